@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include "arena.h"
+#include "custom_print.h"
+
+/* Bump allocator. Memory is handed out from large blocks and is only
+   released all at once by arena_reset, so the many short-lived strings
+   and arrays created while a command line is parsed and expanded cost a
+   pointer increment each instead of a malloc/free pair. */
+
+#define ARENA_BLOCK_SIZE 8192
+#define ARENA_ALIGN (sizeof(void *) > sizeof(double) ? sizeof(void *) : sizeof(double))
+
+/* Tokens, expansions and jobs of the command line being executed.
+   Jobs that outlive the line are promoted to the heap before it is reset. */
+Arena line_arena = {NULL, 0, 0, 0, NULL};
+
+size_t _align(size_t size)
+{
+    return (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+/* Start a new block that can hold at least size bytes. */
+void _arena_new_block(Arena *a, size_t size)
+{
+    size_t block_size = a->block_size ? a->block_size : ARENA_BLOCK_SIZE;
+    Arena_Block *block;
+    if (size > block_size)
+        block_size = size;
+    if (a->spare && a->spare->size >= block_size)
+    {
+        block = a->spare;
+        a->spare = NULL;
+        block->used = 0;
+        block->next = a->current;
+        a->current = block;
+        return;
+    }
+    block = malloc(sizeof(Arena_Block) + block_size);
+    if (!block)
+    {
+        my_fprintf(stderr, "psh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    block->size = block_size;
+    block->used = 0;
+    block->next = a->current;
+    a->current = block;
+    a->blocks++;
+}
+
+/* Allocate size bytes. The memory is valid until the arena is reset. */
+void *arena_alloc(Arena *a, size_t size)
+{
+    void *ptr;
+    size = _align(size ? size : 1);
+    if (!a->current || a->current->size - a->current->used < size)
+        _arena_new_block(a, size);
+    ptr = a->current->data + a->current->used;
+    a->current->used += size;
+    a->allocations++;
+    return ptr;
+}
+
+/* Resize an allocation of old_size bytes. The last allocation grows in place
+   when the block has room, anything else is copied. */
+void *arena_grow(Arena *a, void *ptr, size_t old_size, size_t new_size)
+{
+    void *new_ptr;
+    if (ptr && a->current)
+    {
+        Arena_Block *block = a->current;
+        size_t offset = (char *)ptr - block->data;
+        if ((char *)ptr >= block->data && offset + _align(old_size ? old_size : 1) == block->used &&
+            offset + _align(new_size) <= block->size)
+        {
+            block->used = offset + _align(new_size);
+            return ptr;
+        }
+    }
+    new_ptr = arena_alloc(a, new_size);
+    if (ptr)
+        memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+    return new_ptr;
+}
+
+char *arena_strndup(Arena *a, const char *str, size_t n)
+{
+    size_t len = strnlen(str, n);
+    char *copy = arena_alloc(a, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+char *arena_strdup(Arena *a, const char *str)
+{
+    return arena_strndup(a, str, strlen(str));
+}
+
+/* Format a string into the arena. */
+char *arena_sprintf(Arena *a, const char *format, ...)
+{
+    va_list args;
+    int len;
+    char *str;
+
+    va_start(args, format);
+    len = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (len < 0)
+        return arena_strdup(a, "");
+
+    str = arena_alloc(a, len + 1);
+    va_start(args, format);
+    vsnprintf(str, len + 1, format, args);
+    va_end(args);
+    return str;
+}
+
+Arena_Mark arena_mark(Arena *a)
+{
+    Arena_Mark mark = {a->current, a->current ? a->current->used : 0};
+    return mark;
+}
+
+/* Release the allocations made since the mark, so that a loop can run its
+   body any number of times in the same memory. The last block released is
+   kept as a spare, for a body that does not fit in what is left of the
+   marked block. */
+void arena_release(Arena *a, Arena_Mark mark)
+{
+    while (a->current != mark.block)
+    {
+        Arena_Block *block = a->current;
+        a->current = block->next;
+        if (a->spare && a->spare->size >= block->size)
+            free(block);
+        else
+        {
+            free(a->spare);
+            a->spare = block;
+        }
+    }
+    if (a->current)
+        a->current->used = mark.used;
+}
+
+/* Release every allocation. The largest block is kept for the next line. */
+void arena_reset(Arena *a)
+{
+    Arena_Block *keep = a->current, *block, *next;
+    for (block = a->current; block; block = block->next)
+        if (block->size > keep->size)
+            keep = block;
+    for (block = a->current; block; block = next)
+    {
+        next = block->next;
+        if (block != keep)
+            free(block);
+    }
+    if (keep)
+    {
+        keep->used = 0;
+        keep->next = NULL;
+    }
+    a->current = keep;
+}
+
+void arena_free(Arena *a)
+{
+    arena_reset(a);
+    free(a->current);
+    free(a->spare);
+    a->current = NULL;
+    a->spare = NULL;
+}
@@ -0,0 +1,42 @@
+#include <stddef.h>
+
+#ifndef ARENA_H
+#define ARENA_H
+
+typedef struct Arena_Block
+{
+    struct Arena_Block *next; /* previously filled block */
+    size_t size;              /* capacity of data */
+    size_t used;
+    char data[];
+} Arena_Block;
+
+typedef struct Arena
+{
+    Arena_Block *current;    /* block allocations are made from */
+    size_t block_size;       /* size of new blocks, 0 for the default */
+    size_t allocations;      /* arena_alloc calls since the arena was created */
+    size_t blocks;           /* blocks allocated with malloc */
+    Arena_Block *spare;      /* block freed by arena_release, reused by the next new block */
+} Arena;
+
+/* Position in an arena to release back to. */
+typedef struct Arena_Mark
+{
+    Arena_Block *block;
+    size_t used;
+} Arena_Mark;
+
+extern Arena line_arena;
+
+void *arena_alloc(Arena *a, size_t size);
+void *arena_grow(Arena *a, void *ptr, size_t old_size, size_t new_size);
+char *arena_strdup(Arena *a, const char *str);
+char *arena_strndup(Arena *a, const char *str, size_t n);
+char *arena_sprintf(Arena *a, const char *format, ...);
+Arena_Mark arena_mark(Arena *a);
+void arena_release(Arena *a, Arena_Mark mark);
+void arena_reset(Arena *a);
+void arena_free(Arena *a);
+
+#endif
@@ -5,11 +5,11 @@
 #include "env.h"
 #include "custom_print.h"
 #include "helpers.h"
+#include "cmd_index.h"
 #include <ctype.h>
 #include <glob.h>
 #include <unistd.h>
 #include <sys/stat.h>
-#include <libgen.h>
 
 #define TOK_BUF_SIZE 256
 
@@ -44,44 +44,6 @@ char *append_star(char *str)
     return new_str;
 }
 
-int cursor_on_token_with_index(char *buffer, int *position, int *cursor_pos, int *tok_start, int *tok_end)
-{
-    int tok_counter = -1;
-    int start = 0, end = 0;
-    for (int i = 0; i <= *position; i++)
-    {
-        if (isspace(buffer[i]))
-        {
-            end = i;
-            if (start != end)
-            {
-                tok_counter++;
-                if (start <= *cursor_pos && *cursor_pos <= end)
-                {
-                    *tok_start = start;
-                    *tok_end = end;
-                    return tok_counter;
-                }
-            }
-            else if (start == end && i == *cursor_pos)
-            {
-                *tok_start = start;
-                return -2;
-            }
-            start = i + 1;
-        }
-        if (i > 0 && !isspace(buffer[i]) && buffer[i] == ';')
-            tok_counter++;
-    }
-    if (buffer[start] != '\0')
-    {
-        *tok_start = start;
-        *tok_end = *position;
-        return ++tok_counter;
-    }
-    return -1;
-}
-
 char **create_argv(char *token)
 {
     glob_t glob_result;
@@ -108,87 +70,10 @@ char **create_argv(char *token)
     return list;
 }
 
-int path_exists(const char *path)
-{
-    struct stat path_stat;
-    return (stat(path, &path_stat) == 0);
-}
-
-char **get_path_directories()
-{
-    char *path_env = getenv("PATH");
-    if (!path_env)
-        return NULL;
-    int count = 1;
-    for (char *p = path_env; *p; p++)
-    {
-        if (*p == ':')
-            count++;
-    }
-    char **directories = malloc((count + 1) * sizeof(char *));
-    if (!directories)
-    {
-        perror("malloc");
-        return NULL;
-    }
-    char *path_copy = strdup(path_env);
-    char *token = strtok(path_copy, ":");
-    int i = 0;
-    while (token)
-    {
-        if (path_exists(token))
-            directories[i++] = strdup(token);
-        token = strtok(NULL, ":");
-    }
-    directories[i] = NULL;
-    free(path_copy);
-    return directories;
-}
-
-void free_directories(char **dir)
-{
-    if (!dir)
-        return;
-    for (int i = 0; dir[i] != NULL; i++)
-        free(dir[i]);
-    free(dir);
-}
-
+/* Commands are looked up in the PATH index, which is rebuilt only when needed. */
 char **create_cmd_argv(const char *pattern)
 {
-    char **directories = get_path_directories();
-    if (!directories)
-    {
-        return NULL;
-    }
-    glob_t globbuf;
-    memset(&globbuf, 0, sizeof(globbuf));
-
-    for (int i = 0; directories[i] != NULL; i++)
-    {
-        char glob_pattern[1024];
-        snprintf(glob_pattern, sizeof(glob_pattern), "%s/%s", directories[i], pattern);
-        int ret = glob(glob_pattern, GLOB_APPEND, NULL, &globbuf);
-        if (ret != 0 && ret != GLOB_NOMATCH)
-        {
-            perror("glob");
-            globfree(&globbuf);
-            return NULL;
-        }
-    }
-    char **results = malloc((globbuf.gl_pathc + 1) * sizeof(char *));
-    if (!results)
-    {
-        perror("malloc");
-        globfree(&globbuf);
-        return NULL;
-    }
-    for (size_t i = 0; i < globbuf.gl_pathc; i++)
-        results[i] = strdup(basename(globbuf.gl_pathv[i]));
-    results[globbuf.gl_pathc] = NULL;
-    globfree(&globbuf);
-    free_directories(directories);
-    return results;
+    return cmd_index_complete(pattern);
 }
 
 int is_executable(const char *file)
@@ -234,48 +119,41 @@ char **create_exec_list(char *pattern)
     return new_list;
 }
 
-void autocomplete(char *buffer, int *position, int *cursor_pos)
+void autocomplete(char **line, size_t *size, int *position, int *cursor_pos)
 {
+    char *buffer = *line;
     if (token_to_complete && tab_count == 0)
     {
         free_tokens(possible_completions);
         free(token_to_complete);
     }
-    char **tokens = tokenize(buffer);
-    int *categories = categorize_tokens(tokens);
+    /* The tokens are in the line arena and are released with the line. */
+    int count;
+    Lex_Token *tokens = lex(&line_arena, buffer, &count);
 
     if (tab_count == 0)
     {
-        int tok_start = -1, tok_end = -1;
-        int token_index = cursor_on_token_with_index(buffer, position, cursor_pos, &tok_start, &tok_end);
-        int tok_category;
-        if (token_index == -1)
+        /* Find the word under the cursor, or the place where a new one starts. */
+        int index = 0;
+        while (index < count && tokens[index].offset + tokens[index].length < *cursor_pos)
+            index++;
+
+        char *token;
+        if (index < count && tokens[index].offset <= *cursor_pos && tokens[index].kind == LEX_WORD)
         {
-            int last_category;
-            for (int i = 0; categories[i] != END; i++)
-                last_category = categories[i];
-            if (last_category == BG_OPER ||
-                last_category == INVERSION ||
-                last_category == PIPE ||
-                last_category == OPER ||
-                last_category == LINE_CONTINUATION)
-                tok_category = CMD;
-            else
-                tok_category = ARG;
+            token = strndup(buffer + tokens[index].offset, tokens[index].length);
+            word_start = tokens[index].offset;
         }
-        else if (token_index == -2)
-            tok_category = ARG;
         else
-            tok_category = categories[token_index];
-
-        // my_printf("index %d\n", token_index);
-
-        char *token = token_index == -1 || token_index == -2 ? strdup("") : strdup(tokens[token_index]);
+        {
+            token = strdup("");
+            word_start = *cursor_pos;
+            /* A new word right after an operator follows it. */
+            if (index < count && tokens[index].offset < *cursor_pos)
+                index++;
+        }
         token_to_complete = append_star(token);
-        word_start = tok_start;
-        if (word_start == -1)
-            word_start = *position;
-        real_tok_category = tok_category;
+        real_tok_category = lex_command_position(tokens, index) ? 0 : 1;
     }
 
     // my_printf("\n");
@@ -303,11 +181,7 @@ void autocomplete(char *buffer, int *position, int *cursor_pos)
             possible_completions = create_argv(token_to_complete);
     }
     else
-    {
-        free(categories);
-        free_tokens(tokens);
         return;
-    }
 
     if (possible_completions != NULL && possible_completions[0] != NULL)
     {
@@ -325,13 +199,6 @@ void autocomplete(char *buffer, int *position, int *cursor_pos)
         int prefix_len = word_start;
         int suffix_len = *position - (word_start + delete_len);
 
-        char prefix[prefix_len + 1];
-        char suffix[suffix_len + 1];
-        strncpy(prefix, buffer, prefix_len);
-        prefix[prefix_len] = '\0';
-        strncpy(suffix, &buffer[word_start + delete_len], suffix_len);
-        suffix[suffix_len] = '\0';
-
         for (int i = *cursor_pos; i > 0; i--)
             printf("\b");
 
@@ -341,7 +208,12 @@ void autocomplete(char *buffer, int *position, int *cursor_pos)
         for (int i = prefix_len + delete_len + suffix_len; i > 0; i--)
             printf("\b");
 
-        snprintf(buffer, 1024, "%s%s%s", prefix, word_to_insert, suffix);
+        /* The line grows as needed, the suffix moves after the new word. */
+        reserve_line(line, size, prefix_len + word_len + suffix_len + 1);
+        buffer = *line;
+        memmove(buffer + word_start + word_len, buffer + word_start + delete_len, suffix_len);
+        memcpy(buffer + word_start, word_to_insert, word_len);
+        buffer[prefix_len + word_len + suffix_len] = '\0';
 
         *cursor_pos = word_start + word_len;
         *position = strlen(buffer);
@@ -351,7 +223,5 @@ void autocomplete(char *buffer, int *position, int *cursor_pos)
             printf("\b");
     }
 
-    free_tokens(tokens);
-    free(categories);
     return;
 }
\ No newline at end of file
@@ -1,3 +1,3 @@
-void autocomplete(char *buffer, int *position, int *cursor_pos);
+void autocomplete(char **line, size_t *size, int *position, int *cursor_pos);
 void free_possible_completions();
 void free_token_to_complete();
\ No newline at end of file
@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "batch.h"
+#include "main.h"
+#include "env.h"
+#include "helpers.h"
+#include "arena.h"
+#include "job_table.h"
+#include "custom_print.h"
+
+/* Argument lists longer than exec takes. Before a process is launched its
+   arguments, together with the environment, are checked against ARG_MAX,
+   so an oversized expansion is reported without forking.
+
+   With PSH_AUTOBATCH set, an oversized simple command is split the way
+   xargs splits its input instead: the words before and after the ones
+   that expanded to several words go to every batch, and the expanded
+   words are shared out among as few batches as fit. PSH_AUTOBATCH=N runs
+   up to N batches at a time, as the processes of one job. */
+
+#define ARG_HEADROOM 2048          /* left for the loader, as xargs does */
+#define ARG_STRLEN_MAX (32 * 4096) /* longest single argument on Linux */
+
+extern int last_proc_exit_status;
+
+long arg_max = 0;
+
+/* Return the room left for arguments by the environment. */
+long _arg_limit()
+{
+    if (arg_max == 0 && (arg_max = sysconf(_SC_ARG_MAX)) <= 0)
+        arg_max = 131072;
+    return arg_max - env_environ_size() - ARG_HEADROOM;
+}
+
+long _arg_size(const char *arg)
+{
+    return strlen(arg) + 1 + sizeof(char *);
+}
+
+/* Return 1 if exec can take the arguments. */
+int argv_fits(char **argv)
+{
+    long limit = _arg_limit(), size = sizeof(char *);
+    for (; *argv; argv++)
+    {
+        size_t length = strlen(*argv);
+        size += length + 1 + sizeof(char *);
+        if (length >= ARG_STRLEN_MAX || size > limit)
+            return 0;
+    }
+    return 1;
+}
+
+/* Return the number of batches to run at once, 0 if batching is off. */
+int autobatch_width()
+{
+    char *value = psh_getenv("PSH_AUTOBATCH");
+    int width = value ? atoi(value) : 0;
+    return width > 0 ? width : 0;
+}
+
+/* Count the words of the command, from the first one on in the given
+   direction, that expanded to exactly one word each. */
+int _fixed_words(const int *counts, int from, int step, int limit)
+{
+    int n = 0;
+    for (int i = from; n < limit && counts[i] == 1; i += step)
+        n++;
+    return n;
+}
+
+/* Record which arguments of the process go to every batch, from the
+   number of words each of its n command words expanded to. */
+void batch_fixed_words(process *p, const int *counts, int n)
+{
+    p->batch_head = _fixed_words(counts, 0, 1, n);
+    p->batch_tail = _fixed_words(counts, n - 1, -1, n - p->batch_head);
+}
+
+/* Run the single process of the job as batches of its arguments. The
+   status is that of the first batch that failed. */
+void run_batched(job *j)
+{
+    process *p = j->first_process, **link;
+    int argc = count_elem_in_list(p->argv), head = p->batch_head, tail = p->batch_tail;
+    int width = autobatch_width(), next = head, end = argc - tail, status = 0;
+    long limit = _arg_limit(), fixed = sizeof(char *);
+
+    for (int i = 0; i < argc; i++)
+        if (i < head || i >= end)
+            fixed += _arg_size(p->argv[i]);
+
+    /* Every batch adds to the files the command redirects to.  */
+    if (p->outfile && !p->append_mode)
+        close(open(p->outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    if (p->errfile)
+        close(open(p->errfile, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    p->append_mode = 1;
+    j->batched = 1;
+
+    while (next < end)
+    {
+        link = &j->first_process;
+        for (int n = 0; n < width && next < end; n++)
+        {
+            process *q = arena_alloc(&line_arena, sizeof(process));
+            long size = fixed;
+            int start = next, k = 0;
+
+            /* An argument too long on its own is reported by launch_job.  */
+            while (next < end && (next == start || size + _arg_size(p->argv[next]) <= limit))
+                size += _arg_size(p->argv[next++]);
+
+            *q = *p;
+            q->argv = arena_alloc(&line_arena, (head + next - start + tail + 1) * sizeof(char *));
+            for (int i = 0; i < head; i++)
+                q->argv[k++] = p->argv[i];
+            for (int i = start; i < next; i++)
+                q->argv[k++] = p->argv[i];
+            for (int i = end; i < argc; i++)
+                q->argv[k++] = p->argv[i];
+            q->argv[k] = NULL;
+            q->next = NULL;
+            *link = q;
+            link = &q->next;
+        }
+
+        j->pgid = 0;
+        j->notified = 0;
+        launch_job(j, 1);
+        if (!job_is_completed(j))
+        {
+            /* Stopped, the arguments left are not run.  */
+            if (next < end)
+                my_fprintf(stderr, "psh: %s: stopped, %d arguments left out\n", p->argv[0], end - next);
+            return;
+        }
+        for (process *q = j->first_process; q; q = q->next)
+            if (q->exit_status != 0 && status == 0)
+                status = q->exit_status;
+        unregister_job(j);
+    }
+    last_proc_exit_status = status;
+}
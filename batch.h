@@ -0,0 +1,11 @@
+#include "data_structs.h"
+
+#ifndef BATCH_H
+#define BATCH_H
+
+int argv_fits(char **argv);
+int autobatch_width();
+void batch_fixed_words(process *p, const int *counts, int n);
+void run_batched(job *j);
+
+#endif
@@ -0,0 +1,349 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "brace.h"
+#include "arena.h"
+#include "custom_print.h"
+
+/* Brace expansion. A word is parsed once into a sequence of parts: text,
+   lists of alternatives, each a sequence itself, and ranges. The words are
+   then generated one at a time into a scratch buffer and handed to the
+   caller as they are made, so {1..1000000} never exists as a list of
+   lists, and {a,b}{1..3} is walked as a product without building the
+   intermediate words. Quoted and escaped braces stay as they are. */
+
+#define BRACE_TEXT 0
+#define BRACE_LIST 1
+#define BRACE_RANGE 2
+
+#define WORD_LIST_INITIAL_SIZE 16
+
+typedef struct Brace_Seq Brace_Seq;
+
+typedef struct Brace_Part
+{
+    int kind;
+    const char *text; /* BRACE_TEXT */
+    size_t length;
+    Brace_Seq **alternatives; /* BRACE_LIST */
+    int count;
+    long first, last, step; /* BRACE_RANGE */
+    int width;              /* zero padded width of the numbers */
+    int letters;            /* a range of characters */
+} Brace_Part;
+
+struct Brace_Seq
+{
+    Brace_Part *parts;
+    int count;
+    int size;
+};
+
+/* Rest of the enclosing sequences to generate after a list alternative. */
+typedef struct Brace_Frame
+{
+    Brace_Seq *seq;
+    int index;
+    struct Brace_Frame *next;
+} Brace_Frame;
+
+typedef struct Brace_Gen
+{
+    char *data; /* word being generated */
+    size_t length;
+    size_t size;
+    Word_List *out;
+    brace_emit emit;
+} Brace_Gen;
+
+void word_list_push(Word_List *list, char *word)
+{
+    if (list->count == list->size)
+    {
+        int size = list->size ? 2 * list->size : WORD_LIST_INITIAL_SIZE;
+        list->words = arena_grow(&line_arena, list->words, list->size * sizeof(char *), size * sizeof(char *));
+        list->size = size;
+    }
+    list->words[list->count++] = word;
+}
+
+/* Return the index after the character at i, skipping quoted text and
+   escaped characters as a whole. */
+size_t _brace_skip(const char *s, size_t i, size_t n)
+{
+    if (s[i] == '\\')
+        return i + 2 < n ? i + 2 : n;
+    if (s[i] == '"' || s[i] == '\'')
+    {
+        char quote = s[i++];
+        while (i < n && s[i] != quote)
+            i++;
+        return i < n ? i + 1 : n;
+    }
+    return i + 1;
+}
+
+/* Return the index of the brace closing the one at open, or -1. */
+long _brace_close(const char *s, size_t open, size_t n, int *commas)
+{
+    int depth = 0;
+    *commas = 0;
+    for (size_t i = open + 1; i < n; i = _brace_skip(s, i, n))
+    {
+        if (s[i] == '{')
+            depth++;
+        else if (s[i] == '}' && depth-- == 0)
+            return i;
+        else if (s[i] == ',' && depth == 0)
+            (*commas)++;
+    }
+    return -1;
+}
+
+Brace_Part *_brace_add(Brace_Seq *seq, int kind)
+{
+    Brace_Part *part;
+    if (seq->count == seq->size)
+    {
+        int size = seq->size ? 2 * seq->size : 4;
+        seq->parts = arena_grow(&line_arena, seq->parts, seq->size * sizeof(Brace_Part), size * sizeof(Brace_Part));
+        seq->size = size;
+    }
+    part = &seq->parts[seq->count++];
+    memset(part, 0, sizeof(Brace_Part));
+    part->kind = kind;
+    return part;
+}
+
+/* Parse an endpoint or step of a range. Return its length, 0 if there is
+   none. */
+size_t _brace_number(const char *s, size_t n, long *value, int *padded)
+{
+    size_t i = (n > 0 && (s[0] == '-' || s[0] == '+')) ? 1 : 0, digits = i;
+    while (i < n && isdigit((unsigned char)s[i]))
+        i++;
+    if (i == digits || i - digits > 18)
+        return 0;
+    *value = strtol(s, NULL, 10);
+    *padded = s[digits] == '0' && i - digits > 1;
+    return i;
+}
+
+/* Parse {first..last} or {first..last..step} of numbers or letters. */
+int _brace_range(Brace_Seq *seq, const char *s, size_t n)
+{
+    const char *dots = NULL, *end = s + n;
+    long first, last, step = 1;
+    int pad_first = 0, pad_last = 0, pad_step, letters = 0;
+    size_t len_first, len_last = 0;
+
+    for (const char *c = s; c + 1 < end; c++)
+        if (c[0] == '.' && c[1] == '.')
+        {
+            dots = c;
+            break;
+        }
+    if (!dots)
+        return 0;
+
+    len_first = dots - s;
+    if (len_first == 1 && isalpha((unsigned char)s[0]) && dots + 3 <= end &&
+        isalpha((unsigned char)dots[2]) && (dots + 3 == end || dots[3] == '.'))
+    {
+        first = s[0], last = dots[2], letters = 1;
+        s = dots + 3;
+    }
+    else
+    {
+        if (_brace_number(s, len_first, &first, &pad_first) != len_first)
+            return 0;
+        s = dots + 2;
+        for (len_last = 0; s + len_last < end && s[len_last] != '.'; len_last++)
+            ;
+        if (_brace_number(s, len_last, &last, &pad_last) != len_last)
+            return 0;
+        s += len_last;
+    }
+    if (s != end)
+    {
+        if (end - s < 3 || s[0] != '.' || s[1] != '.' ||
+            _brace_number(s + 2, end - s - 2, &step, &pad_step) != (size_t)(end - s - 2))
+            return 0;
+    }
+
+    Brace_Part *part = _brace_add(seq, BRACE_RANGE);
+    part->first = first;
+    part->last = last;
+    part->step = step < 0 ? -step : (step ? step : 1);
+    part->letters = letters;
+    if (pad_first || pad_last)
+        part->width = len_first > len_last ? len_first : len_last;
+    return 1;
+}
+
+void _brace_text(Brace_Seq *seq, const char *s, size_t n)
+{
+    Brace_Part *part;
+    if (n == 0)
+        return;
+    part = _brace_add(seq, BRACE_TEXT);
+    part->text = s;
+    part->length = n;
+}
+
+Brace_Seq *_brace_parse(const char *s, size_t n, int *expands);
+
+/* Parse the alternatives of the list between open and close. */
+void _brace_list(Brace_Seq *seq, const char *s, size_t open, size_t close, int commas, int *expands)
+{
+    Brace_Part *part = _brace_add(seq, BRACE_LIST);
+    size_t start = open + 1;
+    int depth = 0;
+
+    part->alternatives = arena_alloc(&line_arena, (commas + 1) * sizeof(Brace_Seq *));
+    for (size_t i = start; i <= close; i = _brace_skip(s, i, close + 1))
+    {
+        if (s[i] == '{')
+            depth++;
+        else if (s[i] == '}' && depth > 0)
+            depth--;
+        else if ((s[i] == ',' && depth == 0) || i == close)
+        {
+            part->alternatives[part->count++] = _brace_parse(s + start, i - start, expands);
+            start = i + 1;
+        }
+    }
+}
+
+/* Parse a word into a sequence of parts. Set *expands if it has a list
+   or a range. */
+Brace_Seq *_brace_parse(const char *s, size_t n, int *expands)
+{
+    Brace_Seq *seq = arena_alloc(&line_arena, sizeof(Brace_Seq));
+    size_t i = 0, text = 0;
+
+    seq->parts = NULL, seq->count = 0, seq->size = 0;
+    while (i < n)
+    {
+        if (s[i] == '{' && (i == 0 || s[i - 1] != '$'))
+        {
+            int commas;
+            long close = _brace_close(s, i, n, &commas);
+            if (close > 0)
+            {
+                int count = seq->count;
+                _brace_text(seq, s + text, i - text);
+                if (commas)
+                    _brace_list(seq, s, i, close, commas, expands);
+                if (commas || _brace_range(seq, s + i + 1, close - i - 1))
+                {
+                    *expands = 1;
+                    i = text = close + 1;
+                    continue;
+                }
+                /* Not an expansion, the brace is text. */
+                seq->count = count;
+            }
+            i++;
+            continue;
+        }
+        i = _brace_skip(s, i, n);
+    }
+    _brace_text(seq, s + text, n - text);
+    return seq;
+}
+
+void _brace_append(Brace_Gen *g, const char *text, size_t length)
+{
+    if (g->length + length + 1 > g->size)
+    {
+        size_t size = g->size ? g->size : 64;
+        while (g->length + length + 1 > size)
+            size *= 2;
+        g->data = realloc(g->data, size);
+        if (!g->data)
+        {
+            my_fprintf(stderr, "psh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        g->size = size;
+    }
+    memcpy(g->data + g->length, text, length);
+    g->length += length;
+}
+
+/* Generate the words of the sequence from part i on, followed by the rest
+   of the enclosing sequences. */
+void _brace_generate(Brace_Gen *g, Brace_Seq *seq, int i, Brace_Frame *rest)
+{
+    size_t length = g->length;
+    Brace_Part *part;
+
+    if (i == seq->count)
+    {
+        if (rest)
+            _brace_generate(g, rest->seq, rest->index, rest->next);
+        else
+            g->emit(arena_strndup(&line_arena, g->data ? g->data : "", g->length), g->out);
+        return;
+    }
+
+    part = &seq->parts[i];
+    if (part->kind == BRACE_TEXT)
+    {
+        _brace_append(g, part->text, part->length);
+        _brace_generate(g, seq, i + 1, rest);
+    }
+    else if (part->kind == BRACE_LIST)
+    {
+        Brace_Frame frame = {seq, i + 1, rest};
+        for (int k = 0; k < part->count; k++)
+        {
+            g->length = length;
+            _brace_generate(g, part->alternatives[k], 0, &frame);
+        }
+    }
+    else
+    {
+        long value = part->first, step = part->first <= part->last ? part->step : -part->step;
+        unsigned long count = (part->first <= part->last ? (unsigned long)part->last - part->first
+                                                         : (unsigned long)part->first - part->last) / part->step + 1;
+        char number[32];
+        for (; count > 0; count--, value += step)
+        {
+            g->length = length;
+            if (part->letters)
+            {
+                number[0] = (char)value;
+                _brace_append(g, number, 1);
+            }
+            else
+                _brace_append(g, number, snprintf(number, sizeof(number), "%0*ld", part->width, value));
+            _brace_generate(g, seq, i + 1, rest);
+        }
+    }
+    g->length = length;
+}
+
+/* Return 1 if the word may need brace expansion. */
+int brace_expandable(const char *word)
+{
+    const char *open = strchr(word, '{');
+    return open && strchr(open, '}');
+}
+
+/* Hand each word of the brace expansion of the word to emit.
+   Return 0, emitting nothing, if the word has no expansion. */
+int brace_expand(const char *word, Word_List *out, brace_emit emit)
+{
+    Brace_Gen g = {NULL, 0, 0, out, emit};
+    int expands = 0;
+    Brace_Seq *seq = _brace_parse(word, strlen(word), &expands);
+
+    if (!expands)
+        return 0;
+    _brace_generate(&g, seq, 0, NULL);
+    free(g.data);
+    return 1;
+}
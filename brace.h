@@ -0,0 +1,21 @@
+#include <stddef.h>
+
+#ifndef BRACE_H
+#define BRACE_H
+
+/* Words of an expanded command, growing in the line arena. */
+typedef struct Word_List
+{
+    char **words;
+    int count;
+    int size;
+} Word_List;
+
+/* Takes each word generated by brace_expand. */
+typedef void (*brace_emit)(char *word, Word_List *out);
+
+void word_list_push(Word_List *list, char *word);
+int brace_expandable(const char *word);
+int brace_expand(const char *word, Word_List *out, brace_emit emit);
+
+#endif
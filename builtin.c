@@ -8,9 +8,15 @@
 #include "env.h"
 #include "custom_print.h"
 #include "history.h"
+#include "prompt.h"
+#include "cmd_hash.h"
+#include "job_table.h"
+#include "parse_cache.h"
+#include "vm.h"
+#include "utilities.h"
 
 extern job *first_job;
-extern Env *first_env;
+extern int last_proc_exit_status;
 
 /* Change current directory. */
 int psh_cd(char **args)
@@ -24,7 +30,10 @@ int psh_cd(char **args)
         if (chdir(args[1]) != 0)
         {
             my_perror("psh");
+            last_proc_exit_status = 1;
         }
+        else
+            update_cwd();
     }
     return 1;
 }
@@ -56,6 +65,9 @@ int psh_exit(char **args)
         j2 = j2->next;
     }
 
+    /* The status a script exits with. */
+    if (args[1])
+        last_proc_exit_status = atoi(args[1]);
     return 0;
 }
 
@@ -96,44 +108,23 @@ job *_find_last_stopped_or_bg_job()
     return last_stopped_or_bg;
 }
 
-/* Find the last job that was stopped with Ctrl + Z or SIGTSTP. */
-job *_find_last_stopped_job()
-{
-    job *j = first_job;
-    job *last_stopped = NULL;
-
-    while (j)
-    {
-        if (job_is_stopped(j))
-            last_stopped = j;
-        j = j->next;
-    }
-    return last_stopped;
-}
-
-/* List all currently running or stopped jobs. */
+/* List all currently running or stopped jobs, in job number order. */
 int psh_jobs(char **args)
 {
-    int counter = 1;
-    job *j = first_job;
-    job *last_stopped = _find_last_stopped_job();
+    job *current = _find_last_stopped_or_bg_job();
     char *stopped_or_running;
     char *plus_or_minus;
-    while (j)
+    for (int number = 1; number <= max_job_number(); number++)
     {
-        if (j->pgid != 0)
-        {
-            if (job_is_stopped(j))
-                stopped_or_running = "stopped";
-            else
-                stopped_or_running = "running";
-            if (last_stopped != NULL && j->pgid == last_stopped->pgid)
-                plus_or_minus = "+";
-            else if (last_stopped != NULL)
-                plus_or_minus = "-";
-            my_printf("[%d] %s %s %d %s\n", counter++, plus_or_minus, stopped_or_running, j->pgid, j->command);
-        }
-        j = j->next;
+        job *j = find_job_by_number(number);
+        if (j == NULL)
+            continue;
+        if (job_is_stopped(j))
+            stopped_or_running = "stopped";
+        else
+            stopped_or_running = "running";
+        plus_or_minus = j == current ? "+" : "-";
+        my_printf("[%d] %s %s %d %s\n", j->number, plus_or_minus, stopped_or_running, j->pgid, j->command);
     }
     return 1;
 }
@@ -167,30 +158,6 @@ int _check_if_str_is_valid(char *str)
     return num;
 }
 
-/* If a job is stopped and has the same index as the one provided, return it.
-   Else return NULL. */
-job *_find_job_by_index(int index)
-{
-    job *temp = first_job;
-    int counter = 1;
-    while (temp)
-    {
-        if (temp->pgid != 0)
-        {
-            if (counter == index)
-            {
-                // if (job_is_stopped(temp))
-                //     return temp;
-                // else
-                //     return NULL;
-                return temp;
-            }
-            counter++;
-        }
-    }
-    return NULL;
-}
-
 /* Bring a job to the foreground. */
 int psh_fg(char **args)
 {
@@ -209,8 +176,8 @@ int psh_fg(char **args)
 
         if (args[i][0] == '%')
         {
-            job *j = _find_job_by_index(num);
-            continue_job(j, 1, job_is_stopped(j)); // index
+            job *j = find_job_by_number(num);
+            continue_job(j, 1, job_is_stopped(j)); // job number
         }
         else
         {
@@ -239,8 +206,8 @@ int psh_bg(char **args)
 
         if (args[i][0] == '%')
         {
-            job *j = _find_job_by_index(num);
-            continue_job(j, 0, job_is_stopped(j)); // index
+            job *j = find_job_by_number(num);
+            continue_job(j, 0, job_is_stopped(j)); // job number
         }
         else
         {
@@ -257,6 +224,7 @@ int psh_source(char **argv)
 {
     free_env_list();
     read_config_file();
+    compile_prompts();
     return 1;
 }
 
@@ -280,7 +248,11 @@ int psh_set(char **argv)
                 my_fprintf(stderr, "Argument must be of type NAME=VALUE, but was %s\n", argv[i]);
                 break;
             }
-            psh_setenv(arr[0], arr[1]);
+            if (env_assign(arr[0], arr[1]) < 0)
+                last_proc_exit_status = 1;
+            free(arr[0]);
+            free(arr[1]);
+            free(arr);
         }
         else
         {
@@ -306,6 +278,204 @@ int psh_unset(char **argv)
     return 1;
 }
 
+/* Give each NAME[=VALUE] of argv the attributes, as a local of the running
+   function if local is set. */
+void _declare_names(char **argv, int flags, int local)
+{
+    for (int i = 0; argv[i] != NULL; i++)
+    {
+        char *name = argv[i], *value = strchr(name, '=');
+        if (value)
+            *value++ = '\0';
+        if (*name == '\0')
+        {
+            my_fprintf(stderr, "psh: %s: not a valid identifier\n", argv[i]);
+            last_proc_exit_status = 1;
+            continue;
+        }
+        if (local)
+            env_local(name);
+        env_set_flags(name, flags & ENV_INTEGER);
+        if (value && env_assign(name, value) < 0)
+            last_proc_exit_status = 1;
+        env_set_flags(name, flags);
+    }
+}
+
+int _listed_flags;
+
+void _list_variable(Env *e)
+{
+    if ((e->flags & _listed_flags) != _listed_flags || !e->value)
+        return;
+    my_printf("declare -%s%s%s%s %s=\"%s\"\n", e->flags ? "" : "-",
+              e->flags & ENV_INTEGER ? "i" : "", e->flags & ENV_READONLY ? "r" : "",
+              e->flags & ENV_EXPORT ? "x" : "", e->name, e->value);
+}
+
+/* Declare variables local to the running function. */
+int psh_local(char **argv)
+{
+    if (vm_function_depth == 0)
+    {
+        my_fprintf(stderr, "psh: local: can only be used in a function\n");
+        last_proc_exit_status = 1;
+        return 1;
+    }
+    _declare_names(argv + 1, 0, 1);
+    return 1;
+}
+
+/* Make variables readonly, or list the readonly ones without arguments. */
+int psh_readonly(char **argv)
+{
+    if (argv[1] == NULL)
+    {
+        _listed_flags = ENV_READONLY;
+        env_each(_list_variable);
+        return 1;
+    }
+    _declare_names(argv + 1, ENV_READONLY, 0);
+    return 1;
+}
+
+/* Pass variables to the processes the shell launches, or list the
+   exported ones without arguments. */
+int psh_export(char **argv)
+{
+    if (argv[1] == NULL)
+    {
+        _listed_flags = ENV_EXPORT;
+        env_each(_list_variable);
+        return 1;
+    }
+    _declare_names(argv + 1, ENV_EXPORT, 0);
+    return 1;
+}
+
+/* Set variables with attributes: -i makes them integers, -r readonly and
+   -x exported. In a function the variables are local to it. Without names
+   list the variables having the attributes. */
+int psh_declare(char **argv)
+{
+    int flags = 0, i = 1;
+    for (; argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0'; i++)
+    {
+        for (char *c = argv[i] + 1; *c; c++)
+        {
+            if (*c == 'i')
+                flags |= ENV_INTEGER;
+            else if (*c == 'r')
+                flags |= ENV_READONLY;
+            else if (*c == 'x')
+                flags |= ENV_EXPORT;
+            else
+            {
+                my_fprintf(stderr, "psh: declare: -%c: invalid option\n", *c);
+                last_proc_exit_status = 2;
+                return 1;
+            }
+        }
+    }
+    if (argv[i] == NULL)
+    {
+        _listed_flags = flags;
+        env_each(_list_variable);
+        return 1;
+    }
+    _declare_names(argv + i, flags, vm_function_depth > 0);
+    return 1;
+}
+
+/* Manage the command hash. Without arguments list the remembered commands,
+   -r forgets all of them, -d NAME forgets NAME, -p PATH NAME remembers PATH
+   for NAME, and any other NAME is looked up in PATH and remembered. */
+int psh_hash(char **argv)
+{
+    if (argv[1] == NULL)
+    {
+        hash_print();
+        return 1;
+    }
+    for (int i = 1; argv[i] != NULL; i++)
+    {
+        if (strcmp(argv[i], "-r") == 0)
+            hash_clear();
+        else if (strcmp(argv[i], "-d") == 0 && argv[i + 1] != NULL)
+            hash_forget(argv[++i]);
+        else if (strcmp(argv[i], "-p") == 0 && argv[i + 1] != NULL && argv[i + 2] != NULL)
+        {
+            hash_add(argv[i + 2], argv[i + 1]);
+            i += 2;
+        }
+        else if (argv[i][0] == '-')
+        {
+            my_fprintf(stderr, "psh: hash: invalid usage: %s\n", argv[i]);
+            break;
+        }
+        else if (hash_add(argv[i], NULL) != 0)
+            my_fprintf(stderr, "psh: hash: %s: not found\n", argv[i]);
+    }
+    return 1;
+}
+
+/* Show the parse cache counters and lines, or forget them with -r. */
+int psh_parsecache(char **argv)
+{
+    if (argv[1] == NULL)
+        parse_cache_print();
+    else if (strcmp(argv[1], "-r") == 0)
+        parse_cache_clear(0);
+    else
+        my_fprintf(stderr, "psh: parsecache: invalid usage: %s\n", argv[1]);
+    return 1;
+}
+
+/* Leave or restart the innermost loops, one unless a count is given. */
+int _loop_control(char **argv, int request)
+{
+    int count = argv[1] ? atoi(argv[1]) : 1;
+    if (vm_loop_depth == 0)
+    {
+        my_fprintf(stderr, "psh: %s: only meaningful in a loop\n", argv[0]);
+        return 1;
+    }
+    if (count < 1)
+    {
+        my_fprintf(stderr, "psh: %s: %s: loop count out of range\n", argv[0], argv[1]);
+        last_proc_exit_status = 1;
+        return 1;
+    }
+    vm_pending = request;
+    vm_pending_count = count;
+    return 1;
+}
+
+int psh_break(char **argv)
+{
+    return _loop_control(argv, VM_BREAK);
+}
+
+int psh_continue(char **argv)
+{
+    return _loop_control(argv, VM_CONTINUE);
+}
+
+/* Return from a function, with the last status unless one is given. */
+int psh_return(char **argv)
+{
+    if (vm_function_depth == 0)
+    {
+        my_fprintf(stderr, "psh: return: can only return from a function\n");
+        last_proc_exit_status = 1;
+        return 1;
+    }
+    if (argv[1])
+        last_proc_exit_status = atoi(argv[1]);
+    vm_pending = VM_RETURN;
+    return 1;
+}
+
 // Array of built-in command function pointers
 builtin_func func_arr[] = {
     &psh_cd,
@@ -317,7 +487,23 @@ builtin_func func_arr[] = {
     &psh_source,
     &psh_set,
     &psh_unset,
-    &psh_history
+    &psh_history,
+    &psh_hash,
+    &psh_parsecache,
+    &psh_break,
+    &psh_continue,
+    &psh_return,
+    &psh_local,
+    &psh_readonly,
+    &psh_declare,
+    &psh_export,
+    &psh_echo,
+    &psh_printf,
+    &psh_test,
+    &psh_test,
+    &psh_true,
+    &psh_false,
+    &psh_pwd
     };
 
 // Array of built-in command strings
@@ -331,10 +517,43 @@ char *builtin_str[] = {
     "source",
     "set",
     "unset",
-    "history"
+    "history",
+    "hash",
+    "parsecache",
+    "break",
+    "continue",
+    "return",
+    "local",
+    "readonly",
+    "declare",
+    "export",
+    "echo",
+    "printf",
+    "test",
+    "[",
+    "true",
+    "false",
+    "pwd"
     };
 
 int psh_num_builtins()
 {
     return sizeof(builtin_str) / sizeof(char *);
-}
\ No newline at end of file
+}
+
+/* Return the builtin with the name, or NULL if there is none. */
+builtin_func find_builtin(const char *name)
+{
+    for (int i = 0; i < psh_num_builtins(); i++)
+        if (strcmp(name, builtin_str[i]) == 0)
+            return func_arr[i];
+    return NULL;
+}
+
+/* Check if the builtin acts on the shell itself: exit, return, break and
+   continue. In a pipeline these run in a child, as in a subshell. */
+int builtin_controls_shell(builtin_func builtin)
+{
+    return builtin == &psh_exit || builtin == &psh_return ||
+           builtin == &psh_break || builtin == &psh_continue;
+}
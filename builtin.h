@@ -9,9 +9,12 @@ extern char *builtin_str[];
 extern builtin_func func_arr[];
 
 int psh_num_builtins();
+builtin_func find_builtin(const char *name);
+int builtin_controls_shell(builtin_func builtin);
 int psh_cd(char **args);
 int psh_help(char **args);
 int psh_exit(char **args);
+int psh_return(char **argv);
 job *_find_last_bg_job();
 
 #endif
\ No newline at end of file
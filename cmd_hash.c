@@ -0,0 +1,309 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "cmd_hash.h"
+#include "env.h"
+#include "custom_print.h"
+
+/* Command hash. Maps a command name to the absolute path of the executable
+   found in PATH, so the shell searches PATH once per command instead of
+   libc trying every PATH directory on each launch. Names that are not found
+   are cached too, which lets 'command not found' be reported before forking.
+   Entries belong to a PATH generation, which changes whenever PATH does. */
+
+#define HASH_INITIAL_SIZE 64
+
+typedef struct Hash_Entry
+{
+    struct Hash_Entry *next;
+    char *name;
+    char *path;                 /* NULL if the command was not found */
+    unsigned long hash;
+    int hits;
+    int generation;             /* PATH generation the entry belongs to */
+    struct timespec path_mtime; /* newest PATH directory mtime for missing commands */
+} Hash_Entry;
+
+Hash_Entry **hash_table = NULL;
+int hash_size = 0, hash_count = 0;
+char *hashed_path_var = NULL;
+int path_generation = 0;
+char *uncached_path = NULL; /* last command found through a relative PATH entry */
+
+unsigned long _hash_string(const char *str)
+{
+    unsigned long hash = 5381;
+    while (*str)
+        hash = hash * 33 + (unsigned char)*str++;
+    return hash;
+}
+
+/* Bump the PATH generation if PATH changed since the last lookup. */
+void _check_path_generation(const char *path)
+{
+    if (hashed_path_var && strcmp(hashed_path_var, path) == 0)
+        return;
+    free(hashed_path_var);
+    hashed_path_var = strdup(path);
+    path_generation++;
+}
+
+/* Return the newest modification time of the PATH directories. */
+struct timespec _newest_path_mtime(const char *path)
+{
+    struct timespec newest = {0, 0};
+    char *path_copy = strdup(path);
+    char *saveptr;
+    struct stat st;
+
+    for (char *dir = strtok_r(path_copy, ":", &saveptr); dir; dir = strtok_r(NULL, ":", &saveptr))
+    {
+        if (stat(dir, &st) != 0)
+            continue;
+        if (st.st_mtim.tv_sec > newest.tv_sec ||
+            (st.st_mtim.tv_sec == newest.tv_sec && st.st_mtim.tv_nsec > newest.tv_nsec))
+            newest = st.st_mtim;
+    }
+    free(path_copy);
+    return newest;
+}
+
+/* Search PATH for an executable with the given name. Return a malloc'ed
+   absolute path, or NULL if there is none. Set *relative if the command was
+   found through a relative PATH entry, in which case it must not be cached. */
+char *_search_path(const char *name, const char *path, int *relative)
+{
+    char candidate[PATH_MAX];
+    struct stat st;
+    const char *dir = path;
+
+    *relative = 0;
+    while (1)
+    {
+        const char *end = strchr(dir, ':');
+        int len = end ? end - dir : (int)strlen(dir);
+
+        if (len == 0)
+            snprintf(candidate, sizeof(candidate), "./%s", name);
+        else
+            snprintf(candidate, sizeof(candidate), "%.*s/%s", len, dir, name);
+
+        if (access(candidate, X_OK) == 0 && stat(candidate, &st) == 0 && S_ISREG(st.st_mode))
+        {
+            *relative = candidate[0] != '/';
+            return strdup(candidate);
+        }
+        if (!end)
+            return NULL;
+        dir = end + 1;
+    }
+}
+
+/* Double the number of buckets. */
+void _grow_hash_table()
+{
+    int new_size = hash_size ? hash_size * 2 : HASH_INITIAL_SIZE;
+    Hash_Entry **new_table = calloc(new_size, sizeof(Hash_Entry *));
+    if (!new_table)
+    {
+        my_fprintf(stderr, "psh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < hash_size; i++)
+    {
+        Hash_Entry *e = hash_table[i], *next;
+        for (; e; e = next)
+        {
+            next = e->next;
+            e->next = new_table[e->hash % new_size];
+            new_table[e->hash % new_size] = e;
+        }
+    }
+    free(hash_table);
+    hash_table = new_table;
+    hash_size = new_size;
+}
+
+Hash_Entry *_find_entry(const char *name, unsigned long hash)
+{
+    if (!hash_table)
+        return NULL;
+    for (Hash_Entry *e = hash_table[hash % hash_size]; e; e = e->next)
+        if (e->hash == hash && strcmp(e->name, name) == 0)
+            return e;
+    return NULL;
+}
+
+/* Store path for name, replacing the previous entry. Takes ownership of path. */
+Hash_Entry *_store_entry(const char *name, char *path)
+{
+    unsigned long hash = _hash_string(name);
+    Hash_Entry *e = _find_entry(name, hash);
+
+    if (!e)
+    {
+        if (hash_count >= hash_size)
+            _grow_hash_table();
+        e = calloc(1, sizeof(Hash_Entry));
+        if (!e)
+        {
+            my_fprintf(stderr, "psh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        e->name = strdup(name);
+        e->hash = hash;
+        e->next = hash_table[hash % hash_size];
+        hash_table[hash % hash_size] = e;
+        hash_count++;
+    }
+    else
+        free(e->path);
+    e->path = path;
+    e->hits = 0;
+    e->generation = path_generation;
+    return e;
+}
+
+/* Return the path of the executable to run for name, or NULL if the command
+   does not exist. Names containing a slash are returned as they are.
+   The returned string is owned by the hash table. */
+char *hash_lookup(const char *name)
+{
+    char *path_var = psh_getenv("PATH");
+    Hash_Entry *e;
+    char *path;
+    int relative;
+
+    if (strchr(name, '/'))
+        return (char *)name;
+    if (!path_var)
+        path_var = "/usr/local/bin:/usr/bin:/bin";
+    _check_path_generation(path_var);
+
+    e = _find_entry(name, _hash_string(name));
+    if (e && e->generation == path_generation)
+    {
+        if (e->path)
+        {
+            e->hits++;
+            return e->path;
+        }
+        /* Missing commands stay missing until a PATH directory changes. */
+        struct timespec newest = _newest_path_mtime(path_var);
+        if (newest.tv_sec == e->path_mtime.tv_sec && newest.tv_nsec == e->path_mtime.tv_nsec)
+            return NULL;
+    }
+
+    path = _search_path(name, path_var, &relative);
+    if (path && relative)
+    {
+        /* Relative PATH entries depend on the current directory. */
+        hash_forget(name);
+        free(uncached_path);
+        uncached_path = path;
+        return path;
+    }
+    e = _store_entry(name, path);
+    if (!path)
+        e->path_mtime = _newest_path_mtime(path_var);
+    else
+        e->hits++;
+    return e->path;
+}
+
+/* Add name to the table. If path is NULL, it is searched for in PATH.
+   Return 0 on success, -1 if the command was not found. */
+int hash_add(const char *name, const char *path)
+{
+    char *path_var = psh_getenv("PATH");
+    if (!path_var)
+        path_var = "/usr/local/bin:/usr/bin:/bin";
+    _check_path_generation(path_var);
+
+    if (path)
+    {
+        _store_entry(name, strdup(path));
+        return 0;
+    }
+    hash_forget(name);
+    if (!hash_lookup(name))
+    {
+        hash_forget(name);
+        return -1;
+    }
+    Hash_Entry *e = _find_entry(name, _hash_string(name));
+    if (e)
+        e->hits = 0;
+    return 0;
+}
+
+/* Remove name from the table. Used when its executable disappears. */
+void hash_forget(const char *name)
+{
+    unsigned long hash = _hash_string(name);
+    Hash_Entry **link;
+
+    if (!hash_table)
+        return;
+    for (link = &hash_table[hash % hash_size]; *link; link = &(*link)->next)
+    {
+        Hash_Entry *e = *link;
+        if (e->hash == hash && strcmp(e->name, name) == 0)
+        {
+            *link = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            hash_count--;
+            return;
+        }
+    }
+}
+
+/* Remove every entry. */
+void hash_clear()
+{
+    for (int i = 0; i < hash_size; i++)
+    {
+        Hash_Entry *e = hash_table[i], *next;
+        for (; e; e = next)
+        {
+            next = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+        }
+    }
+    free(hash_table);
+    hash_table = NULL;
+    hash_size = 0, hash_count = 0;
+    free(hashed_path_var);
+    hashed_path_var = NULL;
+    free(uncached_path);
+    uncached_path = NULL;
+}
+
+/* List the remembered commands of the current PATH generation. */
+void hash_print()
+{
+    int header = 0;
+    for (int i = 0; i < hash_size; i++)
+    {
+        for (Hash_Entry *e = hash_table[i]; e; e = e->next)
+        {
+            if (!e->path || e->generation != path_generation)
+                continue;
+            if (!header)
+            {
+                my_printf("hits\tcommand\n");
+                header = 1;
+            }
+            my_printf("%4d\t%s\n", e->hits, e->path);
+        }
+    }
+    if (!header)
+        my_printf("hash: hash table empty\n");
+}
@@ -0,0 +1,10 @@
+#ifndef CMD_HASH_H
+#define CMD_HASH_H
+
+char *hash_lookup(const char *name);
+int hash_add(const char *name, const char *path);
+void hash_forget(const char *name);
+void hash_clear();
+void hash_print();
+
+#endif
@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
+#include "cmd_index.h"
+#include "env.h"
+#include "custom_print.h"
+
+/* In-memory index of the commands found in PATH, used by autocompletion.
+   Names are kept in a single sorted array, each name appearing once with the
+   first directory that provides it, as PATH precedence dictates. The index is
+   rebuilt only when PATH changes or one of its directories is modified. */
+
+typedef struct Cmd_Entry
+{
+    size_t name;   /* offset of the name in the name pool */
+    int dir;       /* index of the providing directory in PATH */
+} Cmd_Entry;
+
+typedef struct Path_Dir
+{
+    char *path;
+    struct timespec mtime; /* mtime when the directory was read */
+    int exists;
+} Path_Dir;
+
+char *indexed_path = NULL;
+Path_Dir *path_dirs = NULL;
+int path_dir_count = 0;
+Cmd_Entry *cmd_entries = NULL;
+int cmd_entry_count = 0, cmd_entry_cap = 0;
+char *name_pool = NULL;
+size_t name_pool_len = 0, name_pool_cap = 0;
+
+void *_index_realloc(void *ptr, size_t size)
+{
+    void *new = realloc(ptr, size);
+    if (!new)
+    {
+        my_fprintf(stderr, "psh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    return new;
+}
+
+/* Free the index. */
+void free_cmd_index()
+{
+    for (int i = 0; i < path_dir_count; i++)
+        free(path_dirs[i].path);
+    free(path_dirs);
+    free(indexed_path);
+    free(cmd_entries);
+    free(name_pool);
+    path_dirs = NULL, indexed_path = NULL, cmd_entries = NULL, name_pool = NULL;
+    path_dir_count = 0, cmd_entry_count = 0, cmd_entry_cap = 0;
+    name_pool_len = 0, name_pool_cap = 0;
+}
+
+/* Add a name provided by the directory with the given index. */
+void _add_cmd_entry(const char *name, int dir)
+{
+    size_t len = strlen(name) + 1;
+    if (name_pool_len + len > name_pool_cap)
+    {
+        name_pool_cap = name_pool_cap ? name_pool_cap * 2 : 16384;
+        while (name_pool_len + len > name_pool_cap)
+            name_pool_cap *= 2;
+        name_pool = _index_realloc(name_pool, name_pool_cap);
+    }
+    if (cmd_entry_count == cmd_entry_cap)
+    {
+        cmd_entry_cap = cmd_entry_cap ? cmd_entry_cap * 2 : 1024;
+        cmd_entries = _index_realloc(cmd_entries, cmd_entry_cap * sizeof(Cmd_Entry));
+    }
+    memcpy(name_pool + name_pool_len, name, len);
+    cmd_entries[cmd_entry_count].name = name_pool_len;
+    cmd_entries[cmd_entry_count].dir = dir;
+    cmd_entry_count++;
+    name_pool_len += len;
+}
+
+/* Order entries by name, then by PATH precedence. */
+int _compare_entries(const void *a, const void *b)
+{
+    const Cmd_Entry *e1 = a, *e2 = b;
+    int cmp = strcmp(name_pool + e1->name, name_pool + e2->name);
+    if (cmp != 0)
+        return cmp;
+    return e1->dir - e2->dir;
+}
+
+/* Read the names of all non-directory entries of the PATH directories. */
+void _build_cmd_index(const char *path)
+{
+    char *path_copy, *token, *saveptr;
+    struct stat st;
+    int last = 0;
+
+    free_cmd_index();
+    indexed_path = strdup(path);
+
+    path_copy = strdup(path);
+    for (token = strtok_r(path_copy, ":", &saveptr); token; token = strtok_r(NULL, ":", &saveptr))
+    {
+        path_dirs = _index_realloc(path_dirs, (path_dir_count + 1) * sizeof(Path_Dir));
+        path_dirs[path_dir_count].path = strdup(token);
+        path_dirs[path_dir_count].exists = stat(token, &st) == 0 && S_ISDIR(st.st_mode);
+        if (path_dirs[path_dir_count].exists)
+            path_dirs[path_dir_count].mtime = st.st_mtim;
+        path_dir_count++;
+    }
+    free(path_copy);
+
+    for (int i = 0; i < path_dir_count; i++)
+    {
+        DIR *dir;
+        struct dirent *entry;
+        if (!path_dirs[i].exists || !(dir = opendir(path_dirs[i].path)))
+            continue;
+        while ((entry = readdir(dir)) != NULL)
+        {
+            if (entry->d_name[0] == '.' || entry->d_type == DT_DIR)
+                continue;
+            _add_cmd_entry(entry->d_name, i);
+        }
+        closedir(dir);
+    }
+
+    if (cmd_entry_count == 0)
+        return;
+    qsort(cmd_entries, cmd_entry_count, sizeof(Cmd_Entry), _compare_entries);
+
+    /* Keep only the first directory for each name. */
+    for (int i = 1; i < cmd_entry_count; i++)
+    {
+        if (strcmp(name_pool + cmd_entries[i].name, name_pool + cmd_entries[last].name) != 0)
+            cmd_entries[++last] = cmd_entries[i];
+    }
+    cmd_entry_count = last + 1;
+}
+
+/* Return 1 if PATH or any of its directories changed since the index was built. */
+int _cmd_index_is_stale(const char *path)
+{
+    struct stat st;
+    if (!indexed_path || strcmp(indexed_path, path) != 0)
+        return 1;
+    for (int i = 0; i < path_dir_count; i++)
+    {
+        int exists = stat(path_dirs[i].path, &st) == 0 && S_ISDIR(st.st_mode);
+        if (exists != path_dirs[i].exists)
+            return 1;
+        if (exists && (st.st_mtim.tv_sec != path_dirs[i].mtime.tv_sec ||
+                       st.st_mtim.tv_nsec != path_dirs[i].mtime.tv_nsec))
+            return 1;
+    }
+    return 0;
+}
+
+/* Make sure the index reflects the current PATH. Return 0 if there is no PATH. */
+int _refresh_cmd_index()
+{
+    char *path = psh_getenv("PATH");
+    if (!path)
+    {
+        free_cmd_index();
+        return 0;
+    }
+    if (_cmd_index_is_stale(path))
+        _build_cmd_index(path);
+    return 1;
+}
+
+/* Return the index of the first entry not less than prefix. */
+int _lower_bound(const char *prefix, size_t len)
+{
+    int lo = 0, hi = cmd_entry_count;
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (strncmp(name_pool + cmd_entries[mid].name, prefix, len) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Return the sorted list of commands matching the glob pattern. The literal part
+   of the pattern before the first wildcard is looked up with a binary search, so
+   a prefix query costs O(log n + k). The caller frees the list. */
+char **cmd_index_complete(const char *pattern)
+{
+    size_t prefix_len = strcspn(pattern, "*?[\\");
+    int exact_prefix = strcmp(pattern + prefix_len, "*") == 0 || pattern[prefix_len] == '\0';
+    char **results;
+    int start, end, count = 0;
+
+    if (!_refresh_cmd_index())
+        return NULL;
+
+    start = _lower_bound(pattern, prefix_len);
+    end = start;
+    while (end < cmd_entry_count && strncmp(name_pool + cmd_entries[end].name, pattern, prefix_len) == 0)
+        end++;
+
+    results = malloc((end - start + 1) * sizeof(char *));
+    if (!results)
+    {
+        my_fprintf(stderr, "psh: allocation error\n");
+        return NULL;
+    }
+    for (int i = start; i < end; i++)
+    {
+        char *name = name_pool + cmd_entries[i].name;
+        if (!exact_prefix && fnmatch(pattern, name, 0) != 0)
+            continue;
+        if (exact_prefix && pattern[prefix_len] == '\0' && name[prefix_len] != '\0')
+            continue;
+        results[count++] = strdup(name);
+    }
+    results[count] = NULL;
+    return results;
+}
@@ -0,0 +1,7 @@
+#ifndef CMD_INDEX_H
+#define CMD_INDEX_H
+
+char **cmd_index_complete(const char *pattern);
+void free_cmd_index();
+
+#endif
@@ -1,9 +1,11 @@
 #include <stdio.h>
 #include <stdarg.h>
+#include <unistd.h>
 
 
 /* Overriden default printing functions. 
-   The are suitable for both the raw and the normal terminal modes. */
+   The are suitable for both the raw and the normal terminal modes.
+   The carriage return raw mode needs is only written to a terminal. */
 
 extern int shell_is_interactive;
 
@@ -13,7 +15,7 @@ void my_printf(const char *format, ...)
     va_start(args, format);
     vprintf(format, args);
     va_end(args);
-    if (shell_is_interactive)
+    if (shell_is_interactive && isatty(STDOUT_FILENO))
     {
         printf("\r");
         fflush(stdout);
@@ -26,7 +28,7 @@ void my_fprintf(FILE *stream, const char *format, ...)
     va_start(args, format);
     vfprintf(stream, format, args);
     va_end(args);
-    if (shell_is_interactive)
+    if (shell_is_interactive && isatty(fileno(stream)))
     {
         fprintf(stream, "\r");
         fflush(stream);
@@ -36,7 +38,7 @@ void my_fprintf(FILE *stream, const char *format, ...)
 void my_perror(const char *s)
 {
     perror(s);
-    if (shell_is_interactive)
+    if (shell_is_interactive && isatty(STDERR_FILENO))
     {
         fprintf(stderr, "\r");
         fflush(stderr);
@@ -11,17 +11,23 @@
 #ifndef DATA_STRUCTS_H
 #define DATA_STRUCTS_H
 
+struct job;
+
 typedef struct process
 {
     struct process *next;            /* next process in pipeline */
+    struct job *job;                 /* job the process belongs to */
     char **argv;                     /* for exec */
+    char *path;                      /* resolved executable, owned by the command hash */
     pid_t pid;                       /* process ID */
+    int pidfd;                       /* readable once the process exits, or -1 */
     char completed;                  /* true if process has completed */
     char stopped;                    /* true if process has stopped */
     int status;                      /* reported status value */
     int exit_status;                 /* actual exit status */
     char *infile, *outfile, *errfile; /* i/o channel names */
     int append_mode;                 /* true if appending */
+    int batch_head, batch_tail;      /* arguments every batch keeps, see batch.c */
 } process;
 
 typedef struct job
@@ -30,12 +36,15 @@ typedef struct job
     char *command;             /* command line, used for messages */
     process *first_process;    /* list of processes in this job */
     pid_t pgid;                /* process group ID */
+    int number;                /* job number used by %N, 0 until launched */
+    char promoted;             /* true if copied out of the line arena into one heap block */
     char notified;             /* true if user told about stopped job */
     struct termios tmodes;     /* saved terminal modes */
     int stdin, stdout, stderr; /* standard i/o channels */
     int inverted;              /* inversion of the exit status */
     int in_bg;                 /* true if job is running in background. */
     int foreground;            /* true if job should be started as a foreground one. */
+    char batched;              /* true if the processes are batches of one command, not a pipeline */
 } job;
 
 #endif
\ No newline at end of file
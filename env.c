@@ -6,113 +6,451 @@
 #include "main.h"
 #include "builtin.h"
 #include <ctype.h>
-#include <glob.h>
+#include <fnmatch.h>
 #include "custom_print.h"
-#include <libgen.h>
+#include "prompt.h"
+#include "arena.h"
+#include "brace.h"
+#include "globstar.h"
 
 #define LINE_LEN 256
-#define MAX_PROMPT_LEN 128
 #define CONFIG_FILE "~/.pshrc"
 
-extern Env *first_env;
 extern int last_proc_exit_status;
 extern pid_t shell_pgid;
+extern int vm_function_depth;
+extern char **environ;
+
+/* Variables live in an open-addressing hash table with linear probing.
+   Each entry keeps the hash of its name, so probes compare names only
+   when the hashes are equal. A local variable takes the slot of the one
+   it hides, which is kept in its saved chain and put back when the
+   function that declared it returns. */
+
+#define ENV_INITIAL_SIZE 64
+#define ENV_DELETED ((Env *)&env_deleted)
+
+Env **env_table = NULL;
+int env_size = 0;
+int env_used = 0; /* slots holding an entry or a deletion mark */
+char env_deleted;
+Env **env_locals = NULL; /* locals in the order they were declared */
+int env_local_count = 0, env_local_size = 0;
+
+/* The environment of child processes, NAME=VALUE for each exported
+   variable with a value. It is updated in place when such a variable
+   changes, so launching a process does not rebuild it. An exported
+   variable knows its position in envp, and env_owners maps positions
+   back to variables. */
+char **env_envp = NULL;
+Env **env_owners = NULL;
+int env_envp_count = 0, env_envp_cap = 0;
+long env_envp_bytes = 0; /* room the strings and pointers take in exec */
+
+unsigned int _env_hash(const char *name)
+{
+    unsigned int h = 2166136261u;
+    while (*name)
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+    return h;
+}
+
+/* Return the slot of the name, or the free slot where it would go. */
+Env **_env_slot(const char *name, unsigned int hash)
+{
+    Env **tomb = NULL;
+    for (unsigned int i = hash & (env_size - 1);; i = (i + 1) & (env_size - 1))
+    {
+        Env *e = env_table[i];
+        if (!e)
+            return tomb ? tomb : &env_table[i];
+        if (e == ENV_DELETED)
+        {
+            if (!tomb)
+                tomb = &env_table[i];
+        }
+        else if (e->hash == hash && strcmp(e->name, name) == 0)
+            return &env_table[i];
+    }
+}
+
+void _env_import();
+
+Env *_env_find(const char *name)
+{
+    Env *e;
+    if (!env_table)
+        _env_import();
+    e = *_env_slot(name, _env_hash(name));
+    return e == ENV_DELETED ? NULL : e;
+}
+
+/* Double the table, or rebuild it without deletion marks. */
+void _env_rehash()
+{
+    Env **old = env_table;
+    int old_size = env_size, count = 0;
+
+    for (int i = 0; i < old_size; i++)
+        if (old[i] && old[i] != ENV_DELETED)
+            count++;
+    env_size = old_size ? old_size : ENV_INITIAL_SIZE;
+    while ((count + 1) * 2 > env_size)
+        env_size *= 2;
+    env_table = calloc(env_size, sizeof(Env *));
+    if (!env_table)
+    {
+        my_fprintf(stderr, "psh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    env_used = count;
+    for (int i = 0; i < old_size; i++)
+        if (old[i] && old[i] != ENV_DELETED)
+            *_env_slot(old[i]->name, old[i]->hash) = old[i];
+    free(old);
+}
+
+/* Store the value in the entry, reusing its buffer if the value fits. */
+void _env_assign(Env *e, const char *value)
+{
+    size_t length = strlen(value);
+    if (!e->value || length >= e->value_size)
+    {
+        free(e->value);
+        e->value_size = length + 1 > 16 ? length + 1 : 16;
+        e->value = malloc(e->value_size);
+        if (!e->value)
+        {
+            my_fprintf(stderr, "psh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(e->value, value, length + 1);
+}
+
+Env *_env_new(const char *name, unsigned int hash)
+{
+    Env *e = calloc(1, sizeof(Env));
+    if (!e || !(e->name = strdup(name)))
+    {
+        my_fprintf(stderr, "psh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    e->hash = hash;
+    return e;
+}
+
+/* Return the entry of the name, creating an unset one in its slot. */
+Env *_env_entry(const char *name)
+{
+    unsigned int hash = _env_hash(name);
+    Env **slot;
+
+    if (!env_table)
+        _env_import();
+    if ((env_used + 1) * 2 > env_size)
+        _env_rehash();
+    slot = _env_slot(name, hash);
+    if (*slot && *slot != ENV_DELETED)
+        return *slot;
+    if (!*slot)
+        env_used++;
+    return *slot = _env_new(name, hash);
+}
+
+void _envp_remove(Env *e);
+
+/* Put the NAME=VALUE of the exported variable into envp, or take it out
+   if the variable has no value. */
+void _envp_set(Env *e)
+{
+    size_t name_length = strlen(e->name), length;
+    char *entry;
+    int index;
+
+    if (!e->value)
+    {
+        _envp_remove(e);
+        return;
+    }
+    length = name_length + strlen(e->value) + 2;
+    entry = malloc(length);
+    if (!entry)
+    {
+        my_fprintf(stderr, "psh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(entry, e->name, name_length);
+    entry[name_length] = '=';
+    strcpy(entry + name_length + 1, e->value);
+
+    if (e->envp_slot)
+    {
+        index = e->envp_slot - 1;
+        env_envp_bytes -= strlen(env_envp[index]) + 1;
+        free(env_envp[index]);
+    }
+    else
+    {
+        if (env_envp_count + 1 >= env_envp_cap)
+        {
+            env_envp_cap = env_envp_cap ? 2 * env_envp_cap : 64;
+            env_envp = realloc(env_envp, env_envp_cap * sizeof(char *));
+            env_owners = realloc(env_owners, env_envp_cap * sizeof(Env *));
+            if (!env_envp || !env_owners)
+            {
+                my_fprintf(stderr, "psh: allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        index = env_envp_count++;
+        env_envp[env_envp_count] = NULL;
+        env_owners[index] = e;
+        e->envp_slot = index + 1;
+        env_envp_bytes += sizeof(char *);
+    }
+    env_envp[index] = entry;
+    env_envp_bytes += length;
+}
+
+/* Take the variable out of envp, moving the last entry into its place. */
+void _envp_remove(Env *e)
+{
+    int index = e->envp_slot - 1, last = env_envp_count - 1;
+
+    if (!e->envp_slot)
+        return;
+    env_envp_bytes -= strlen(env_envp[index]) + 1 + sizeof(char *);
+    free(env_envp[index]);
+    env_envp[index] = env_envp[last];
+    env_owners[index] = env_owners[last];
+    env_owners[index]->envp_slot = index + 1;
+    env_envp[last] = NULL;
+    env_envp_count--;
+    e->envp_slot = 0;
+}
+
+/* Take the inherited environment in as exported variables. */
+void _env_import()
+{
+    _env_rehash();
+    for (char **var = environ; var && *var; var++)
+    {
+        char *equal = strchr(*var, '='), *name;
+        Env *e;
+        if (!equal || equal == *var)
+            continue;
+        name = strndup(*var, equal - *var);
+        if (!name)
+        {
+            my_fprintf(stderr, "psh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        e = _env_entry(name);
+        _env_assign(e, equal + 1);
+        e->flags |= ENV_EXPORT;
+        _envp_set(e);
+        free(name);
+    }
+}
+
+void _env_free(Env *e)
+{
+    while (e)
+    {
+        Env *saved = e->saved;
+        free(e->name);
+        free(e->value);
+        free(e);
+        e = saved;
+    }
+}
 
 /* Get the value of the environmental variable corresponding to the given name.
    Return null pointer if there is no variable with such name. */
 char *psh_getenv(char *name)
 {
-    char *value = NULL;
-    Env *temp = first_env;
-    if (!temp)
-        return getenv(name);
-    do
+    Env *e = _env_find(name);
+    return e ? e->value : NULL;
+}
+
+/* Set a variable, creating it if it does not exist yet. An integer variable
+   takes the value as a number. Return -1 if the variable is readonly or
+   the value is not a number. */
+int env_assign(const char *name, const char *value)
+{
+    Env *e = _env_entry(name);
+    char number[24];
+
+    if (e->flags & ENV_READONLY)
+    {
+        my_fprintf(stderr, "psh: %s: readonly variable\n", name);
+        return -1;
+    }
+    if (e->flags & ENV_INTEGER)
     {
-        if (strcmp(temp->name, name) == 0)
+        char *end;
+        long n = strtol(value, &end, 10);
+        if (*value == '\0' || *end != '\0')
         {
-            value = temp->value;
-            break;
+            my_fprintf(stderr, "psh: %s: %s: not an integer\n", name, value);
+            return -1;
         }
-        temp = temp->next;
-    } while (temp);
-    if (value)
-        return value;
-    else
-        return getenv(name);
+        snprintf(number, sizeof(number), "%ld", n);
+        value = number;
+    }
+    _env_assign(e, value);
+    if (e->flags & ENV_EXPORT)
+        _envp_set(e);
+    prompt_var_changed(name);
+    return 0;
 }
 
 /* Add a variable to the list of environmental variables. Override existing value if
    a variable with such name already exists. */
 void psh_setenv(char *name, char *value)
 {
-    Env *temp = first_env;
-    Env *last_env;
-    int found = 0;
+    env_assign(name, value);
+}
 
-    if (!temp)
+/* Unset the variable with the given name. Do nothing if no variable with such name exists.
+   A local is only emptied, it keeps hiding the variable it shadows. */
+void psh_unsetenv(char *name)
+{
+    Env **slot, *e;
+    if (!env_table)
+        _env_import();
+    slot = _env_slot(name, _env_hash(name));
+    e = *slot;
+    if (!e || e == ENV_DELETED)
+        return;
+    if (e->flags & ENV_READONLY)
     {
-        Env *new = malloc(sizeof(Env));
-        new->name = strdup(name);
-        new->value = strdup(value);
-        new->next = NULL;
-        first_env = new;
+        my_fprintf(stderr, "psh: %s: readonly variable\n", name);
         return;
     }
-
-    do
-    {
-        if (strcmp(temp->name, name) == 0)
-        {
-            found = 1;
-            break;
-        }
-        last_env = temp;
-        temp = temp->next;
-    } while (temp);
-
-    if (found)
+    _envp_remove(e);
+    if (e->scope > 0)
     {
-        free(temp->value);
-        temp->value = strdup(value);
+        free(e->value);
+        e->value = NULL;
+        e->value_size = 0;
     }
     else
     {
-        Env *new = malloc(sizeof(Env));
-        new->name = strdup(name);
-        new->value = strdup(value);
-        new->next = NULL;
-        last_env->next = new;
+        *slot = ENV_DELETED;
+        _env_free(e);
     }
+    prompt_var_changed(name);
 }
 
-/* Unset the variable with the given name. Do nothing if no variable with such name exists. */
-void psh_unsetenv(char *name)
+/* Add attributes to a variable, creating it unset if needed. */
+void env_set_flags(const char *name, int flags)
 {
-    Env *temp = first_env;
-    if (!temp)
+    Env *e = _env_entry(name);
+    int exported = e->flags & ENV_EXPORT;
+    e->flags |= flags;
+    if (!exported && (flags & ENV_EXPORT))
+        _envp_set(e);
+}
+
+/* Return the attributes of a variable, 0 if it does not exist. */
+int env_flags(const char *name)
+{
+    Env *e = _env_find(name);
+    return e ? e->flags : 0;
+}
+
+/* Declare a variable local to the running function. The variable it hides
+   comes back when the function returns. A local of an exported variable
+   is exported in its place. */
+void env_local(const char *name)
+{
+    Env *hidden = _env_find(name), *e;
+
+    if (hidden && hidden->scope == vm_function_depth)
         return;
-    Env *prev = NULL, *next;
-    int found = 0;
-    do
+    if (hidden)
     {
-        if (strcmp(temp->name, name) == 0)
+        Env **slot = _env_slot(name, hidden->hash);
+        e = *slot = _env_new(name, hidden->hash);
+        e->saved = hidden;
+        e->flags = hidden->flags & ENV_EXPORT;
+        _envp_remove(hidden);
+    }
+    else
+        e = _env_entry(name);
+    e->scope = vm_function_depth;
+    if (env_local_count == env_local_size)
+    {
+        env_local_size = env_local_size ? 2 * env_local_size : 16;
+        env_locals = realloc(env_locals, env_local_size * sizeof(Env *));
+        if (!env_locals)
         {
-            found = 1;
-            next = temp->next;
-            break;
+            my_fprintf(stderr, "psh: allocation error\n");
+            exit(EXIT_FAILURE);
         }
-        prev = temp;
-        temp = temp->next;
-    } while (temp);
-    if (!found)
-        return;
-    if (!prev)
-        first_env = next;
-    else
-        prev->next = next;
-    free(temp->name);
-    free(temp->value);
-    free(temp);
+    }
+    env_locals[env_local_count++] = e;
+}
+
+/* Drop the locals of functions deeper than the depth. */
+void env_pop_locals(int depth)
+{
+    while (env_local_count > 0 && env_locals[env_local_count - 1]->scope > depth)
+    {
+        Env *e = env_locals[--env_local_count];
+        Env **slot = _env_slot(e->name, e->hash);
+        *slot = e->saved ? e->saved : ENV_DELETED;
+        _envp_remove(e);
+        if (e->saved && (e->saved->flags & ENV_EXPORT))
+            _envp_set(e->saved);
+        e->saved = NULL;
+        prompt_var_changed(e->name);
+        _env_free(e);
+    }
+}
+
+int _env_compare(const void *a, const void *b)
+{
+    return strcmp((*(Env **)a)->name, (*(Env **)b)->name);
+}
+
+/* Call the function with each variable, in the order of their names. */
+void env_each(void (*visit)(Env *e))
+{
+    Env **sorted = malloc((env_size + 1) * sizeof(Env *));
+    int count = 0;
+
+    if (!sorted)
+    {
+        my_fprintf(stderr, "psh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < env_size; i++)
+        if (env_table[i] && env_table[i] != ENV_DELETED)
+            sorted[count++] = env_table[i];
+    qsort(sorted, count, sizeof(Env *), _env_compare);
+    for (int i = 0; i < count; i++)
+        visit(sorted[i]);
+    free(sorted);
+}
+
+/* Return the environment for a new process. */
+char **env_environ()
+{
+    static char *empty[] = {NULL};
+    if (!env_table)
+        _env_import();
+    return env_envp ? env_envp : empty;
+}
+
+/* Return the room the environment takes in the arguments of exec. */
+long env_environ_size()
+{
+    if (!env_table)
+        _env_import();
+    return env_envp_bytes;
 }
 
 char **_split_string(char *str, char *c)
@@ -147,7 +485,8 @@ char **_split_string(char *str, char *c)
     return arr;
 }
 
-/* Reads the configuration file and sets the environmental variables accordingly. */
+/* Reads the configuration file and sets the environmental variables accordingly.
+   A line starting with export also passes the variable to launched processes. */
 void read_config_file()
 {
     char *filename = CONFIG_FILE;
@@ -157,7 +496,7 @@ void read_config_file()
     char **arr;
 
     if (filename[0] == '~') {
-        const char *home = getenv("HOME");
+        const char *home = psh_getenv("HOME");
         if (home)
             snprintf(expanded_filename, sizeof(expanded_filename), "%s%s", home, filename + 1);
         else
@@ -174,10 +513,13 @@ void read_config_file()
     {
         if (line[0] != '#' && strchr(line, '='))
         {
-            arr = _split_string(line, "=");
+            int exported = strncmp(line, "export ", 7) == 0;
+            arr = _split_string(line + (exported ? 7 : 0), "=");
             if (arr)
             {
                 psh_setenv(arr[0], arr[1]);
+                if (exported)
+                    env_set_flags(arr[0], ENV_EXPORT);
                 free(arr[0]);
                 free(arr[1]);
                 free(arr);
@@ -188,473 +530,348 @@ void read_config_file()
     fclose(file);
 }
 
-char *_get_current_dir()
-{
-    FILE *fp;
-    char path[MAX_PROMPT_LEN];
-    
-    fp = popen("pwd", "r");
-    if (fp == NULL)
-    {
-        my_fprintf(stderr, "Failed to run command\n");
-        exit(1);
-    }
+/* Expansion of $ parameters and a leading ~ in one left-to-right pass over
+   a word, into a growable buffer. The result is still a word: its quotes
+   stay for the brace, glob and quote removal steps after it, and the
+   characters of substituted values those steps would give meaning to are
+   escaped. The pattern of ${VAR%...} and ${VAR#...} is expanded in
+   pattern mode instead, where quotes are dropped and the glob characters
+   they quote are escaped for fnmatch. */
 
-    if (fgets(path, sizeof(path), fp) != NULL)
-    {
-        path[strcspn(path, "\n")] = '\0';
-    }
-    pclose(fp);
-    
-    char *last = basename(path);
-    char *result = strdup(last);
-    if (!result)
-    {
-        my_perror("Memory allocation error");
-        exit(1);
-    }
-
-    return result;
-}
-
-char *_get_current_git_branch()
+typedef struct Exp_Buffer
 {
-    FILE *fp;
-    char path[MAX_PROMPT_LEN];
-
-    fp = popen("git rev-parse --abbrev-ref HEAD 2>/dev/null", "r");
-    if (fp == NULL)
-    {
-        my_fprintf(stderr, "Failed to run command\n");
-        exit(1);
-    }
-
-    if (fgets(path, sizeof(path), fp) != NULL)
-    {
-        path[strcspn(path, "\n")] = '\0';
-    }
-    else
-        path[0] = '\0';
+    char *text;
+    size_t length;
+    size_t size;
+} Exp_Buffer;
 
-    pclose(fp);
+Exp_Buffer exp_word = {NULL, 0, 0};
 
-    char *result = strdup(path);
-    if (!result)
+void _exp_put(Exp_Buffer *b, const char *s, size_t n)
+{
+    if (b->length + n + 1 > b->size)
     {
-        my_perror("Memory allocation error");
-        exit(1);
+        size_t size = b->size ? b->size : 128;
+        while (b->length + n + 1 > size)
+            size *= 2;
+        b->text = realloc(b->text, size);
+        if (!b->text)
+        {
+            my_fprintf(stderr, "psh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        b->size = size;
     }
+    memcpy(b->text + b->length, s, n);
+    b->length += n;
+    b->text[b->length] = '\0';
+}
 
-    return result;
+void _exp_putc(Exp_Buffer *b, char c)
+{
+    _exp_put(b, &c, 1);
 }
 
-char *_parse_ps_var(char *var)
+/* Append a substituted value, escaped for the steps that follow. Inside
+   double quotes of a word a quote is closed around an escaped '"'. */
+void _exp_value(Exp_Buffer *b, const char *value, size_t n, int quoted, int pattern)
 {
-    char *temp = malloc(MAX_PROMPT_LEN * sizeof(char));
-    if (!temp)
-    {
-        my_perror("psh: allocation error");
-        exit(1);
-    }
-    int counter = 0;
-    for (int i = 0; var[i] != '\0'; i++)
+    const char *special = pattern ? (quoted ? "*?[]\\" : "") : (quoted ? "\"" : "\\\"'{},");
+    size_t start = 0;
+
+    for (size_t i = 0; i < n; i++)
     {
-        if (var[i] != '-')
-        {
-            temp[counter++] = var[i];
-        }
+        if (!strchr(special, value[i]) || value[i] == '\0')
+            continue;
+        _exp_put(b, value + start, i - start);
+        if (!pattern && quoted)
+            _exp_put(b, "\"\\\"\"", 4);
         else
         {
-            i++;
-            if (var[i] == '\0')
-                break;
-            switch (var[i])
-            {
-            case 'b':
-            {
-                char *branch = _get_current_git_branch();
-                for (int k = 0; branch[k] != '\0'; k++)
-                    temp[counter++] = branch[k];
-                free(branch);
-                break;
-            }
-            case 'p':
-            {
-                char *cur_dir = _get_current_dir();
-                for (int k = 0; cur_dir[k] != '\0'; k++)
-                    temp[counter++] = cur_dir[k];
-                free(cur_dir);
-                break;
-            }
-            default:
-                my_fprintf(stderr, "Unexpected token after '-': %c\n", var[i]);
-                break;
-            }
+            _exp_putc(b, '\\');
+            _exp_putc(b, value[i]);
         }
+        start = i + 1;
     }
-    temp[counter] = '\0';
-    free(var);
-    return temp;
+    _exp_put(b, value + start, n - start);
 }
 
-/* Configures the prompt. It is called at the beginning of the main loop
-   and is updated every time in case a user has a custom prompt that shows
-   the current directory and/or current git branch. */
-char *configure_prompt(char *env, char *cur_prompt)
+/* Return the length of the parameter name at s: a variable name, a digit
+   or one of the special parameters. */
+size_t _exp_name(const char *s, size_t n)
 {
-    char *def = "$ ";
-    char *def2 = "> ";
-
-    if (cur_prompt != NULL)
-        free(cur_prompt);
-    char *temp = psh_getenv(env);
-
-    if (!temp && strcmp(env, "PS1") == 0)
-        return strdup(def);
-    else if (!temp && strcmp(env, "PS2") == 0)
-        return strdup(def2);
-    char *var = strdup(temp);
-
-    return _parse_ps_var(var);
+    size_t i = 0;
+    if (n == 0)
+        return 0;
+    if (isalpha((unsigned char)s[0]) || s[0] == '_')
+    {
+        while (i < n && (isalnum((unsigned char)s[i]) || s[i] == '_'))
+            i++;
+        return i;
+    }
+    return strchr("0123456789?$!#", s[0]) ? 1 : 0;
 }
 
-void remove_first_char(char *str)
+/* Return the value of the parameter, or NULL if it is unset. */
+const char *_exp_lookup(const char *name, size_t n, char number[24])
 {
-    if (str == NULL || strlen(str) == 0)
-    {
-        return;
+    char key[64];
+    if (n == 1 && (name[0] == '?' || name[0] == '$' || name[0] == '!'))
+    {
+        job *j;
+        if (name[0] == '?')
+            snprintf(number, 24, "%d", last_proc_exit_status);
+        else if (name[0] == '$')
+            snprintf(number, 24, "%d", shell_pgid);
+        else
+            snprintf(number, 24, "%d", (j = _find_last_bg_job()) ? j->pgid : 0);
+        return number;
     }
-
-    for (int i = 1; i <= strlen(str); i++)
+    if (n < sizeof(key))
     {
-        str[i - 1] = str[i];
+        memcpy(key, name, n);
+        key[n] = '\0';
+        return psh_getenv(key);
     }
+    return psh_getenv(arena_strndup(&line_arena, name, n));
 }
 
-int _is_dollar_expandable(char *token)
+/* Return the index of the '}' closing the parameter opened before i,
+   skipping quoted text, escapes and nested braces, or n if it is missing. */
+size_t _exp_close(const char *s, size_t i, size_t n)
 {
-    int $_index = -1;
-    for (int i = 0; token[i] != '\0'; i++)
+    int depth = 0;
+    while (i < n)
     {
-        if (token[i] == '$')
+        if (s[i] == '\\')
+            i += 2;
+        else if (s[i] == '\'' || s[i] == '"')
         {
-            $_index = i;
-            break;
+            char quote = s[i++];
+            while (i < n && s[i] != quote)
+                i += s[i] == '\\' && quote == '"' ? 2 : 1;
+            i++;
         }
+        else if (s[i] == '{')
+            depth++, i++;
+        else if (s[i] == '}' && depth-- == 0)
+            return i;
+        else
+            i++;
     }
-    if ($_index == -1)
-        return 0;
-    if (token[$_index + 1] == '\0' || token[$_index + 1] == '{')
-        return 0;
-
-    // printf("Got out of the dollar_expandable thingy\n");
-    return 1;
-}
-
-char arr[] = {
-    '$',
-    '{',
-    '[',
-    '(',
-    '\\',
-    '/',
-    '*',
-    '?',
-    '&',
-    '|',
-    '!',
-    '~',
-    '<',
-    '>',
-    '%',
-    ':',
-    ';',
-    '"',
-    '\'',
-    '\0'};
-
-int is_special_symbol(char c)
-{
-    for (int i = 0; arr[i] != '\0'; i++)
-    {
-        if (arr[i] == c)
-            return 1;
-    }
-    return 0;
+    return n;
 }
 
-void _handle_dollar_expansion(char **tokens, char *token, int index)
-{
-    int prefix_len = 0, content_len = 0, suffix_len = 0;
-    char *prefix = NULL, *content = NULL, *suffix = NULL;
-    int first = 0;
+void _exp_pass(Exp_Buffer *b, const char *s, size_t n, int quoted, int pattern);
 
-    for (int i = 0; token[i] != '\0'; i++)
-    {
-        if (!first && token[i] == '$')
+/* Append the value without the shortest or longest prefix or suffix that
+   matches the pattern. */
+void _exp_trim(Exp_Buffer *b, const char *value, const char *op, const char *word, size_t n,
+               int quoted, int pattern)
+{
+    Exp_Buffer glob = {NULL, 0, 0};
+    size_t length = strlen(value), start = 0, end = length;
+    int suffix = op[0] == '%', longest = op[1] == op[0];
+    char *copy;
+
+    _exp_pass(&glob, word, n, 0, 1);
+    _exp_put(&glob, "", 0);
+    copy = arena_strndup(&line_arena, value, length);
+    for (size_t k = 0; k <= length; k++)
+    {
+        /* Try the longest candidates first when asked for them. */
+        size_t cut = suffix ? (longest ? k : length - k) : (longest ? length - k : k);
+        int match;
+        if (suffix)
+            match = fnmatch(glob.text, copy + cut, 0) == 0;
+        else
         {
-            first = 1;
-            prefix_len = i;
+            char saved = copy[cut];
+            copy[cut] = '\0';
+            match = fnmatch(glob.text, copy, 0) == 0;
+            copy[cut] = saved;
         }
-        else if (first && is_special_symbol(token[i]))
+        if (match)
         {
-            // printf("Special symbol is %c\n", token[i]);
-            content_len = i - prefix_len - 1;
-            if (token[i] == '$' && content_len == 0)
-                content_len++;
-            else if (token[i] == '?' && content_len == 0)
-                content_len++;
-            else if (token[i] == '!' && content_len == 0)
-                content_len++;
-            break;
-        }
-        else if (first && token[i + 1] == '\0')
-        {
-            content_len = i - prefix_len;
+            if (suffix)
+                end = cut;
+            else
+                start = cut;
             break;
         }
     }
-    suffix_len = strlen(token) - prefix_len - content_len - 1;
+    free(glob.text);
+    _exp_value(b, value + start, end - start, quoted, pattern);
+}
 
-    prefix = (char *)malloc(prefix_len + 1);
-    content = (char *)malloc(content_len + 1);
-    suffix = (char *)malloc(2 * suffix_len + 1); // It sometimes behaved weirdly causing a trace error
+/* Expand the parameter of ${...} between i and close. */
+void _exp_braced(Exp_Buffer *b, const char *s, size_t i, size_t close, int quoted, int pattern)
+{
+    char number[24];
+    const char *value;
+    size_t name;
 
-    if (!prefix || !content || !suffix)
+    if (s[i] == '#' && i + 1 < close && (name = _exp_name(s + i + 1, close - i - 1)) == close - i - 1)
     {
-        free(prefix);
-        free(content);
-        free(suffix);
+        value = _exp_lookup(s + i + 1, name, number);
+        snprintf(number, sizeof(number), "%zu", value ? strlen(value) : 0);
+        _exp_put(b, number, strlen(number));
         return;
     }
-
-    // printf("Prefix_len %d\n", prefix_len);
-    // printf("Content_len %d\n", content_len);
-    // printf("Suffix_len %d\n", suffix_len);
-
-    strlcpy(prefix, token, prefix_len + 1);
-    strlcpy(content, token + prefix_len + 1, content_len + 1);
-    strlcpy(suffix, token + prefix_len + content_len + 1, suffix_len + 1);
-
-    // printf("Prefix %s\n", prefix);
-    // printf("Content %s\n", content);
-    // printf("Suffix %s\n", suffix);
-
-    char *expanded_content = NULL;
-    if (strcmp(content, "?") == 0)
-    {
-        expanded_content = (char *)malloc(12);
-        sprintf(expanded_content, "%d", last_proc_exit_status);
-    }
-    else if (strcmp(content, "$") == 0)
+    name = _exp_name(s + i, close - i);
+    if (name == 0)
     {
-        expanded_content = (char *)malloc(12);
-        sprintf(expanded_content, "%d", shell_pgid);
+        my_fprintf(stderr, "psh: ${%.*s}: bad substitution\n", (int)(close - i), s + i);
+        return;
     }
-    else if (strcmp(content, "!") == 0)
+    value = _exp_lookup(s + i, name, number);
+    i += name;
+    if (i == close)
     {
-        pid_t pgid;
-        job *j = _find_last_bg_job();
-        if (!j)
-            pgid = 0;
-        else
-            pgid = j->pgid;
-
-        expanded_content = (char *)malloc(12);
-        sprintf(expanded_content, "%d", pgid);
+        if (value)
+            _exp_value(b, value, strlen(value), quoted, pattern);
     }
-    else
+    else if (s[i] == '-' || (s[i] == ':' && s[i + 1] == '-'))
     {
-        char *temp = psh_getenv(content);
-        if (!temp)
-            expanded_content = strdup("");
+        int colon = s[i] == ':';
+        if (value && (!colon || *value))
+            _exp_value(b, value, strlen(value), quoted, pattern);
         else
-            expanded_content = strdup(temp);
+            _exp_pass(b, s + i + 1 + colon, close - i - 1 - colon, quoted, pattern);
     }
-
-    if (!expanded_content)
+    else if (s[i] == '%' || s[i] == '#')
     {
-        free(prefix);
-        free(content);
-        free(suffix);
-        return;
+        size_t op = i + 1 < close && s[i + 1] == s[i] ? 2 : 1;
+        if (value)
+            _exp_trim(b, value, s + i, s + i + op, close - i - op, quoted, pattern);
     }
-
-    size_t new_token_len = prefix_len + strlen(expanded_content) + suffix_len;
-    char *new_token = (char *)malloc(new_token_len + 1);
-
-    if (!new_token)
-    {
-        free(prefix);
-        free(content);
-        free(suffix);
-        free(expanded_content);
-        return;
-    }
-
-    sprintf(new_token, "%s%s%s", prefix, expanded_content, suffix);
-
-    free(prefix);
-    free(content);
-    free(suffix);
-    free(expanded_content);
-
-    // my_printf("New_token %s\n", new_token);
-    // my_printf("Tokens[index] %s\n", tokens[index]);
-    // my_printf("Token %s\n", token);
-    // my_printf("Tokens[index] pointer %p\n", tokens[index]);
-    // my_printf("Token pointer %p\n", token);
-
-    free(tokens[index]);
-    tokens[index] = new_token;
-    // printf("END of handle_dollar\n");
+    else
+        my_fprintf(stderr, "psh: ${%.*s}: bad substitution\n", (int)(close - i + name), s + i - name);
 }
 
-void _handle_wave(char **tokens, char *token, int index)
+/* Expand the $ at i and return the index after what it took. */
+size_t _exp_dollar(Exp_Buffer *b, const char *s, size_t i, size_t n, int quoted, int pattern)
 {
-    char *home = strdup(getenv("HOME"));
-    remove_first_char(token);
-    strcat(home, token);
-    free(tokens[index]);
-    tokens[index] = home;
-    // printf("New var is %s\n", tokens[index]);
-}
+    char number[24];
+    const char *value;
+    size_t name;
 
-int _find_curly_brace_expansion(const char *token)
-{
-    int open_i = -1, close_i = -1;
-    for (int i = 0; token[i] != '\0'; i++)
+    if (i + 1 < n && s[i + 1] == '{')
     {
-        if (token[i] == '{')
-            open_i = i;
-        else if (token[i] == '}')
+        size_t close = _exp_close(s, i + 2, n);
+        if (close == n)
         {
-            close_i = i;
-            break;
+            _exp_putc(b, '$');
+            return i + 1;
         }
+        _exp_braced(b, s, i + 2, close, quoted, pattern);
+        return close + 1;
     }
-    if (open_i == -1 || close_i == -1 || open_i >= close_i || (close_i - open_i) <= 1)
-        return 0;
+    name = _exp_name(s + i + 1, n - i - 1);
+    if (name == 0)
+    {
+        _exp_putc(b, '$');
+        return i + 1;
+    }
+    /* Like $0..$9, a name that starts with a digit is one digit long. */
+    if (isdigit((unsigned char)s[i + 1]))
+        name = 1;
+    value = _exp_lookup(s + i + 1, name, number);
+    if (value)
+        _exp_value(b, value, strlen(value), quoted, pattern);
+    return i + 1 + name;
+}
 
-    char *content = strndup(token + open_i + 1, close_i - open_i - 1);
-    if (!content)
-        return 0;
+/* Expand the n bytes at s into the buffer, starting inside double quotes
+   if quoted is set. */
+void _exp_pass(Exp_Buffer *b, const char *s, size_t n, int quoted, int pattern)
+{
+    char quote = quoted ? '"' : 0;
+    size_t i = 0;
 
-    // printf("content is %s\n", content);
-    int is_comma_separated = 1;
-    if (!strchr(content, ','))
-        is_comma_separated = 0;
-    for (int i = 0; content[i] != '\0'; i++)
+    while (i < n)
     {
-        if (!isalnum(content[i]) && content[i] != ',')
+        char c = s[i];
+        if (quote == '\'')
         {
-            is_comma_separated = 0;
-            break;
+            if (c == '\'')
+                quote = 0;
+            if (!pattern || c != '\'')
+            {
+                if (pattern && strchr("*?[]\\", c))
+                    _exp_putc(b, '\\');
+                _exp_putc(b, c);
+            }
+            i++;
         }
-    }
-    // printf("is comma sep %d\n", is_comma_separated);
-    int is_number_range = 0;
-    char *dotdot = strstr(content, "..");
-    if (dotdot)
-    {
-        char *first_part = strndup(content, dotdot - content);
-        char *second_part = strdup(dotdot + 2);
-        if (first_part && second_part)
+        else if (c == '\\' && i + 1 < n)
         {
-            is_number_range = 1;
-            for (int i = 0; first_part[i] != '\0'; i++)
+            char next = s[i + 1];
+            if (quote && !strchr("$`\\\"", next))
+            {
+                /* Inside double quotes the backslash stays. */
+                _exp_put(b, pattern ? "\\\\" : "\\", pattern ? 2 : 1);
+                i++;
+                continue;
+            }
+            if (quote && !pattern)
             {
-                if (!isdigit(first_part[i]))
-                {
-                    is_number_range = 0;
-                    break;
-                }
+                _exp_put(b, "\"\\", 2);
+                _exp_putc(b, next);
+                _exp_putc(b, '"');
             }
-            for (int i = 0; second_part[i] != '\0'; i++)
+            else
             {
-                if (!isdigit(second_part[i]))
-                {
-                    is_number_range = 0;
-                    break;
-                }
+                _exp_putc(b, '\\');
+                _exp_putc(b, next);
             }
+            i += 2;
         }
-        free(first_part);
-        free(second_part);
-    }
-    // printf("is .. sep %d\n", is_number_range);
-    // sleep(2);
-    free(content);
-
-    return is_comma_separated || is_number_range;
-}
-
-void _handle_curly_brace_expansion(char **tokens, char *token, int index)
-{
-    char *start = strchr(token, '{');
-    char *end = strchr(token, '}');
-
-    if (start == NULL || end == NULL || start > end)
-        return;
-
-    char prefix[256] = {0};
-    char suffix[256] = {0};
-    char content[256] = {0};
-
-    strncpy(prefix, token, start - token);
-    strncpy(suffix, end + 1, strlen(end + 1));
-    strncpy(content, start + 1, end - start - 1);
-
-    // my_printf("Prefix is %s\n", prefix);
-    // my_printf("Conten is %s\n", content);
-    // my_printf("Suffix is %s\n", suffix);
-
-    char **new_tokens = NULL;
-    int new_token_count = 0;
-
-    if (strchr(content, ','))
-    {
-        // Handle comma-separated list
-        char *part = strtok(content, ",");
-        while (part != NULL)
+        else if (c == '\'' && !quote)
         {
-            new_tokens = realloc(new_tokens, sizeof(char *) * (new_token_count + 1));
-            new_tokens[new_token_count] = malloc(strlen(prefix) + strlen(part) + strlen(suffix) + 1);
-            sprintf(new_tokens[new_token_count], "%s%s%s", prefix, part, suffix);
-            new_token_count++;
-            part = strtok(NULL, ",");
+            quote = c;
+            if (!pattern)
+                _exp_putc(b, c);
+            i++;
         }
-    }
-    else if (strchr(content, '.') && strchr(content, '.') != strrchr(content, '.'))
-    {
-        // Handle numeric range
-        int start_num, end_num;
-        if (sscanf(content, "%d..%d", &start_num, &end_num) == 2)
+        else if (c == '"')
         {
-            int k = start_num < end_num ? 1 : -1;
-            for (int i = start_num; (k == 1) ? (i <= end_num) : (i >= end_num); i += k)
-            {
-                new_tokens = realloc(new_tokens, sizeof(char *) * (new_token_count + 1));
-                new_tokens[new_token_count] = malloc(strlen(prefix) + 21 + strlen(suffix)); // 21 for integer
-                sprintf(new_tokens[new_token_count], "%s%d%s", prefix, i, suffix);
-                new_token_count++;
-            }
+            quote = quote ? 0 : c;
+            if (!pattern)
+                _exp_putc(b, c);
+            i++;
+        }
+        else if (c == '$')
+            i = _exp_dollar(b, s, i, n, quote != 0, pattern);
+        else
+        {
+            if (pattern && quote && strchr("*?[]", c))
+                _exp_putc(b, '\\');
+            _exp_putc(b, c);
+            i++;
         }
     }
+}
 
-    if (new_tokens != NULL)
-    {
-        int original_count = 0;
-        while (tokens[original_count] != NULL)
-            original_count++;
-
-        memmove(&tokens[index + new_token_count], &tokens[index + 1], sizeof(char *) * (original_count - index));
+/* Return the word with its parameters and a leading ~ expanded and the
+   backslashes inside double quotes resolved, or the word itself if it has
+   nothing to expand. */
+char *_expand_parameters(char *word)
+{
+    size_t start = 0;
 
-        for (int i = 0; i < new_token_count; i++)
-            tokens[index + i] = new_tokens[i];
-        free(new_tokens);
+    if (word[0] != '~' && !strpbrk(word, "$\\"))
+        return word;
+    exp_word.length = 0;
+    if (word[0] == '~' && (word[1] == '\0' || word[1] == '/'))
+    {
+        char *home = psh_getenv("HOME");
+        if (home)
+            _exp_value(&exp_word, home, strlen(home), 0, 0);
+        start = 1;
     }
-    free(token);
+    _exp_pass(&exp_word, word + start, strlen(word + start), 0, 0);
+    return arena_strndup(&line_arena, exp_word.text ? exp_word.text : "", exp_word.length);
 }
 
 int _is_glob_expandable(char *str)
@@ -663,80 +880,77 @@ int _is_glob_expandable(char *str)
         return 0;
     for (int i = 0; str[i] != '\0'; i++)
     {
-        if (str[i] == '*' || str[i] == '?')
+        if (str[i] == '*' || str[i] == '?' || str[i] == '[')
             return 1;
     }
     return 0;
 }
 
-void _handle_glob_expansion(char **tokens, char *token, int index)
+/* Add the word to the list, or the paths it matches if it is a pattern
+   that matches any. */
+void _expand_glob(char *word, Word_List *out)
 {
-    glob_t glob_result;
-    int ret = glob(token, GLOB_TILDE, NULL, &glob_result);
-    if (ret != 0)
-    {
-        globfree(&glob_result);
-        return;
-    }
-
-    int num_matches = glob_result.gl_pathc;
-    int original_count = 0;
-    while (tokens[original_count] != NULL)
-        original_count++;
-
-    memmove(&tokens[index + num_matches], &tokens[index + 1], sizeof(char *) * (original_count - index));
-
-    for (int i = 0; i < num_matches; i++)
-    {
-        tokens[index + i] = strdup(glob_result.gl_pathv[i]);
-        if (!tokens[index + i])
-        {
-            for (int j = 0; j < index + i; j++)
-            {
-                free(tokens[index + j]);
-            }
-            globfree(&glob_result);
-            my_fprintf(stderr, "Memory allocation error\n");
-            return;
-        }
-    }
-
-    globfree(&glob_result);
-    free(token);
+    if (!_is_glob_expandable(word) || glob_walk(word, out) == 0)
+        word_list_push(out, word);
 }
 
 /* Check if any token in the list can be expanded and
-   perform the expansion in case it is possible.*/
-void expand(char **tokens)
+   perform the expansion in case it is possible.
+   Return the expanded list. Tokens that expand to a single word are
+   replaced in place, the list is copied once a token makes more.
+   If counts is given, the number of words each token made is stored in it.  */
+char **expand(char **tokens, int *counts)
 {
+    Word_List out = {NULL, 0, 0};
+    int listed = 0;
+
     for (int i = 0; tokens[i] != NULL; i++)
     {
-        if (tokens[i][0] == '~')
-            _handle_wave(tokens, tokens[i], i);
-        while (_is_dollar_expandable(tokens[i]))
-            _handle_dollar_expansion(tokens, tokens[i], i);
-        while (_find_curly_brace_expansion(tokens[i]))
-            _handle_curly_brace_expansion(tokens, tokens[i], i);
-        if (_is_glob_expandable(tokens[i]))
-            _handle_glob_expansion(tokens, tokens[i], i);
-    }
+        char *word = _expand_parameters(tokens[i]);
+        /* An unquoted word that expands to nothing is dropped. */
+        int vanished = word[0] == '\0' && word != tokens[i] && !strpbrk(tokens[i], "\"'");
+        int before = out.count;
+        tokens[i] = word;
+        if (counts)
+            counts[i] = !vanished;
+        if (!listed && !vanished && !brace_expandable(word) && !_is_glob_expandable(word))
+            continue;
+        if (!listed)
+        {
+            for (int k = 0; k < i; k++)
+                word_list_push(&out, tokens[k]);
+            before = out.count;
+            listed = 1;
+        }
+        if (vanished)
+            continue;
+        if (!brace_expand(tokens[i], &out, _expand_glob))
+            _expand_glob(tokens[i], &out);
+        if (counts)
+            counts[i] = out.count - before;
+    }
+    if (!listed)
+        return tokens;
+    word_list_push(&out, NULL);
+    return out.words;
 }
 
 /* Free the list of environmental variables. */
 void free_env_list()
 {
-    Env *temp = first_env;
-    Env *next;
-    if (!temp)
-        return;
-
-    do
-    {
-        next = temp->next;
-        free(temp->name);
-        free(temp->value);
-        free(temp);
-        temp = next;
-    } while (temp);
-    first_env = NULL;
-}
\ No newline at end of file
+    for (int i = 0; i < env_size; i++)
+        if (env_table[i] && env_table[i] != ENV_DELETED)
+            _env_free(env_table[i]);
+    for (int i = 0; i < env_envp_count; i++)
+        free(env_envp[i]);
+    free(env_table);
+    free(env_locals);
+    free(env_envp);
+    free(exp_word.text);
+    exp_word.text = NULL, exp_word.size = 0;
+    free(env_owners);
+    env_envp = NULL, env_owners = NULL;
+    env_envp_count = 0, env_envp_cap = 0, env_envp_bytes = 0;
+    env_table = NULL, env_size = 0, env_used = 0;
+    env_locals = NULL, env_local_count = 0, env_local_size = 0;
+}
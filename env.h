@@ -1,15 +1,31 @@
+#define ENV_READONLY 1
+#define ENV_INTEGER 2
+#define ENV_EXPORT 4
+
 typedef struct Env
 {
     char *name;
     char *value;
-    struct Env *next;
+    size_t value_size;
+    unsigned int hash;
+    int flags;
+    int scope;         /* function depth of a local, 0 for globals */
+    int envp_slot;     /* 1 + position in the environment if exported */
+    struct Env *saved; /* variable hidden by this local */
 } Env;
 
 char *psh_getenv(char *name);
 void psh_setenv(char *name, char *value);
 void psh_unsetenv(char *name);
+int env_assign(const char *name, const char *value);
+void env_set_flags(const char *name, int flags);
+int env_flags(const char *name);
+void env_local(const char *name);
+void env_pop_locals(int depth);
+void env_each(void (*visit)(Env *e));
+char **env_environ();
+long env_environ_size();
 void read_config_file();
-char *configure_prompt(char *env, char *cur_prompt);
-void expand(char **tokens);
+char **expand(char **tokens, int *counts);
 void free_env_list();
 char **_split_string(char *str, char *c);
\ No newline at end of file
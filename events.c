@@ -0,0 +1,66 @@
+#include <signal.h>
+#include <unistd.h>
+#include "events.h"
+#ifdef __linux__
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#endif
+
+/* Signals the interactive loop waits for are blocked and read from signal_fd,
+   so SIGCHLD and SIGWINCH can be polled together with the terminal.
+   signal_fd is -1 where signalfd is not available. */
+int signal_fd = -1;
+
+/* Block SIGCHLD and SIGWINCH and open a signal fd for them. */
+void init_events()
+{
+#ifdef __linux__
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGWINCH);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0)
+        return;
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0)
+        sigprocmask(SIG_UNBLOCK, &mask, NULL);
+#endif
+}
+
+/* Consume the pending signals. Return a mask of EVENT_CHILD and EVENT_WINCH. */
+int read_signal_events()
+{
+    int events = 0;
+#ifdef __linux__
+    struct signalfd_siginfo info;
+    if (signal_fd < 0)
+        return 0;
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+    {
+        if (info.ssi_signo == SIGCHLD)
+            events |= EVENT_CHILD;
+        else if (info.ssi_signo == SIGWINCH)
+            events |= EVENT_WINCH;
+    }
+#endif
+    return events;
+}
+
+/* Return a file descriptor that becomes readable when the process exits,
+   or -1 if pidfds are not supported. */
+int open_pidfd(pid_t pid)
+{
+#if defined(__linux__) && defined(SYS_pidfd_open)
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    return -1;
+#endif
+}
+
+/* Unblock all signals. Used in children before exec. */
+void reset_signal_mask()
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+}
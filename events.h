@@ -0,0 +1,16 @@
+#include <sys/types.h>
+
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#define EVENT_CHILD 1
+#define EVENT_WINCH 2
+
+extern int signal_fd;
+
+void init_events();
+int read_signal_events();
+int open_pidfd(pid_t pid);
+void reset_signal_mask();
+
+#endif
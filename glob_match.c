@@ -0,0 +1,245 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "glob_match.h"
+#include "custom_print.h"
+
+/* Glob patterns compiled once and matched against many names, as
+   fnmatch(pattern, name, FNM_PERIOD) in the C locale would.
+
+   Every element but * matches exactly one byte, so a pattern is a list
+   of fixed width segments separated by stars. The first segment must
+   match at the start of the name and the last at its end; those are a
+   memcmp when they are literal, and most names are rejected there or by
+   the minimum length. The segments in between are placed leftmost, which
+   is always right when only stars vary in width, so matching never
+   backtracks. They are searched for with memchr on their first literal
+   byte, which glibc runs with SSE2 or AVX2; for names this short it beats
+   memmem. */
+
+void *_glob_match_alloc(size_t size)
+{
+    void *ptr = calloc(1, size ? size : 1);
+    if (!ptr)
+    {
+        my_fprintf(stderr, "psh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+void _set_add(unsigned char *set, int c)
+{
+    set[(unsigned char)c >> 3] |= 1 << (c & 7);
+}
+
+int _set_has(const unsigned char *set, unsigned char c)
+{
+    return set[c >> 3] & (1 << (c & 7));
+}
+
+/* Parse the bracket expression at p into the item. Return the index after
+   it, or 0 if the bracket is not closed and stands for itself. */
+size_t _glob_class(Glob_Item *item, const char *p)
+{
+    static const struct
+    {
+        const char *name;
+        int (*test)(int);
+    } classes[] = {{"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank}, {"cntrl", iscntrl},
+                   {"digit", isdigit}, {"graph", isgraph}, {"lower", islower}, {"print", isprint},
+                   {"punct", ispunct}, {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit}};
+    size_t i = 1;
+    int negate = 0;
+
+    memset(item->set, 0, sizeof(item->set));
+    if (p[i] == '!' || p[i] == '^')
+        negate = 1, i++;
+    for (int first = 1; p[i] != ']' || first; first = 0)
+    {
+        unsigned char c = p[i];
+        if (c == '\0')
+            return 0;
+        if (c == '[' && p[i + 1] == ':')
+        {
+            const char *end = strstr(p + i + 2, ":]");
+            size_t k;
+            for (k = 0; end && k < sizeof(classes) / sizeof(classes[0]); k++)
+                if (strlen(classes[k].name) == (size_t)(end - p - i - 2) &&
+                    strncmp(classes[k].name, p + i + 2, end - p - i - 2) == 0)
+                    break;
+            if (end && k < sizeof(classes) / sizeof(classes[0]))
+            {
+                for (int b = 0; b < 256; b++)
+                    if (classes[k].test(b))
+                        _set_add(item->set, b);
+                i = end - p + 2;
+                continue;
+            }
+        }
+        if (c == '\\' && p[i + 1] != '\0')
+            c = p[++i];
+        i++;
+        if (p[i] == '-' && p[i + 1] != ']' && p[i + 1] != '\0')
+        {
+            unsigned char last = p[i + 1] == '\\' && p[i + 2] != '\0' ? p[i + 2] : p[i + 1];
+            i += p[i + 1] == '\\' && p[i + 2] != '\0' ? 3 : 2;
+            for (int b = c; b <= last; b++)
+                _set_add(item->set, b);
+        }
+        else
+            _set_add(item->set, c);
+    }
+    if (negate)
+        for (int b = 0; b < 32; b++)
+            item->set[b] = ~item->set[b];
+    item->kind = GLOB_CLASS;
+    return i + 1;
+}
+
+/* Compile the pattern. Literal runs are unescaped into m->text. */
+void glob_compile(Glob_Matcher *m, const char *pattern)
+{
+    size_t length = strlen(pattern);
+    char *text;
+    Glob_Item *item;
+    Glob_Segment *segment;
+
+    memset(m, 0, sizeof(Glob_Matcher));
+    m->items = _glob_match_alloc((length + 1) * sizeof(Glob_Item));
+    m->segments = _glob_match_alloc((length + 2) * sizeof(Glob_Segment));
+    m->text = text = _glob_match_alloc(length + 1);
+
+    item = m->items;
+    segment = m->segments;
+    segment->items = item;
+    for (const char *p = pattern; *p;)
+    {
+        if (*p == '*')
+        {
+            while (*p == '*')
+                p++;
+            m->stars = 1;
+            segment = &m->segments[++m->count];
+            segment->items = item;
+            continue;
+        }
+        if (*p == '?')
+        {
+            item->kind = GLOB_ANY;
+            p++;
+        }
+        else if (*p == '[' && (length = _glob_class(item, p)) != 0)
+            p += length;
+        else
+        {
+            /* Extend the literal run of the previous item.  */
+            if (*p == '\\' && p[1] == '\0')
+                m->invalid = 1;
+            if (*p == '\\' && p[1] != '\0')
+                p++;
+            if (segment->count > 0 && item[-1].kind == GLOB_LITERAL)
+            {
+                *text++ = *p++;
+                item[-1].length++;
+                segment->width++;
+                continue;
+            }
+            item->kind = GLOB_LITERAL;
+            item->text = text;
+            item->length = 1;
+            *text++ = *p++;
+            segment->width++;
+            segment->count++;
+            item++;
+            continue;
+        }
+        segment->width++;
+        segment->count++;
+        item++;
+    }
+    m->count++;
+    m->literal_period = m->segments[0].count > 0 && m->items[0].kind == GLOB_LITERAL && m->items[0].text[0] == '.';
+    for (int i = 0; i < m->count; i++)
+        m->min_length += m->segments[i].width;
+}
+
+/* Return 1 if the segment matches the bytes at s. */
+int _segment_at(const Glob_Segment *segment, const char *s)
+{
+    for (int i = 0; i < segment->count; i++)
+    {
+        const Glob_Item *item = &segment->items[i];
+        if (item->kind == GLOB_LITERAL)
+        {
+            if (memcmp(s, item->text, item->length) != 0)
+                return 0;
+            s += item->length;
+            continue;
+        }
+        if (item->kind == GLOB_CLASS && !_set_has(item->set, *s))
+            return 0;
+        s++;
+    }
+    return 1;
+}
+
+/* Return the leftmost place in [s, end) where the segment matches
+   entirely before end, or NULL. */
+const char *_segment_find(const Glob_Segment *segment, const char *s, const char *end)
+{
+    const Glob_Item *first = &segment->items[0];
+    const char *last = end - segment->width;
+
+    if (s > last)
+        return NULL;
+    if (first->kind == GLOB_LITERAL)
+    {
+        for (; s <= last && (s = memchr(s, first->text[0], last - s + 1)) != NULL; s++)
+            if (_segment_at(segment, s))
+                return s;
+        return NULL;
+    }
+    for (; s <= last; s++)
+        if (_segment_at(segment, s))
+            return s;
+    return NULL;
+}
+
+/* Return 1 if the name matches the pattern. A leading period must be
+   matched by a literal one. */
+int glob_match(const Glob_Matcher *m, const char *name, size_t length)
+{
+    const Glob_Segment *first = &m->segments[0], *last = &m->segments[m->count - 1];
+    const char *s = name, *end = name + length;
+
+    if (length < m->min_length || (name[0] == '.' && !m->literal_period) || m->invalid)
+        return 0;
+    if (!m->stars)
+        return length == first->width && _segment_at(first, name);
+
+    /* The ends are anchored, most names fail here.  */
+    if (!_segment_at(last, end - last->width) || !_segment_at(first, name))
+        return 0;
+    s += first->width;
+    end -= last->width;
+    for (int i = 1; i < m->count - 1; i++)
+    {
+        const Glob_Segment *segment = &m->segments[i];
+        if (segment->count == 0)
+            continue;
+        if (!(s = _segment_find(segment, s, end)))
+            return 0;
+        s += segment->width;
+    }
+    return 1;
+}
+
+void glob_free(Glob_Matcher *m)
+{
+    free(m->items);
+    free(m->segments);
+    free(m->text);
+}
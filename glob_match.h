@@ -0,0 +1,44 @@
+#include <stddef.h>
+
+#ifndef GLOB_MATCH_H
+#define GLOB_MATCH_H
+
+/* One byte wide element of a pattern. */
+typedef struct Glob_Item
+{
+    int kind;                 /* GLOB_LITERAL, GLOB_ANY or GLOB_CLASS */
+    const char *text;         /* bytes of a literal run */
+    size_t length;
+    unsigned char set[32];    /* bytes a class matches */
+} Glob_Item;
+
+/* Items between two stars, or before the first or after the last one. */
+typedef struct Glob_Segment
+{
+    Glob_Item *items;
+    int count;
+    size_t width;             /* bytes the segment matches */
+} Glob_Segment;
+
+/* Pattern compiled for matching many names. */
+typedef struct Glob_Matcher
+{
+    Glob_Segment *segments;
+    int count;
+    int stars;                /* the segments are separated by stars */
+    size_t min_length;        /* shortest name that can match */
+    int literal_period;       /* pattern starts with a literal '.' */
+    int invalid;              /* ends with a lone backslash, matches nothing */
+    Glob_Item *items;
+    char *text;               /* unescaped literal bytes */
+} Glob_Matcher;
+
+#define GLOB_LITERAL 0
+#define GLOB_ANY 1
+#define GLOB_CLASS 2
+
+void glob_compile(Glob_Matcher *m, const char *pattern);
+int glob_match(const Glob_Matcher *m, const char *name, size_t length);
+void glob_free(Glob_Matcher *m);
+
+#endif
@@ -0,0 +1,373 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "globstar.h"
+#include "glob_match.h"
+#include "arena.h"
+#include "custom_print.h"
+
+/* Pathname expansion. Each component of a pattern is compiled once with
+   glob_compile and matched against the names of a directory as it is
+   read. ** matches any number of directories, hidden ones and symbolic
+   links to directories excepted, as bash's globstar does.
+
+   Each directory to read is a task. Tasks are spread over a few threads,
+   each with a deque of its own: a thread takes its newest task, which
+   keeps the walk depth first, and an idle thread steals the oldest task
+   of another, which is usually the largest subtree left. Patterns without
+   ** read at most one directory per component match and stay on the
+   calling thread. Directories are
+   read with getdents64, whose d_type tells directories apart without a
+   stat per entry. The matches of all threads are sorted and deduplicated
+   at the end, so the order does not depend on the schedule. The threads
+   only use malloc, the line arena is filled once they are done. */
+
+#define GLOB_THREADS_MAX 8
+#define GLOB_DENTS_SIZE 32768
+
+typedef struct Glob_Task
+{
+    char *dir; /* "" or a path ending with '/' */
+    int index; /* component to match in it */
+} Glob_Task;
+
+typedef struct Glob_Worker
+{
+    pthread_mutex_t lock;
+    Glob_Task *tasks; /* deque, taken from the back and stolen from the front */
+    int first, count, size;
+    char **matches;
+    int match_count, match_size;
+    struct Glob_Walk *walk;
+} Glob_Worker;
+
+typedef struct Glob_Walk
+{
+    char **components;
+    char *magic;     /* component has wildcards */
+    Glob_Matcher *matchers; /* compiled components that have wildcards */
+    char *star;      /* component is ** */
+    int count;
+    int dirs_only;   /* pattern ends with '/' */
+    atomic_int pending; /* tasks queued or running */
+    Glob_Worker *workers;
+    int worker_count;
+} Glob_Walk;
+
+struct linux_dirent64
+{
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+void *_glob_alloc(void *ptr, size_t size)
+{
+    ptr = realloc(ptr, size);
+    if (!ptr)
+    {
+        my_fprintf(stderr, "psh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+char *_glob_path(const char *dir, const char *name, int slash)
+{
+    size_t dir_length = strlen(dir), name_length = strlen(name);
+    char *path = _glob_alloc(NULL, dir_length + name_length + 2);
+    memcpy(path, dir, dir_length);
+    memcpy(path + dir_length, name, name_length);
+    if (slash)
+        path[dir_length + name_length++] = '/';
+    path[dir_length + name_length] = '\0';
+    return path;
+}
+
+void _glob_push(Glob_Worker *w, char *dir, int index)
+{
+    atomic_fetch_add(&w->walk->pending, 1);
+    pthread_mutex_lock(&w->lock);
+    if (w->first + w->count == w->size)
+    {
+        if (w->first > 0)
+        {
+            memmove(w->tasks, w->tasks + w->first, w->count * sizeof(Glob_Task));
+            w->first = 0;
+        }
+        if (w->count == w->size)
+        {
+            w->size = w->size ? 2 * w->size : 64;
+            w->tasks = _glob_alloc(w->tasks, w->size * sizeof(Glob_Task));
+        }
+    }
+    w->tasks[w->first + w->count].dir = dir;
+    w->tasks[w->first + w->count].index = index;
+    w->count++;
+    pthread_mutex_unlock(&w->lock);
+}
+
+void _glob_match_found(Glob_Worker *w, char *path)
+{
+    if (w->match_count == w->match_size)
+    {
+        w->match_size = w->match_size ? 2 * w->match_size : 64;
+        w->matches = _glob_alloc(w->matches, w->match_size * sizeof(char *));
+    }
+    w->matches[w->match_count++] = path;
+}
+
+/* Go down into a directory matched by the component before index. A last
+   ** matches the directory itself too. */
+void _glob_descend(Glob_Worker *w, char *dir, int index)
+{
+    struct stat st;
+    if (w->walk->star[index] && index == w->walk->count - 1 && stat(dir, &st) == 0 && S_ISDIR(st.st_mode))
+        _glob_match_found(w, strdup(dir));
+    _glob_push(w, dir, index);
+}
+
+/* Take a task from the back of the deque, or steal one from the front. */
+int _glob_take(Glob_Worker *w, Glob_Task *task, int steal)
+{
+    int found = 0;
+    pthread_mutex_lock(&w->lock);
+    if (w->count > 0)
+    {
+        *task = steal ? w->tasks[w->first++] : w->tasks[w->first + w->count - 1];
+        w->count--;
+        found = 1;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return found;
+}
+
+/* Return 1 if the entry is a directory, following symbolic links if asked. */
+int _glob_is_dir(int fd, const char *name, unsigned char type, int follow)
+{
+    struct stat st;
+    if (type == DT_DIR)
+        return 1;
+    if (type != DT_UNKNOWN && (type != DT_LNK || !follow))
+        return 0;
+    return fstatat(fd, name, &st, follow ? 0 : AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+}
+
+/* Match an entry of the directory against the component at index. */
+void _glob_entry(Glob_Worker *w, int fd, const char *dir, const char *name, unsigned char type, int index)
+{
+    Glob_Walk *walk = w->walk;
+    const char *component = walk->components[index];
+    int last = index == walk->count - 1;
+
+    if (walk->magic[index] ? !glob_match(&walk->matchers[index], name, strlen(name)) : strcmp(component, name) != 0)
+        return;
+    if (!last)
+    {
+        if (_glob_is_dir(fd, name, type, 1))
+            _glob_descend(w, _glob_path(dir, name, 1), index + 1);
+    }
+    else if (!walk->dirs_only || _glob_is_dir(fd, name, type, 1))
+        _glob_match_found(w, _glob_path(dir, name, walk->dirs_only));
+}
+
+/* Read the directory of the task and match its entries. */
+void _glob_run(Glob_Worker *w, Glob_Task *task)
+{
+    Glob_Walk *walk = w->walk;
+    int index = task->index, last = index == walk->count - 1, fd;
+    char buffer[GLOB_DENTS_SIZE];
+    long n;
+
+    /* A literal component is looked up, not searched for.  */
+    if (!walk->star[index] && !walk->magic[index])
+    {
+        char *path = _glob_path(task->dir, walk->components[index], 0);
+        struct stat st;
+        if (!last)
+            _glob_descend(w, _glob_path(task->dir, walk->components[index], 1), index + 1);
+        else if (walk->dirs_only ? stat(path, &st) == 0 && S_ISDIR(st.st_mode) : lstat(path, &st) == 0)
+            _glob_match_found(w, _glob_path(task->dir, walk->components[index], walk->dirs_only));
+        free(path);
+        return;
+    }
+
+    fd = open(task->dir[0] ? task->dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    while ((n = syscall(SYS_getdents64, fd, buffer, sizeof(buffer))) > 0)
+    {
+        for (long pos = 0; pos < n;)
+        {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(buffer + pos);
+            const char *name = d->d_name;
+            pos += d->d_reclen;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+            if (!walk->star[index])
+            {
+                _glob_entry(w, fd, task->dir, name, d->d_type, index);
+                continue;
+            }
+            if (name[0] == '.')
+                continue;
+            /* ** as the last component matches everything below.  */
+            if (last)
+            {
+                if (!walk->dirs_only || _glob_is_dir(fd, name, d->d_type, 1))
+                    _glob_match_found(w, _glob_path(task->dir, name, walk->dirs_only));
+            }
+            else
+                _glob_entry(w, fd, task->dir, name, d->d_type, index + 1);
+            if (_glob_is_dir(fd, name, d->d_type, 0))
+                _glob_push(w, _glob_path(task->dir, name, 1), index);
+        }
+    }
+    close(fd);
+}
+
+void *_glob_worker(void *arg)
+{
+    Glob_Worker *w = arg;
+    Glob_Walk *walk = w->walk;
+    Glob_Task task;
+    int self = w - walk->workers;
+
+    for (;;)
+    {
+        int found = _glob_take(w, &task, 0);
+        for (int i = 1; !found && i < walk->worker_count; i++)
+            found = _glob_take(&walk->workers[(self + i) % walk->worker_count], &task, 1);
+        if (!found)
+        {
+            if (atomic_load(&walk->pending) == 0)
+                return NULL;
+            sched_yield();
+            continue;
+        }
+        _glob_run(w, &task);
+        free(task.dir);
+        atomic_fetch_sub(&walk->pending, 1);
+    }
+}
+
+int _glob_compare(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Copy the path into the line arena, with a backslash before each quote
+   and backslash in it, so that quote removal leaves the name as it is. */
+char *_glob_quote(const char *path)
+{
+    char *copy, *out;
+
+    if (!strpbrk(path, "'\"\\"))
+        return arena_strdup(&line_arena, path);
+    copy = out = arena_alloc(&line_arena, 2 * strlen(path) + 1);
+    for (; *path; path++)
+    {
+        if (*path == '\'' || *path == '"' || *path == '\\')
+            *out++ = '\\';
+        *out++ = *path;
+    }
+    *out = '\0';
+    return copy;
+}
+
+/* Add the sorted paths matching the pattern to the list, quoted as words.
+   Return the number of matches. */
+int glob_walk(const char *pattern, Word_List *out)
+{
+    char *copy = _glob_alloc(NULL, strlen(pattern) + 1), *component, *save;
+    size_t length = strlen(pattern);
+    Glob_Walk walk;
+    pthread_t threads[GLOB_THREADS_MAX];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    char **matches = NULL;
+    int match_count = 0, unique = 0, stars = 0;
+
+    memset(&walk, 0, sizeof(walk));
+    walk.components = _glob_alloc(NULL, (length / 2 + 2) * sizeof(char *));
+    walk.magic = _glob_alloc(NULL, length / 2 + 2);
+    walk.star = _glob_alloc(NULL, length / 2 + 2);
+    walk.matchers = _glob_alloc(NULL, (length / 2 + 2) * sizeof(Glob_Matcher));
+    walk.dirs_only = length > 0 && pattern[length - 1] == '/';
+    strcpy(copy, pattern);
+    for (component = strtok_r(copy, "/", &save); component; component = strtok_r(NULL, "/", &save))
+    {
+        int star = strcmp(component, "**") == 0;
+        /* Consecutive ** match the same as one.  */
+        if (star && walk.count > 0 && walk.star[walk.count - 1])
+            continue;
+        walk.components[walk.count] = component;
+        walk.star[walk.count] = star;
+        walk.magic[walk.count] = !star && strpbrk(component, "*?[\\") != NULL;
+        if (walk.magic[walk.count])
+            glob_compile(&walk.matchers[walk.count], component);
+        stars += star;
+        walk.count++;
+    }
+
+    walk.worker_count = !stars || cpus < 1 ? 1 : (cpus > GLOB_THREADS_MAX ? GLOB_THREADS_MAX : cpus);
+    walk.workers = _glob_alloc(NULL, walk.worker_count * sizeof(Glob_Worker));
+    memset(walk.workers, 0, walk.worker_count * sizeof(Glob_Worker));
+    for (int i = 0; i < walk.worker_count; i++)
+    {
+        pthread_mutex_init(&walk.workers[i].lock, NULL);
+        walk.workers[i].walk = &walk;
+    }
+
+    if (walk.count > 0)
+        _glob_push(&walk.workers[0], strdup(pattern[0] == '/' ? "/" : ""), 0);
+    for (int i = 1; i < walk.worker_count; i++)
+        if (pthread_create(&threads[i], NULL, _glob_worker, &walk.workers[i]) != 0)
+            walk.worker_count = i;
+    _glob_worker(&walk.workers[0]);
+
+    for (int i = 0; i < walk.worker_count; i++)
+    {
+        Glob_Worker *w = &walk.workers[i];
+        if (i > 0)
+            pthread_join(threads[i], NULL);
+        matches = _glob_alloc(matches, (match_count + w->match_count + 1) * sizeof(char *));
+        memcpy(matches + match_count, w->matches, w->match_count * sizeof(char *));
+        match_count += w->match_count;
+        pthread_mutex_destroy(&w->lock);
+        free(w->matches);
+        free(w->tasks);
+    }
+
+    qsort(matches, match_count, sizeof(char *), _glob_compare);
+    for (int i = 0; i < match_count; i++)
+        if (i == 0 || strcmp(matches[i], matches[i - 1]) != 0)
+        {
+            word_list_push(out, _glob_quote(matches[i]));
+            unique++;
+        }
+    for (int i = 0; i < match_count; i++)
+        free(matches[i]);
+
+    free(matches);
+    free(walk.workers);
+    free(walk.components);
+    for (int i = 0; i < walk.count; i++)
+        if (walk.magic[i])
+            glob_free(&walk.matchers[i]);
+    free(walk.matchers);
+    free(walk.magic);
+    free(walk.star);
+    free(copy);
+    return unique;
+}
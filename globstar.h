@@ -0,0 +1,8 @@
+#include "brace.h"
+
+#ifndef GLOBSTAR_H
+#define GLOBSTAR_H
+
+int glob_walk(const char *pattern, Word_List *out);
+
+#endif
@@ -3,41 +3,6 @@
 #include <stdio.h>
 #include <ctype.h>
 
-char *operators[] = {
-    ";",
-    "&&",
-    "||",
-    NULL
-};
-
-char *redirection[] = {
-    ">",
-    ">>",
-    "<",
-    "2>",
-    NULL
-};
-
-int isOperator(char *str)
-{
-    for (int i = 0; operators[i] != NULL; i++)
-    {
-        if (strcmp(operators[i], str) == 0)
-            return 1;
-    }
-    return 0;
-}
-
-int isRedirection(char *str)
-{
-    for (int i = 0; redirection[i] != NULL; i++)
-    {
-        if (strcmp(redirection[i], str) == 0)
-            return 1;
-    }
-    return 0;
-}
-
 int endsWith(const char *str, char c)
 {
     size_t len = strlen(str);
@@ -77,24 +42,6 @@ char *trim(char *str)
     return str;
 }
 
-char *concat_line(char **tokens, int start, int end) 
-{
-    char *str = malloc(256 * sizeof(char));
-    if (!str)
-    {
-        perror("allocation error");
-        exit(1);
-    }
-    int pos = 0;
-    for (int i = start; i < end; i++) {
-        for (int j = 0; tokens[i][j] != '\0'; j++) {
-            str[pos++] = tokens[i][j];
-        }
-        str[pos++] = ' ';
-    }
-    return str;
-}
-
 int containsChar(char *word, char c)
 {
     for (int i = 0; word[i] != '\0'; i++)
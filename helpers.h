@@ -1,8 +1,5 @@
-int isOperator(char *str);
-int isRedirection(char *str);
 int endsWith(const char *str, char c);
 char *trim(char *str);
-char *concat_line(char **tokens, int start, int end);
 int containsChar(char *word, char c);
 int count_elem_in_list(char **list);
 int startsWith(const char *str, const char *sub);
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "custom_print.h"
+#include "env.h"
 
 extern History *last_history;
 History *first_history = NULL;
@@ -44,7 +45,7 @@ void load_history()
     char *filename = HISTORY_FILE;
     char expanded_filename[1024];
     if (filename[0] == '~') {
-        const char *home = getenv("HOME");
+        const char *home = psh_getenv("HOME");
         if (home)
             snprintf(expanded_filename, sizeof(expanded_filename), "%s%s", home, filename + 1);
         else
@@ -84,7 +85,7 @@ void save_history()
     char *filename = HISTORY_FILE;
     char expanded_filename[1024];
     if (filename[0] == '~') {
-        const char *home = getenv("HOME");
+        const char *home = psh_getenv("HOME");
         if (home)
             snprintf(expanded_filename, sizeof(expanded_filename), "%s%s", home, filename + 1);
         else {
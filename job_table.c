@@ -0,0 +1,251 @@
+#include <stdlib.h>
+#include <string.h>
+#include "job_table.h"
+#include "custom_print.h"
+
+/* Lookup tables for job control, so reaping a child, 'fg %N' or 'jobs'
+   cost the same no matter how many jobs are active:
+   - pid -> process, for mark_process_status;
+   - pgid -> job, for find_job;
+   - a dense array indexed by job number, for %N. */
+
+#define MAP_INITIAL_SIZE 64
+
+/* Open-addressing hash map with linear probing keyed by a positive pid. */
+typedef struct Pid_Map
+{
+    pid_t *keys; /* 0 marks an empty slot */
+    void **values;
+    int size;
+    int count;
+} Pid_Map;
+
+extern job *first_job;
+job *last_job = NULL;
+Pid_Map processes_by_pid = {NULL, NULL, 0, 0};
+Pid_Map jobs_by_pgid = {NULL, NULL, 0, 0};
+job **job_numbers = NULL; /* job_numbers[n - 1] is job number n */
+int job_numbers_size = 0;
+int job_numbers_used = 0; /* highest job number in use */
+
+unsigned int _pid_slot(Pid_Map *map, pid_t key)
+{
+    return ((unsigned int)key * 2654435761u) & (map->size - 1);
+}
+
+void *_map_get(Pid_Map *map, pid_t key)
+{
+    if (map->count == 0)
+        return NULL;
+    for (unsigned int i = _pid_slot(map, key); map->keys[i] != 0; i = (i + 1) & (map->size - 1))
+        if (map->keys[i] == key)
+            return map->values[i];
+    return NULL;
+}
+
+void _map_put(Pid_Map *map, pid_t key, void *value);
+
+/* Double the capacity of the map. */
+void _map_grow(Pid_Map *map)
+{
+    Pid_Map old = *map;
+    map->size = old.size ? old.size * 2 : MAP_INITIAL_SIZE;
+    map->count = 0;
+    map->keys = calloc(map->size, sizeof(pid_t));
+    map->values = malloc(map->size * sizeof(void *));
+    if (!map->keys || !map->values)
+    {
+        my_fprintf(stderr, "psh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < old.size; i++)
+        if (old.keys[i] != 0)
+            _map_put(map, old.keys[i], old.values[i]);
+    free(old.keys);
+    free(old.values);
+}
+
+void _map_put(Pid_Map *map, pid_t key, void *value)
+{
+    unsigned int i;
+    if ((map->count + 1) * 2 > map->size)
+        _map_grow(map);
+    for (i = _pid_slot(map, key); map->keys[i] != 0; i = (i + 1) & (map->size - 1))
+        if (map->keys[i] == key)
+        {
+            map->values[i] = value;
+            return;
+        }
+    map->keys[i] = key;
+    map->values[i] = value;
+    map->count++;
+}
+
+/* Remove key. The following entries of the probe sequence are shifted back,
+   so no tombstones are needed. */
+void _map_remove(Pid_Map *map, pid_t key)
+{
+    unsigned int mask = map->size - 1, i, j;
+    if (map->count == 0)
+        return;
+    for (i = _pid_slot(map, key); map->keys[i] != key; i = (i + 1) & mask)
+        if (map->keys[i] == 0)
+            return;
+    map->keys[i] = 0;
+    map->count--;
+    for (j = (i + 1) & mask; map->keys[j] != 0; j = (j + 1) & mask)
+    {
+        unsigned int home = _pid_slot(map, map->keys[j]);
+        /* Move the entry into the hole if its home slot is not between the hole and j. */
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j))
+        {
+            map->keys[i] = map->keys[j];
+            map->values[i] = map->values[j];
+            map->keys[j] = 0;
+            i = j;
+        }
+    }
+}
+
+void _map_free(Pid_Map *map)
+{
+    free(map->keys);
+    free(map->values);
+    memset(map, 0, sizeof(Pid_Map));
+}
+
+/* Add a job to the end of the active job list. */
+void append_job(job *j)
+{
+    j->next = NULL;
+    if (first_job == NULL)
+        first_job = j;
+    else
+        last_job->next = j;
+    last_job = j;
+}
+
+/* Unlink a job from the active job list. prev is the job before it, or NULL. */
+void remove_job(job *j, job *prev)
+{
+    if (prev)
+        prev->next = j->next;
+    else
+        first_job = j->next;
+    if (last_job == j)
+        last_job = prev;
+}
+
+/* Put copy in the place of old, a copy of it with the same processes.
+   prev is the job before old, or NULL. */
+void replace_job(job *old, job *copy, job *prev)
+{
+    process *p, *q;
+
+    if (prev)
+        prev->next = copy;
+    else
+        first_job = copy;
+    if (last_job == old)
+        last_job = copy;
+
+    for (p = old->first_process, q = copy->first_process; p && q; p = p->next, q = q->next)
+        if (p->pid > 0 && _map_get(&processes_by_pid, p->pid) == p)
+            _map_put(&processes_by_pid, q->pid, q);
+    if (old->number != 0)
+    {
+        job_numbers[old->number - 1] = copy;
+        if (_map_get(&jobs_by_pgid, old->pgid) == old)
+            _map_put(&jobs_by_pgid, old->pgid, copy);
+    }
+}
+
+/* Make the process findable by its pid. */
+void register_process(job *j, process *p)
+{
+    p->job = j;
+    _map_put(&processes_by_pid, p->pid, p);
+}
+
+void unregister_process(process *p)
+{
+    if (p->pid > 0 && _map_get(&processes_by_pid, p->pid) == p)
+        _map_remove(&processes_by_pid, p->pid);
+}
+
+/* Find the process with the indicated pid. */
+process *find_process(pid_t pid)
+{
+    return _map_get(&processes_by_pid, pid);
+}
+
+/* Make the job findable by its pgid and give it the lowest free job number. */
+void register_job(job *j)
+{
+    int number = 0;
+
+    if (j->number != 0)
+        return;
+    _map_put(&jobs_by_pgid, j->pgid, j);
+
+    while (number < job_numbers_used && job_numbers[number] != NULL)
+        number++;
+    if (number == job_numbers_size)
+    {
+        job_numbers_size = job_numbers_size ? job_numbers_size * 2 : 16;
+        job_numbers = realloc(job_numbers, job_numbers_size * sizeof(job *));
+        if (!job_numbers)
+        {
+            my_fprintf(stderr, "psh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    job_numbers[number] = j;
+    j->number = number + 1;
+    if (j->number > job_numbers_used)
+        job_numbers_used = j->number;
+}
+
+/* Forget the job and its processes. */
+void unregister_job(job *j)
+{
+    for (process *p = j->first_process; p; p = p->next)
+        unregister_process(p);
+    if (j->number == 0)
+        return;
+    if (_map_get(&jobs_by_pgid, j->pgid) == j)
+        _map_remove(&jobs_by_pgid, j->pgid);
+    job_numbers[j->number - 1] = NULL;
+    while (job_numbers_used > 0 && job_numbers[job_numbers_used - 1] == NULL)
+        job_numbers_used--;
+    j->number = 0;
+}
+
+/* Find the active job with the indicated pgid.  */
+job *find_job(pid_t pgid)
+{
+    return _map_get(&jobs_by_pgid, pgid);
+}
+
+/* Find the job with the indicated job number, as used by %N. */
+job *find_job_by_number(int number)
+{
+    if (number < 1 || number > job_numbers_used)
+        return NULL;
+    return job_numbers[number - 1];
+}
+
+/* Return the highest job number in use. */
+int max_job_number()
+{
+    return job_numbers_used;
+}
+
+void free_job_table()
+{
+    _map_free(&processes_by_pid);
+    _map_free(&jobs_by_pgid);
+    free(job_numbers);
+    job_numbers = NULL;
+    job_numbers_size = job_numbers_used = 0;
+}
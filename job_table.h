@@ -0,0 +1,19 @@
+#include "data_structs.h"
+
+#ifndef JOB_TABLE_H
+#define JOB_TABLE_H
+
+void append_job(job *j);
+void remove_job(job *j, job *prev);
+void replace_job(job *old, job *copy, job *prev);
+void register_process(job *j, process *p);
+void unregister_process(process *p);
+process *find_process(pid_t pid);
+void register_job(job *j);
+void unregister_job(job *j);
+job *find_job(pid_t pgid);
+job *find_job_by_number(int number);
+int max_job_number();
+void free_job_table();
+
+#endif
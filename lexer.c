@@ -0,0 +1,273 @@
+#include <string.h>
+#include "lexer.h"
+
+/* Single pass lexer. The text is scanned once, every token is recorded as
+   an (offset, length, kind) slice of it and nothing is copied. lex_next
+   hands out one token at a time, so a script is read only as far as the
+   statement being parsed; lex collects a whole command line in one
+   growing array. */
+
+#define LEX_INITIAL_SIZE 32
+
+enum
+{
+    CH_WORD,
+    CH_SPACE,
+    CH_NEWLINE,
+    CH_META, /* starts an operator */
+    CH_QUOTE,
+    CH_BACKSLASH,
+    CH_COMMENT,
+    CH_NUL
+};
+
+unsigned char lex_class[256] = {
+    ['\0'] = CH_NUL,
+    [' '] = CH_SPACE,
+    ['\t'] = CH_SPACE,
+    ['\n'] = CH_NEWLINE,
+    ['\r'] = CH_SPACE,
+    ['\v'] = CH_SPACE,
+    ['\f'] = CH_SPACE,
+    ['|'] = CH_META,
+    ['&'] = CH_META,
+    [';'] = CH_META,
+    ['<'] = CH_META,
+    ['>'] = CH_META,
+    ['('] = CH_META,
+    [')'] = CH_META,
+    ['"'] = CH_QUOTE,
+    ['\''] = CH_QUOTE,
+    ['\\'] = CH_BACKSLASH,
+    ['#'] = CH_COMMENT,
+};
+
+/* The character at i, or NUL past the end of the text. */
+#define _lex_at(lx, i) ((i) < (lx)->length ? (lx)->text[i] : '\0')
+
+void _lex_set(Lex_Token *token, size_t offset, int length, Lex_Kind kind, int flags)
+{
+    token->offset = offset;
+    token->length = length;
+    token->kind = kind;
+    token->flags = flags;
+}
+
+/* Return the kind and length of the operator at i. */
+Lex_Kind _lex_operator(Lexer *lx, size_t i, int *length)
+{
+    char c = lx->text[i], next = _lex_at(lx, i + 1);
+
+    *length = 2;
+    switch (c)
+    {
+    case '|':
+        if (next == '|')
+            return LEX_OR_IF;
+        break;
+    case '&':
+        if (next == '&')
+            return LEX_AND_IF;
+        break;
+    case '>':
+        if (next == '>')
+            return LEX_DGREAT;
+        break;
+    case ';':
+        if (next == ';')
+            return LEX_DSEMI;
+        break;
+    }
+    *length = 1;
+    switch (c)
+    {
+    case '|':
+        return LEX_PIPE;
+    case '&':
+        return LEX_AMP;
+    case ';':
+        return LEX_SEMI;
+    case '<':
+        return LEX_LESS;
+    case '(':
+        return LEX_LPAREN;
+    case ')':
+        return LEX_RPAREN;
+    default:
+        return LEX_GREAT;
+    }
+}
+
+void lexer_init(Lexer *lx, const char *text, size_t length)
+{
+    lx->text = text;
+    lx->length = length;
+    lx->pos = 0;
+}
+
+/* Read the next token. Past the end of the text every token is LEX_END. */
+void lex_next(Lexer *lx, Lex_Token *token)
+{
+    size_t i = lx->pos, start;
+    int flags = 0, length;
+    char quote = 0;
+
+    for (;;)
+    {
+        while (lex_class[(unsigned char)_lex_at(lx, i)] == CH_SPACE)
+            i++;
+        start = i;
+
+        switch (lex_class[(unsigned char)_lex_at(lx, i)])
+        {
+        case CH_NUL:
+            if (i < lx->length)
+            {
+                i++;
+                continue;
+            }
+            _lex_set(token, i, 0, LEX_END, 0);
+            lx->pos = i;
+            return;
+        case CH_NEWLINE:
+            _lex_set(token, i, 1, LEX_NEWLINE, 0);
+            lx->pos = i + 1;
+            return;
+        case CH_COMMENT:
+            while (i < lx->length && lx->text[i] != '\n')
+                i++;
+            continue;
+        case CH_META:
+        {
+            Lex_Kind kind = _lex_operator(lx, i, &length);
+            _lex_set(token, i, length, kind, 0);
+            lx->pos = i + length;
+            return;
+        }
+        case CH_BACKSLASH:
+            /* An escaped newline joins the lines. */
+            if (_lex_at(lx, i + 1) == '\n')
+            {
+                i += 2;
+                continue;
+            }
+            if (i + 1 == lx->length)
+            {
+                _lex_set(token, i, 1, LEX_CONTINUATION, 0);
+                lx->pos = i + 1;
+                return;
+            }
+            break;
+        }
+        break;
+    }
+
+    if (lx->text[i] == '2' && _lex_at(lx, i + 1) == '>' && _lex_at(lx, i + 2) != '>')
+    {
+        _lex_set(token, i, 2, LEX_ERR_GREAT, 0);
+        lx->pos = i + 2;
+        return;
+    }
+
+    /* A word runs until unquoted space, an operator, or the end of the text. */
+    for (; i < lx->length; i++)
+    {
+        unsigned char c = lx->text[i];
+        if (c == '\0')
+            break;
+        if (quote)
+        {
+            if (c == quote)
+                quote = 0;
+            /* Inside double quotes a backslash escapes the next character. */
+            else if (c == '\\' && quote == '"' && i + 1 < lx->length)
+                i++;
+            continue;
+        }
+        switch (lex_class[c])
+        {
+        case CH_QUOTE:
+            quote = c;
+            flags |= LEX_QUOTED;
+            continue;
+        case CH_BACKSLASH:
+            /* Keep the escaped character in the word, unless the backslash
+               ends the text and asks for a continuation or escapes a newline. */
+            if (i + 1 < lx->length && lx->text[i + 1] != '\n')
+                i++;
+            else
+                goto end_of_word;
+            continue;
+        case CH_SPACE:
+        case CH_NEWLINE:
+        case CH_META:
+            goto end_of_word;
+        }
+    }
+end_of_word:
+    if (quote)
+        flags |= LEX_OPEN_QUOTE;
+    if (i - start == 1 && lx->text[start] == '!')
+        _lex_set(token, start, 1, LEX_BANG, 0);
+    else
+        _lex_set(token, start, i - start, LEX_WORD, flags);
+    lx->pos = i;
+}
+
+/* Split the line into tokens. The array is allocated in the arena and ends
+   with a LEX_END token, which is not included in count. */
+Lex_Token *lex(Arena *a, const char *line, int *count)
+{
+    int size = LEX_INITIAL_SIZE, n = 0;
+    Lex_Token *tokens = arena_alloc(a, size * sizeof(Lex_Token));
+    Lexer lx;
+
+    lexer_init(&lx, line, strlen(line));
+    for (;;)
+    {
+        if (n == size)
+        {
+            tokens = arena_grow(a, tokens, size * sizeof(Lex_Token), size * 2 * sizeof(Lex_Token));
+            size *= 2;
+        }
+        lex_next(&lx, &tokens[n]);
+        if (tokens[n++].kind == LEX_END)
+            break;
+    }
+    if (count)
+        *count = n - 1;
+    return tokens;
+}
+
+int lex_is_redirection(Lex_Kind kind)
+{
+    return kind == LEX_LESS || kind == LEX_GREAT || kind == LEX_DGREAT || kind == LEX_ERR_GREAT;
+}
+
+/* Return 1 if a word at index of the token list would be a command name. */
+int lex_command_position(Lex_Token *tokens, int index)
+{
+    if (index == 0)
+        return 1;
+    switch (tokens[index - 1].kind)
+    {
+    case LEX_BANG:
+    case LEX_PIPE:
+    case LEX_AND_IF:
+    case LEX_OR_IF:
+    case LEX_SEMI:
+    case LEX_DSEMI:
+    case LEX_AMP:
+    case LEX_NEWLINE:
+    case LEX_RPAREN:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* Copy the text of a token into the arena. */
+char *lex_text(Arena *a, const char *line, Lex_Token *token)
+{
+    return arena_strndup(a, line + token->offset, token->length);
+}
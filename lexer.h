@@ -0,0 +1,56 @@
+#include <stddef.h>
+#include "arena.h"
+
+#ifndef LEXER_H
+#define LEXER_H
+
+typedef enum Lex_Kind
+{
+    LEX_WORD,
+    LEX_BANG,         /* ! */
+    LEX_PIPE,         /* | */
+    LEX_AND_IF,       /* && */
+    LEX_OR_IF,        /* || */
+    LEX_SEMI,         /* ; */
+    LEX_DSEMI,        /* ;; */
+    LEX_AMP,          /* & */
+    LEX_LESS,         /* < */
+    LEX_GREAT,        /* > */
+    LEX_DGREAT,       /* >> */
+    LEX_ERR_GREAT,    /* 2> */
+    LEX_LPAREN,       /* ( */
+    LEX_RPAREN,       /* ) */
+    LEX_NEWLINE,      /* separates statements of a script */
+    LEX_CONTINUATION, /* \ at the end of the line */
+    LEX_END
+} Lex_Kind;
+
+/* Flags of a LEX_WORD. */
+#define LEX_QUOTED 1     /* the word contains quotes */
+#define LEX_OPEN_QUOTE 2 /* a quote is still open at the end of the line */
+
+/* A token is a slice of the text it was read from. */
+typedef struct Lex_Token
+{
+    int offset;
+    int length;
+    Lex_Kind kind;
+    int flags;
+} Lex_Token;
+
+/* Reads one token at a time from text that need not be NUL-terminated. */
+typedef struct Lexer
+{
+    const char *text;
+    size_t length;
+    size_t pos;
+} Lexer;
+
+void lexer_init(Lexer *lx, const char *text, size_t length);
+void lex_next(Lexer *lx, Lex_Token *token);
+Lex_Token *lex(Arena *a, const char *line, int *count);
+int lex_is_redirection(Lex_Kind kind);
+int lex_command_position(Lex_Token *tokens, int index);
+char *lex_text(Arena *a, const char *line, Lex_Token *token);
+
+#endif
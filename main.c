@@ -1,9 +1,12 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <spawn.h>
 #include <sys/wait.h>
 #include <sys/ioctl.h>
+#include <poll.h>
 #include <signal.h>
 #include <termios.h>
 #include <errno.h>
@@ -16,39 +19,72 @@
 #include "custom_print.h"
 #include "history.h"
 #include "autocompletion.h"
+#include "prompt.h"
+#include "cmd_index.h"
+#include "cmd_hash.h"
+#include "events.h"
+#include "job_table.h"
+#include "arena.h"
+#include "lexer.h"
+#include "parser.h"
+#include "parse_cache.h"
+#include "script.h"
+#include "vm.h"
+#include "batch.h"
+#include "utilities.h"
 
 #define BUF_SIZE 2048
-#define TOK_BUF_SIZE 256
+#define INPUT_BUF_SIZE 256
+
+/* Reasons for wait_for_input to return before input is available. */
+#define INPUT_PROMPT_CHANGED 1
+#define INPUT_JOBS_CHANGED 2
+
+/* posix_spawn can hand the terminal to the new process group since glibc 2.35. */
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+#define HAVE_SPAWN_TCSETPGRP 1
+#endif
 
 pid_t shell_pgid;
 struct termios shell_tmodes, raw;
 int shell_terminal;
 int shell_is_interactive;
 job *first_job = NULL;
-int last_proc_exit_status, inverted;
-Env *first_env = NULL;
+int last_proc_exit_status;
 History *last_history = NULL;
 History *cur_history = NULL;
 int tab_count = -1;
 int term_width;
+char input_buf[INPUT_BUF_SIZE];
+/* Text of a bracketed paste still to be inserted into the line.  */
+char *paste_text = NULL;
+size_t paste_len = 0, paste_pos = 0, paste_size = 0;
+int input_pos = 0, input_len = 0;
+struct pollfd *poll_fds = NULL;
+int poll_fds_cap = 0;
 
 void init_line_editing();
 void disable_raw_mode();
-void free_wr_list(wrapper **list);
 int get_terminal_width();
 
-int main(void)
+int main(int argc, char **argv)
 {
-    char *line = malloc(BUF_SIZE * sizeof(char));
+    char *line;
     /* Trim fucntion increments the pointer, which means that if you free the new pointer,
        it will cause a segfault, as that new pointer had never been malloc'ed. To fix that
        a temporary variable is introduced to store the original pointer. */
-    char *temp_line = line;
-    char **tokens;
-    wrapper **list;
+    char *temp_line;
+    size_t line_size = BUF_SIZE;
+    Node *tree;
+    Parse_Status parse_status;
     int status = 1;
-    int check_status;
     int prompt_type = 0;
+
+    /* Scripts and commands given with -c run without the line editor. */
+    if (argc > 1 || (!isatty(STDIN_FILENO) && !getenv("PSH_NON_INTERACTIVE")))
+        return script_main(argc, argv);
+
+    line = temp_line = malloc(BUF_SIZE * sizeof(char));
     term_width = get_terminal_width();
 
     if (!line)
@@ -56,10 +92,12 @@ int main(void)
         my_fprintf(stderr, "psh: allocation error\n");
         exit(EXIT_FAILURE);
     }
+    line[0] = '\0';
 
-    char *prompt = NULL;
     /* Make sure the shell is a foreground process. */
     init_shell();
+    /* Remember the working directory for the prompt. */
+    init_cwd();
     /* Read data from a configuration file. */
     read_config_file();
     /* Read data from the history file. */
@@ -69,15 +107,14 @@ int main(void)
     {
         /* Regular shell cycle. */
 
-        /* Updating the prompts for dir and branch changes.
-           In case the prompt is configured via .pshrc file.  */
-        if (prompt_type == 0)
-            prompt = configure_prompt("PS1", prompt);
-        else
-            prompt = configure_prompt("PS2", prompt);
-
-        read_line(line, prompt);
-        line = trim(line);
+        /* Only the prompt segments affected by dir and branch changes are redrawn.
+           The prompts are compiled when PS1 or PS2 is set.  */
+        /* The line may grow, so a continued line is moved back to the start
+           of its buffer first.  */
+        if (line != temp_line)
+            memmove(temp_line, line, strlen(line) + 1);
+        read_line(&temp_line, &line_size, prompt_type == 0 ? PROMPT_PS1 : PROMPT_PS2);
+        line = trim(temp_line);
         /* Empty command check. */
         if (line[0] == '\0')
             continue;
@@ -87,43 +124,36 @@ int main(void)
         cur_history = NULL;
 
         /* Check if the provided line can be parsed. */
-        tokens = tokenize(line);
-        if ((check_status = check_tokens(tokens)) == 0)
+        tree = parse_cached(line, &parse_status);
+        if (parse_status == PARSE_OK)
         {
-            expand(tokens); // perform various expansions
-            list = create_jobs(tokens);
-            if (list == NULL)
-            {
-                free(list);
-                continue;
-            }
-            status = launch_jobs(list);
+            status = run_node(tree, 0);
             do_job_notification();
+            prompt_invalidate_status();
             prompt_type = 0;
             line[0] = '\0';
 
-            free_wr_list(list);
-            free_tokens(tokens);
+            /* Everything but the jobs still running is dropped with the line.  */
+            promote_jobs();
+            arena_reset(&line_arena);
         }
-        else if (check_status == 1)
+        else if (parse_status == PARSE_INCOMPLETE)
         { // Case when line continuation is needed.
             prompt_type = 1;
-            free_tokens(tokens);
+            arena_reset(&line_arena);
             continue;
         }
         else
         { // Syntax error occured.
             line[0] = '\0';
             prompt_type = 0;
-            free_tokens(tokens);
+            arena_reset(&line_arena);
             continue;
         }
 
         if (temp_line != line)
         {
-            free(temp_line);
-            line = malloc(BUF_SIZE * sizeof(char));
-            temp_line = line;
+            line = temp_line;
             line[0] = '\0';
         }
     } while (status);
@@ -135,24 +165,20 @@ int main(void)
 
     free_token_to_complete();
     free_possible_completions();
-
-    free(prompt);
-    free(line);
+    free_cmd_index();
+    free_job_table();
+    free_functions();
+    parse_cache_clear(1);
+    arena_free(&line_arena);
+    hash_clear();
+    free(poll_fds);
+
+    free_prompts();
+    free(temp_line);
+    free(paste_text);
     return 0;
 }
 
-/* Free the wrapper list. */
-void free_wr_list(wrapper **list)
-{
-    for (int i = 0; list[i] != NULL; i++)
-    {
-        if (list[i]->type == OPERATOR)
-            free(list[i]->oper);
-        free(list[i]);
-    }
-    free(list);
-}
-
 /* Free the token list. */
 void free_tokens(char **tokens)
 {
@@ -188,756 +214,485 @@ void handle_sigwinch(int sig)
     term_width = get_terminal_width();
 }
 
-/* Enable raw mode and set up a SIGWINCH signal listener. */
+/* Enable raw mode and set up a SIGWINCH signal listener,
+   unless SIGWINCH is read from the signal fd. */
 void init_line_editing()
 {
     enable_raw_mode();
-    signal(SIGWINCH, handle_sigwinch);
+    if (signal_fd < 0)
+        signal(SIGWINCH, handle_sigwinch);
 }
 
-/* Categorize the tokens for the later syntax check. */
-int *categorize_tokens(char **tokens)
+/* Remove the quotes from a word, keeping what they quote.  */
+char *remove_quotes(const char *word)
 {
-    int *arr = malloc(TOK_BUF_SIZE * sizeof(int));
-    int pos = 0, first = 1;
-    for (int i = 0; tokens[i] != NULL; i++)
+    char *result = arena_alloc(&line_arena, strlen(word) + 1), *out = result;
+    char quote = 0;
+    for (; *word; word++)
     {
-        switch (tokens[i][0])
+        if (quote)
         {
-        case '!':
-            if (first)
-                arr[pos++] = INVERSION;
-            else
-                arr[pos++] = ARG;
-            break;
-        case '|':
-            arr[pos++] = PIPE;
-            first = 1;
-            break;
-        case '"':
-            arr[pos++] = QUOTE;
-            if (strcmp(tokens[i], "\"") == 0)
-                i++;
-            while (tokens[i] != NULL && !endsWith(tokens[i], '"'))
-                i++;
-            if (!tokens[i])
-            {
-                arr[pos] = END;
-                return arr;
-            }
-            arr[pos++] = QUOTE_END;
-            break;
-        case '\'':
-            arr[pos++] = QUOTE;
-            if (strcmp(tokens[i], "\"") == 0)
-                i++;
-            while (tokens[i] != NULL && !endsWith(tokens[i], '\''))
-                i++;
-            if (!tokens[i])
-            {
-                arr[pos] = END;
-                return arr;
-            }
-            arr[pos++] = QUOTE_END;
-            break;
-        default:
-            if (isRedirection(tokens[i]))
-                arr[pos++] = REDIRECTION;
-            else if (isOperator(tokens[i]))
-            {
-                arr[pos++] = OPER;
-                first = 1;
-            }
-            else if (endsWith(tokens[i], ';'))
-            {
-                if (first)
-                    arr[pos++] = CMD;
-                else
-                    arr[pos++] = ARG;
-                arr[pos++] = OPER;
-                first = 1;
-            }
-            else if (endsWith(tokens[i], '\\'))
-                arr[pos++] = LINE_CONTINUATION;
-            else if (strcmp(tokens[i], "&") == 0)
-            {
-                arr[pos++] = BG_OPER;
-                first = 1;
-            }
-            else if (first)
-            {
-                arr[pos++] = CMD;
-                first = 0;
-            }
+            if (*word == quote)
+                quote = 0;
             else
-                arr[pos++] = ARG;
-            break;
+                *out++ = *word;
         }
+        else if (*word == '"' || *word == '\'')
+            quote = *word;
+        else if (*word == '\\' && word[1] != '\0')
+            *out++ = *++word;
+        else
+            *out++ = *word;
     }
-    arr[pos] = END;
+    *out = '\0';
+    return result;
+}
 
-    return arr;
+/* Expand a single word, such as a redirection target.  */
+char *expand_word(char *word)
+{
+    char *words[2] = {word, NULL};
+    char **expanded = expand(words, NULL);
+    return remove_quotes(expanded[0] ? expanded[0] : "");
 }
 
-/* Check if the provided tokens make sense syntactically.
-   Return 1 if line continuation is needed, -1 if error occured, 0 - success. */
-int check_tokens(char **tokens)
+/* Create a job for a pipeline. Its words are expanded now, so that each
+   pipeline sees the effects of the ones before it.  */
+job *create_job(Node *pipeline, int background)
 {
-    int *arr = categorize_tokens(tokens);
-    int first = 1;
-    int last_token, next_token;
-    for (int i = 0; arr[i] != END; i++)
+    // Create a new job, promoted out of the line arena if it is still running when the line ends
+    job *j = arena_alloc(&line_arena, sizeof(job));
+    process **last = &j->first_process;
+    j->stdin = STDIN_FILENO;
+    j->stdout = STDOUT_FILENO;
+    j->stderr = STDERR_FILENO;
+    j->pgid = 0, j->notified = 0, j->number = 0, j->promoted = 0, j->batched = 0;
+    j->inverted = (pipeline->flags & NODE_INVERTED) != 0;
+    j->in_bg = background, j->foreground = !background;
+    j->command = background ? arena_sprintf(&line_arena, "%s &", pipeline->text) : pipeline->text;
+    j->first_process = NULL;
+    append_job(j);
+
+    /* Create the processes. */
+    for (int i = 0; i < pipeline->count; i++)
     {
-        next_token = arr[i + 1];
-        if (first)
+        Node *command = pipeline->children[i];
+        process *p = arena_alloc(&line_arena, sizeof(process));
+        int argc = count_elem_in_list(command->words);
+        char **words = arena_alloc(&line_arena, (argc + 1) * sizeof(char *));
+        int *counts = arena_alloc(&line_arena, (argc + 1) * sizeof(int));
+
+        p->completed = 0, p->stopped = 0;
+        p->pid = 0, p->pidfd = -1, p->path = NULL;
+        p->next = NULL;
+        p->infile = NULL, p->outfile = NULL, p->errfile = NULL;
+        p->append_mode = 0, p->status = 0, p->exit_status = 0, p->job = j;
+
+        /* The tree is not modified, expansion works on a copy of the words.  */
+        memcpy(words, command->words, (argc + 1) * sizeof(char *));
+        p->argv = expand(words, counts);
+        batch_fixed_words(p, counts, argc);
+        for (int k = 0; p->argv[k] != NULL; k++)
+            p->argv[k] = remove_quotes(p->argv[k]);
+
+        for (Redirect *r = command->redirects; r; r = r->next)
         {
-            if (arr[i] == INVERSION)
-            {
-                if (next_token == CMD)
-                {
-                    last_token = INVERSION;
-                    continue;
-                }
-                else if (next_token == LINE_CONTINUATION)
-                {
-                    free(arr);
-                    return 1;
-                }
-                else
-                {
-                    my_perror("Wrong after '!'");
-                    free(arr);
-                    return -1;
-                }
-            }
-            else if (arr[i] == CMD)
+            if (r->kind == LEX_GREAT || r->kind == LEX_DGREAT)
             {
-                first = 0;
-                last_token = CMD;
-                continue;
+                p->outfile = expand_word(r->target);
+                p->append_mode = r->kind == LEX_DGREAT;
             }
+            else if (r->kind == LEX_LESS)
+                p->infile = expand_word(r->target);
             else
-            {
-                my_perror("Wrong first word!");
-                free(arr);
-                return -1;
-            }
+                p->errfile = expand_word(r->target);
         }
-        switch (arr[i])
-        {
-        case ARG:
-            if (last_token == CMD ||
-                last_token == ARG ||
-                last_token == QUOTE_END)
-            {
-                if (next_token != CMD &&
-                    next_token != INVERSION)
-                {
-                    last_token = ARG;
-                    break;
-                }
-                else
-                {
-                    my_perror("Wrong after ARG!");
-                    free(arr);
-                    return -1;
-                }
-            }
-            else if (last_token == REDIRECTION)
-            {
-                if (next_token == REDIRECTION ||
-                    next_token == LINE_CONTINUATION ||
-                    next_token == PIPE ||
-                    next_token == END ||
-                    next_token == OPER ||
-                    next_token == BG_OPER)
-                {
-                    last_token = ARG;
-                    break;
-                }
-                else
-                {
-                    my_perror("Wrong after ARG2!");
-                    free(arr);
-                    return -1;
-                }
-            }
-            else
-            {
-                my_perror("Weird error 1!");
-                free(arr);
-                return -1;
-            }
-
-        case PIPE:
-            if (last_token == CMD ||
-                last_token == ARG ||
-                last_token == QUOTE_END)
-            {
-                if (next_token == CMD ||
-                    next_token == INVERSION)
-                {
-                    first = 1;
-                    last_token = PIPE;
-                    break;
-                }
-                else if (next_token == END ||
-                         next_token == LINE_CONTINUATION)
-                {
-                    free(arr);
-                    return 1;
-                }
-                else
-                {
-                    my_perror("Wrong after PIPE!");
-                    free(arr);
-                    return -1;
-                }
-            }
-            else
-            {
-                my_perror("Weird error 2!");
-                free(arr);
-                return -1;
-            }
-
-        case REDIRECTION:
-            if (last_token == CMD ||
-                last_token == ARG ||
-                last_token == QUOTE_END)
-            {
-                if (next_token == ARG ||
-                    next_token == QUOTE_END)
-                {
-                    last_token = REDIRECTION;
-                    break;
-                }
-                else if (next_token == END ||
-                         next_token == LINE_CONTINUATION)
-                {
-                    free(arr);
-                    return 1;
-                }
-                else
-                {
-                    my_perror("Wrong after REDIRECTION!");
-                    free(arr);
-                    return -1;
-                }
-            }
-            else
-            {
-                my_perror("Weird error 3!");
-                free(arr);
-                return -1;
-            }
-
-        case OPER:
-            if (last_token == CMD ||
-                last_token == ARG ||
-                last_token == QUOTE_END)
-            {
-                if (next_token == CMD ||
-                    next_token == INVERSION)
-                {
-                    first = 1;
-                    last_token = OPER;
-                    break;
-                }
-                else if (next_token == END ||
-                         next_token == LINE_CONTINUATION)
-                {
-                    free(arr);
-                    return 1;
-                }
-                else
-                {
-                    my_perror("Wrong after OPERATOR!");
-                    free(arr);
-                    return -1;
-                }
-            }
-            else
-            {
-                my_perror("Weird error 4!");
-                free(arr);
-                return -1;
-            }
 
-        case LINE_CONTINUATION:
-            if (next_token == END)
-            {
-                free(arr);
-                return 1;
-            }
-            else
-            {
-                my_perror("Wrong after LINE_CONT!");
-                free(arr);
-                return -1;
-            }
+        *last = p;
+        last = &p->next;
+    }
 
-        case QUOTE:
-            if (last_token == CMD ||
-                last_token == ARG ||
-                last_token == QUOTE ||
-                last_token == QUOTE_END)
-            {
-                if (next_token == QUOTE ||
-                    next_token == QUOTE_END)
-                {
-                    last_token = QUOTE;
-                    break;
-                }
-                else if (next_token == END ||
-                         next_token == LINE_CONTINUATION)
-                {
-                    free(arr);
-                    return 1;
-                }
-                else
-                {
-                    my_perror("Wrong after QUOTE!");
-                    free(arr);
-                    return -1;
-                }
-            }
-            else
-            {
-                my_perror("Weird error 5!");
-                free(arr);
-                return -1;
-            }
+    return j;
+}
 
-        case QUOTE_END:
-            if (last_token == CMD ||
-                last_token == ARG ||
-                last_token == QUOTE)
-            {
-                if (next_token != CMD &&
-                    next_token != INVERSION)
-                {
-                    last_token = QUOTE_END;
-                    break;
-                }
-                else
-                {
-                    my_perror("Wrong after QUOTE!");
-                    free(arr);
-                    return -1;
-                }
-            }
-            else
-            {
-                my_perror("Weird error 6!");
-                free(arr);
-                return -1;
-            }
+/* Run a pipeline. Return 0 if the shell should exit.  */
+int run_pipeline(Node *pipeline, int background)
+{
+    job *j;
+    Function *f;
+    int status = -1;
 
-        case BG_OPER:
-            if (last_token == CMD ||
-                last_token == ARG ||
-                last_token == QUOTE_END)
-            {
-                if (next_token == CMD ||
-                    next_token == INVERSION ||
-                    next_token == END)
-                {
-                    first = 1;
-                    last_token = BG_OPER;
-                    break;
-                }
-                else if (next_token == LINE_CONTINUATION)
-                {
-                    free(arr);
-                    return 1;
-                }
-                else
-                {
-                    my_perror("Wrong after BG_OPER!");
-                    free(arr);
-                    return -1;
-                }
-            }
-            else
-            {
-                my_perror("Weird error 7!");
-                free(arr);
-                return -1;
-            }
-        }
+    if (pipeline->children[0]->type != NODE_COMMAND)
+    {
+        if (!run_compound(pipeline->children[0]))
+            return 0;
+        if (pipeline->flags & NODE_INVERTED)
+            last_proc_exit_status = !last_proc_exit_status;
+        return 1;
     }
-    free(arr);
-    return 0;
-}
 
-/* Function used for debugging. */
-void print_list(wrapper **list)
-{
-    for (int i = 0; list[i] != NULL; i++)
+    j = create_job(pipeline, background);
+    /* Functions and builtins run in the shell itself.  */
+    if (pipeline->count == 1 && (f = find_function(j->first_process->argv[0])))
+        status = call_function(f, j->first_process->argv);
+    else if (pipeline->count == 1)
+        status = execute(j, !background);
+    if (status == 0)
+        return 0;
+    if (status == -1)
     {
-        if (list[i]->type == OPERATOR)
-        {
-            my_printf("Type OPERATOR\n");
-            my_printf("Text %s\n", list[i]->oper);
-        }
+        if (pipeline->count == 1 && !background && autobatch_width() &&
+            !argv_fits(j->first_process->argv))
+            run_batched(j);
         else
-        {
-            my_printf("Type JOB\n");
-            my_printf("Command %s\n", list[i]->j->command);
-            my_printf("PGID %d\n", list[i]->j->pgid);
-            my_printf("\tProcesses: \n");
-            process *temp = list[i]->j->first_process;
-            do
-            {
-                int k = 0;
-                while (temp->argv[k] != NULL)
-                {
-                    my_printf("\tArg %s\n", temp->argv[k]);
-                    k++;
-                }
-                temp = temp->next;
-            } while (temp != NULL);
-        }
+            launch_job(j, j->foreground);
+        if (background)
+            last_proc_exit_status = 0;
+        else if (job_is_completed(j))
+            /* Free the job number now, the job is removed after the line.  */
+            unregister_job(j);
     }
+    if (j->inverted && !background)
+        last_proc_exit_status = !last_proc_exit_status;
+    return 1;
 }
 
-/* Launch jobs sequentially. Store the exit status of perfomed job. */
-int launch_jobs(wrapper **list)
+/* Run the syntax tree of a command line. A background && or || list runs
+   its last pipeline in the background. Return 0 if the shell should exit.  */
+int run_node(Node *node, int background)
 {
-    int first = 1, status = 1;
-    for (int i = 0; list[i] != NULL; i++)
+    switch (node->type)
     {
-        if (first)
-        {
-            first = 0;
-            status = execute(list[i]->j, 1);
-            if (status == 0)
-                break;
-            else if (status == 1)
-                continue;
-            else
-            {
-                inverted = list[i]->j->inverted;
-                launch_job(list[i]->j, list[i]->j->foreground);
-                if (inverted)
-                    last_proc_exit_status = !last_proc_exit_status;
-            }
-        }
-        else if (list[i - 1]->type == OPERATOR && list[i]->type == JOB)
-        {
-            if (strcmp(list[i - 1]->oper, ";") == 0)
-            {
-                inverted = list[i]->j->inverted;
-                launch_job(list[i]->j, list[i]->j->foreground);
-                if (inverted)
-                    last_proc_exit_status = !last_proc_exit_status;
-            }
-            else if (strcmp(list[i - 1]->oper, "&") == 0)
-            {
-                launch_job(list[i]->j, list[i]->j->foreground);
-                last_proc_exit_status = 0;
-            }
-            else if (strcmp(list[i - 1]->oper, "&&") == 0)
-            {
-                if (last_proc_exit_status == EXIT_SUCCESS)
-                {
-                    inverted = list[i]->j->inverted;
-                    launch_job(list[i]->j, list[i]->j->foreground);
-                    if (inverted)
-                        last_proc_exit_status = !last_proc_exit_status;
-                }
-                else
-                {
-                    return 1;
-                }
-            }
-            else
-            {
-                if (last_proc_exit_status != EXIT_SUCCESS)
-                {
-                    inverted = list[i]->j->inverted;
-                    launch_job(list[i]->j, list[i]->j->foreground);
-                    if (inverted)
-                        last_proc_exit_status = !last_proc_exit_status;
-                }
-                else
-                {
-                    return 1;
-                }
-            }
-        }
+    case NODE_LIST:
+        for (int i = 0; i < node->count; i++)
+            if (!run_node(node->children[i], (node->children[i]->flags & NODE_BACKGROUND) != 0))
+                return 0;
+        return 1;
+    case NODE_AND:
+        if (!run_node(node->children[0], 0))
+            return 0;
+        if (last_proc_exit_status == EXIT_SUCCESS)
+            return run_node(node->children[1], background);
+        return 1;
+    case NODE_OR:
+        if (!run_node(node->children[0], 0))
+            return 0;
+        if (last_proc_exit_status != EXIT_SUCCESS)
+            return run_node(node->children[1], background);
+        return 1;
+    case NODE_PIPELINE:
+        return run_pipeline(node, background);
+    default:
+        return 1;
     }
-    return status;
 }
 
-/* Create a wrapper for a job. */
-wrapper *create_job_wrapper(char **tokens, int start, int end)
+void clear_line(int position)
 {
-    wrapper *wr = malloc(sizeof(wrapper));
-    if (!wr)
-    {
-        my_fprintf(stderr, "psh: allocation error\n");
-        exit(EXIT_FAILURE);
-    }
-    wr->type = JOB;
-    wr->j = create_job(tokens, start, end);
-    if (wr->j == NULL)
+    int lines = (position + term_width - 1) / term_width;
+    for (int i = 0; i < lines; i++)
     {
-        free(wr);
-        return NULL;
+        printf("\r");
+        for (int j = 0; j < term_width; j++)
+            printf(" ");
+        printf("\033[A");
     }
+    printf("\r");
+    printf("\033[B");
+}
 
-    return wr;
+int get_terminal_width()
+{
+    struct winsize w;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) < 0 || w.ws_col == 0)
+        return 80;
+    return w.ws_col;
 }
 
-/* Create a wrapper for an operator. */
-wrapper *create_oper_wrapper(char *str)
+/* Read a character from the standard input. The input is buffered by the shell
+   itself, so it is known whether a character is available without blocking. */
+int read_char()
 {
-    wrapper *wr2 = malloc(sizeof(wrapper));
-    if (!wr2)
+    ssize_t n;
+    while (input_pos == input_len)
     {
-        my_fprintf(stderr, "psh: allocation error\n");
-        exit(EXIT_FAILURE);
+        n = read(STDIN_FILENO, input_buf, INPUT_BUF_SIZE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return EOF;
+        input_pos = 0;
+        input_len = n;
     }
-    wr2->type = OPERATOR;
-    wr2->oper = strdup(str);
-
-    return wr2;
+    return (unsigned char)input_buf[input_pos++];
 }
 
-/* Create a list of wrapper structs. */
-wrapper **create_jobs(char **tokens)
+/* Add a descriptor to the poll set. Return its index. */
+int add_poll_fd(int *nfds, int fd)
 {
-    int start = 0, end = 0, position = 0;
-    if (tokens[0] == NULL)
+    if (*nfds == poll_fds_cap)
     {
-        return NULL; // Empty command
+        poll_fds_cap = poll_fds_cap ? poll_fds_cap * 2 : 16;
+        poll_fds = realloc(poll_fds, poll_fds_cap * sizeof(struct pollfd));
+        if (!poll_fds)
+        {
+            my_fprintf(stderr, "psh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
     }
-    wrapper **list = malloc(TOK_BUF_SIZE * sizeof(wrapper *));
-    if (!list)
+    poll_fds[*nfds].fd = fd;
+    poll_fds[*nfds].events = POLLIN;
+    poll_fds[*nfds].revents = 0;
+    return (*nfds)++;
+}
+
+/* Add the pidfds of the unfinished processes of job J, or of all jobs if J is NULL. */
+void add_job_pidfds(job *j, int *nfds)
+{
+    job *end = j ? j->next : NULL;
+    for (j = j ? j : first_job; j != end; j = j->next)
+        for (process *p = j->first_process; p; p = p->next)
+            if (p->pidfd >= 0)
+                add_poll_fd(nfds, p->pidfd);
+}
+
+/* Handle SIGWINCH and SIGCHLD read from the signal fd and the pidfds in
+   poll_fds[first..nfds). Return 1 if a child process changed its state. */
+int handle_poll_events(int signal_index, int first, int nfds)
+{
+    int child = 0;
+    if (signal_index >= 0 && poll_fds[signal_index].revents)
     {
-        my_fprintf(stderr, "psh: allocation error\n");
-        exit(EXIT_FAILURE);
+        int events = read_signal_events();
+        if (events & EVENT_WINCH)
+            term_width = get_terminal_width();
+        if (events & EVENT_CHILD)
+            child = 1;
     }
+    for (int i = first; i < nfds; i++)
+        if (poll_fds[i].revents)
+            child = 1;
+    return child;
+}
 
-    while (tokens[end] != NULL)
+/* Wait until the terminal has input. Meanwhile, children are reaped as soon as
+   SIGCHLD arrives or a pidfd reports an exit, the terminal width follows window
+   size changes, and asynchronous prompt segments are collected. Return 0 once
+   input is available, or a mask of INPUT_PROMPT_CHANGED and INPUT_JOBS_CHANGED
+   if the line must be redrawn first. */
+int wait_for_input()
+{
+    while (input_pos == input_len)
     {
-        if (isOperator(tokens[end]))
+        int nfds = 0, changes = 0;
+        int signal_index = -1, prompt_index = -1, first_pidfd;
+        int ret;
+
+        add_poll_fd(&nfds, STDIN_FILENO);
+        if (signal_fd >= 0)
+            signal_index = add_poll_fd(&nfds, signal_fd);
+        if (prompt_pending_fd() >= 0)
+            prompt_index = add_poll_fd(&nfds, prompt_pending_fd());
+        first_pidfd = nfds;
+        add_job_pidfds(NULL, &nfds);
+
+        ret = poll(poll_fds, nfds, prompt_timeout());
+        if (ret < 0)
         {
-            wrapper *wr = create_job_wrapper(tokens, start, end);
-            list[position++] = wr;
-
-            wrapper *wr2 = create_oper_wrapper(tokens[end]);
-            list[position++] = wr2;
-            start = end + 1;
+            if (errno == EINTR)
+                continue;
+            return 0;
         }
-        else if (endsWith(tokens[end], ';'))
-        {
-            size_t len = strlen(tokens[end]);
-            tokens[end][len - 1] = '\0';
-            end++;
 
-            wrapper *wr = create_job_wrapper(tokens, start, end);
-            list[position++] = wr;
-
-            wrapper *wr2 = create_oper_wrapper(";");
-            list[position++] = wr2;
-            start = end;
-        }
-        else if (strcmp(tokens[end], "&") == 0)
+        if (prompt_index >= 0 && (ret == 0 || poll_fds[prompt_index].revents) && prompt_update())
+            changes |= INPUT_PROMPT_CHANGED;
+        if (handle_poll_events(signal_index, first_pidfd, nfds))
         {
-            end++;
-            wrapper *wr = create_job_wrapper(tokens, start, end);
-            list[position++] = wr;
-
-            wrapper *wr2 = create_oper_wrapper("&");
-            list[position++] = wr2;
-            start = end;
+            update_status();
+            if (job_notifications_pending())
+                changes |= INPUT_JOBS_CHANGED;
         }
-        end++;
+        if (changes)
+            return changes;
+        if (poll_fds[0].revents)
+            return 0;
     }
-    wrapper *wr = create_job_wrapper(tokens, start, end);
-    if (wr != NULL)
-        list[position++] = wr;
+    return 0;
+}
 
-    list[position] = NULL;
-    return list;
+/* Redraw the prompt and the line in place, keeping the cursor position. */
+void redraw_line(int old_prompt_len, char *prompt, char *buffer, int position, int cursor_pos)
+{
+    clear_line(position + old_prompt_len);
+    printf("%s%s", prompt, buffer);
+    for (int i = cursor_pos; i < position; i++)
+        printf("\b");
+    fflush(stdout);
 }
 
-/* Create a job struct. */
-job *create_job(char **tokens, int start, int end)
+/* Make room for needed bytes in the line buffer. */
+void reserve_line(char **line, size_t *size, size_t needed)
 {
-    if (tokens[start] == NULL)
-        return NULL;
-    int last_pipe_index = start;
-    // Create a new job
-    job *j = malloc(sizeof(job));
-    if (!j)
+    size_t old = *size;
+    if (needed <= old)
+        return;
+    while (*size < needed)
+        *size *= 2;
+    *line = realloc(*line, *size);
+    if (!*line)
     {
         my_fprintf(stderr, "psh: allocation error\n");
         exit(EXIT_FAILURE);
-    }
-    j->stdin = STDIN_FILENO;
-    j->stdout = STDOUT_FILENO;
-    j->stderr = STDERR_FILENO;
-    j->pgid = 0, j->notified = 0, j->inverted = 0;
-    j->first_process = NULL, j->next = NULL;
-    if (first_job == NULL)
-        first_job = j;
-    else
-    {
-        job *temp = first_job;
-        while (temp->next != NULL)
-            temp = temp->next;
-        temp->next = j;
-    }
-
-    if (strcmp(tokens[start], "!") == 0)
-    {
-        j->inverted = 1;
-        start++;
-        last_pipe_index++;
-    }
-    j->command = trim(concat_line(tokens, start, end));
-
-    /* Create the processes. */
-    for (int i = start; i < end; i++)
-    {
-        if (strcmp(tokens[i], "|") == 0 || tokens[i + 1] == NULL || i + 1 == end)
-        {
-            process *p = malloc(sizeof(process));
-            if (!p)
-            {
-                my_fprintf(stderr, "psh: allocation error\n");
-                exit(EXIT_FAILURE);
-            }
-            p->completed = 0, p->stopped = 0;
-            p->next = NULL;
-            p->argv = malloc(TOK_BUF_SIZE * sizeof(char *));
-            if (!p->argv)
-            {
-                my_fprintf(stderr, "psh: allocation error\n");
-                exit(EXIT_FAILURE);
-            }
-            p->infile = NULL, p->outfile = NULL, p->errfile = NULL;
-
-            int position = 0;
-            for (int j = last_pipe_index; j <= i; j++)
-            {
-                if (strcmp(tokens[j], "|") != 0)
-                {
-                    // for quoting
-                    if (tokens[j][0] == '"' || tokens[j][0] == '\'')
-                    {
-                        size_t len = strlen(tokens[j]);
-                        memmove(tokens[j], tokens[j] + 1, len - 1);
-                        tokens[j][len - 2] = '\0';
-                        p->argv[position++] = strdup(tokens[j]);
-                    }
-                    else if (isRedirection(tokens[j]))
-                    {
-                        if (strcmp(tokens[j], ">") == 0)
-                        {
-                            p->outfile = strdup(tokens[j + 1]);
-                            p->append_mode = 0;
-                        }
-                        else if (strcmp(tokens[j], ">>") == 0)
-                        {
-                            p->outfile = strdup(tokens[j + 1]);
-                            p->append_mode = 1;
-                        }
-                        else if (strcmp(tokens[j], "<") == 0)
-                            p->infile = strdup(tokens[j + 1]);
-                        else if (strcmp(tokens[j], "2>") == 0)
-                            p->errfile = strdup(tokens[j + 1]);
-                        j++;
-                    }
-                    else
-                        p->argv[position++] = strdup(tokens[j]);
-                }
-            }
-            last_pipe_index = i + 1;
-
-            p->argv[position] = NULL;
-            if (endsWith(p->argv[position - 1], '&'))
-            {
-                j->foreground = 0;
-                j->in_bg = 1;
-                size_t len = strlen(p->argv[position - 1]);
-                if (len == 1)
-                {
-                    free(p->argv[position - 1]);
-                    p->argv[position - 1] = NULL;
-                }
-                else
-                {
-                    p->argv[position - 1][len - 1] = ' ';
-                    p->argv[position - 1] = trim(p->argv[position - 1]);
-                }
-            }
-            else
-                j->foreground = 1;
+    }
+    memset(*line + old, '\0', *size - old);
+}
 
-            if (j->first_process == NULL)
-                j->first_process = p;
-            else
-            {
-                process *proc = j->first_process;
-                while (proc->next != NULL)
-                    proc = proc->next;
-                proc->next = p;
-            }
+void _paste_add(int c)
+{
+    if (paste_len == paste_size)
+    {
+        paste_size = paste_size ? 2 * paste_size : BUF_SIZE;
+        paste_text = realloc(paste_text, paste_size);
+        if (!paste_text)
+        {
+            my_fprintf(stderr, "psh: allocation error\n");
+            exit(EXIT_FAILURE);
         }
     }
-
-    return j;
+    paste_text[paste_len++] = c;
 }
 
-void clear_line(int position)
+/* Read a bracketed paste up to the ESC [201~ that ends it. */
+void read_paste()
 {
-    int lines = (position + term_width - 1) / term_width;
-    for (int i = 0; i < lines; i++)
+    const char *end = "[201~";
+    int c;
+
+    paste_len = paste_pos = 0;
+    while ((c = read_char()) != EOF)
     {
-        printf("\r");
-        for (int j = 0; j < term_width; j++)
-            printf(" ");
-        printf("\033[A");
+        int matched = 0;
+        if (c != 27)
+        {
+            _paste_add(c);
+            continue;
+        }
+        while (end[matched] && (c = read_char()) == end[matched])
+            matched++;
+        if (!end[matched])
+            return;
+        _paste_add(27);
+        for (int i = 0; i < matched; i++)
+            _paste_add(end[i]);
+        if (c == EOF)
+            return;
+        _paste_add(c);
     }
-    printf("\r");
-    printf("\033[B");
 }
 
-int get_terminal_width()
+/* Insert the pasted text up to its next newline at the cursor, and draw
+   the line once. Return '\n' if a newline ends the part, which enters the
+   line like the user pressing return, otherwise 0.  */
+int insert_paste(char **line, size_t *size, int *position, int *cursor_pos)
 {
-    struct winsize w;
-    ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
-    return w.ws_col;
+    char *start = paste_text + paste_pos, *buffer;
+    size_t n = 0, k = 0;
+    int c = 0;
+
+    while (paste_pos + n < paste_len && start[n] != '\n' && start[n] != '\r')
+        n++;
+    reserve_line(line, size, *position + n + 1);
+    buffer = *line;
+
+    /* Only what can be typed is kept, tabs become spaces.  */
+    memmove(&buffer[*cursor_pos + n], &buffer[*cursor_pos], *position - *cursor_pos + 1);
+    for (size_t i = 0; i < n; i++)
+        if (start[i] == '\t' || (start[i] >= 32 && start[i] <= 126))
+            buffer[*cursor_pos + k++] = start[i] == '\t' ? ' ' : start[i];
+    if (k < n)
+        memmove(&buffer[*cursor_pos + k], &buffer[*cursor_pos + n], *position - *cursor_pos + 1);
+    *position += k;
+    fwrite(&buffer[*cursor_pos], 1, *position - *cursor_pos, stdout);
+    *cursor_pos += k;
+    for (int i = *cursor_pos; i < *position; i++)
+        putchar('\b');
+    fflush(stdout);
+
+    paste_pos += n;
+    if (paste_pos < paste_len)
+    {
+        /* A CR LF pair is one newline.  */
+        if (paste_text[paste_pos] == '\r' && paste_pos + 1 < paste_len && paste_text[paste_pos + 1] == '\n')
+            paste_pos++;
+        paste_pos++;
+        c = '\n';
+    }
+    if (paste_pos == paste_len)
+        paste_pos = paste_len = 0;
+    return c;
 }
 
 /* Read the line entered by the user. If the shell is used interactively,
-   the terminal enters raw mode. Handle shortcuts, character insertion, and deletion. */
-void read_line(char *buffer, char *prompt)
+   the terminal enters raw mode. Handle shortcuts, character insertion, and deletion.
+   The line buffer grows as needed. Bracketed paste mode is on while the
+   line is edited, so a paste is inserted as a whole.  */
+void read_line(char **line, size_t *size, int prompt_type)
 {
+    char *buffer = *line;
     int position = strlen(buffer);
-    int cursor_pos = position;
+    int cursor_pos;
     int c;
+    char *prompt = render_prompt(prompt_type);
 
-    memset(buffer + position, '\0', BUF_SIZE - position);
+    reserve_line(line, size, position + 2);
+    buffer = *line;
+    memset(buffer + position, '\0', *size - position);
 
+    /* A continued line is joined with a newline, so that keywords such as
+       then and do start a command. */
     if (position != 0)
     {
         if (buffer[position - 1] == '\\')
             buffer[position - 1] = ' ';
         else
-            buffer[position++] = ' ';
+            buffer[position++] = '\n';
     }
+    cursor_pos = position;
 
     printf("%s", prompt);
+    if (shell_is_interactive)
+        printf("\033[?2004h");
+    fflush(stdout);
 
     while (1)
     {
-        c = getchar();
+        /* Report finished jobs and redraw the prompt when its asynchronous
+           segments are ready, while waiting for the user to type. */
+        int changes;
+        while (paste_pos == paste_len && (changes = wait_for_input()) != 0)
+        {
+            int old_prompt_len = strlen(prompt);
+            prompt = render_prompt(prompt_type);
+            if (changes & INPUT_JOBS_CHANGED)
+            {
+                clear_line(position + old_prompt_len);
+                do_job_notification();
+                printf("%s%s", prompt, buffer);
+                for (int i = cursor_pos; i < position; i++)
+                    printf("\b");
+                fflush(stdout);
+            }
+            else
+                redraw_line(old_prompt_len, prompt, buffer, position, cursor_pos);
+        }
+
+        if (paste_pos < paste_len)
+        {
+            c = insert_paste(line, size, &position, &cursor_pos);
+            buffer = *line;
+        }
+        else
+            c = read_char();
         if (c == 9)
             tab_count++;
         else
@@ -948,6 +703,8 @@ void read_line(char *buffer, char *prompt)
             while (cursor_pos < position)
                 printf("%c", buffer[cursor_pos++]);
             buffer[position] = '\0';
+            if (shell_is_interactive)
+                printf("\033[?2004l");
             my_printf("\n");
             return;
         }
@@ -961,7 +718,8 @@ void read_line(char *buffer, char *prompt)
                 free(temp);
                 continue;
             }
-            autocomplete(buffer, &position, &cursor_pos);
+            autocomplete(line, size, &position, &cursor_pos);
+            buffer = *line;
             free(temp);
         }
         else if (c == 127)
@@ -1053,6 +811,8 @@ void read_line(char *buffer, char *prompt)
         }
         else if (c >= 32 && c <= 126)
         { // Printable characters
+            reserve_line(line, size, position + 2);
+            buffer = *line;
             memmove(&buffer[cursor_pos + 1], &buffer[cursor_pos], position - cursor_pos + 1);
             buffer[cursor_pos] = c;
             position++;
@@ -1065,12 +825,17 @@ void read_line(char *buffer, char *prompt)
         }
         else if (c == 27) // Escape character
         {
-            c = getchar();
+            c = read_char();
             if (c == 91) // [
             {
-                c = getchar();
+                c = read_char();
                 switch (c)
                 {
+                case '2': // Bracketed paste: ESC [200~
+                    /* The pasted text is inserted on the next turns of the loop.  */
+                    if (read_char() == '0' && read_char() == '0' && read_char() == '~')
+                        read_paste();
+                    break;
                 case 'A': // Up-Arrow
                     if (!cur_history && last_history)
                         cur_history = last_history;
@@ -1080,6 +845,8 @@ void read_line(char *buffer, char *prompt)
                         break;
 
                     clear_line(position + strlen(prompt));
+                    reserve_line(line, size, strlen(cur_history->line) + 1);
+                    buffer = *line;
 
                     memset(buffer, '\0', position);
                     position = 0;
@@ -1100,6 +867,9 @@ void read_line(char *buffer, char *prompt)
                         break;
 
                     clear_line(position + strlen(prompt));
+                    if (cur_history)
+                        reserve_line(line, size, strlen(cur_history->line) + 1);
+                    buffer = *line;
 
                     memset(buffer, '\0', position);
                     position = 0;
@@ -1142,71 +912,6 @@ void read_line(char *buffer, char *prompt)
     }
 }
 
-/* Tokenize the provided string. */
-char **tokenize(char *line)
-{
-    int position = 0;
-    int start = 0;
-    int in_quotes = 0;
-    int len = strlen(line);
-    char *token;
-    char **buffer = malloc(TOK_BUF_SIZE * sizeof(char *));
-    if (!buffer)
-    {
-        my_fprintf(stderr, "psh: allocation error\n");
-        exit(EXIT_FAILURE);
-    }
-
-    for (int i = 0; i <= len; i++)
-    {
-        if (line[i] == '"' || line[i] == '\'')
-        {
-            in_quotes = !in_quotes;
-        }
-        else if (isspace(line[i]) && !in_quotes)
-        {
-            if (i > start)
-            {
-                token = strndup(line + start, i - start);
-                buffer[position++] = token;
-            }
-            start = i + 1;
-        }
-        else if (line[i] == ';' && !in_quotes)
-        {
-            if (i > start)
-            {
-                token = strndup(line + start, i - start);
-                buffer[position++] = token;
-            }
-            buffer[position++] = strndup(";", 1);
-            start = i + 1;
-        }
-        else if (line[i] == '\0')
-        {
-            if (i > start)
-            {
-                token = strndup(line + start, i - start);
-                buffer[position++] = token;
-            }
-        }
-    }
-
-    buffer[position] = NULL;
-    return buffer;
-}
-
-/* Find the active job with the indicated pgid.  */
-job *find_job(pid_t pgid)
-{
-    job *j;
-
-    for (j = first_job; j; j = j->next)
-        if (j->pgid == pgid)
-            return j;
-    return NULL;
-}
-
 /* Return true if all processes in the job have stopped or completed.  */
 int job_is_stopped(job *j)
 {
@@ -1239,6 +944,9 @@ int job_is_completed(job *j)
    before proceeding. */
 void init_shell()
 {
+    /* Wait for SIGCHLD and SIGWINCH through a signal fd.  */
+    init_events();
+
     /* Check for non-interactive mode. Used for tests. */
     if (getenv("PSH_NON_INTERACTIVE"))
     {
@@ -1282,12 +990,14 @@ void init_shell()
     }
 }
 
-/* Launch the provided process P. */
-void launch_process(process *p, pid_t pgid,
+/* Prepare the forked child for process P: its process group, terminal,
+   signals and standard channels. */
+void setup_process(process *p, pid_t pgid,
                     int infile, int outfile, int errfile,
                     int foreground)
 {
     pid_t pid;
+    reset_signal_mask();
     if (shell_is_interactive)
     {
         /* Put the process into the process group and give the process group
@@ -1340,7 +1050,7 @@ void launch_process(process *p, pid_t pgid,
     // Handle error redirection
     if (p->errfile)
     {
-        errfile = open(p->errfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        errfile = open(p->errfile, O_WRONLY | O_CREAT | (p->job->batched ? O_APPEND : O_TRUNC), 0644);
         if (errfile < 0)
         {
             my_perror("open error file");
@@ -1365,10 +1075,162 @@ void launch_process(process *p, pid_t pgid,
         close(errfile);
     }
 
+}
+
+/* Launch the provided process P. */
+void launch_process(process *p, pid_t pgid,
+                    int infile, int outfile, int errfile,
+                    int foreground)
+{
+    setup_process(p, pgid, infile, outfile, errfile, foreground);
+
     /* Exec the new process.  Make sure we exit.  */
-    execvp(p->argv[0], p->argv);
-    my_perror("execvp");
-    exit(1);
+    execve(p->path, p->argv, env_environ());
+    if (errno == ENOENT && p->path != p->argv[0])
+        /* The hashed executable is gone. Search PATH again. */
+        execvpe(p->argv[0], p->argv, env_environ());
+    my_perror(p->argv[0]);
+    exit(errno == ENOENT ? 127 : 126);
+}
+
+/* Choose how processes are started. PSH_SPAWN=fork selects fork and exec,
+   PSH_SPAWN=posix_spawn (the default) starts processes without copying the
+   shell's address space. Foreground jobs fall back to fork when posix_spawn
+   cannot hand them the terminal. */
+int use_posix_spawn(int foreground)
+{
+    char *backend = psh_getenv("PSH_SPAWN");
+    if (backend && strcmp(backend, "fork") == 0)
+        return 0;
+#ifndef HAVE_SPAWN_TCSETPGRP
+    if (shell_is_interactive && foreground)
+        return 0;
+#endif
+    return 1;
+}
+
+/* Record that the process P could not be started. */
+void mark_process_failed(process *p, int exit_status)
+{
+    p->completed = 1;
+    p->status = exit_status << 8;
+    p->exit_status = exit_status;
+    last_proc_exit_status = exit_status;
+}
+
+/* Launch the process P with posix_spawn. The child gets the same process group,
+   terminal, signal and redirection setup as in launch_process. Redirection files
+   are opened by the shell. Return the pid, or -1 if the process was not started. */
+pid_t spawn_process(process *p, pid_t pgid,
+                    int infile, int outfile, int errfile,
+                    int foreground)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t sigs;
+    short flags = POSIX_SPAWN_SETSIGMASK;
+    int in_fd = -1, out_fd = -1, err_fd = -1;
+    int err;
+    pid_t pid;
+
+    // Handle input redirection
+    if (p->infile && (in_fd = open(p->infile, O_RDONLY | O_CLOEXEC)) < 0)
+    {
+        my_perror("open input file");
+        mark_process_failed(p, 1);
+        return -1;
+    }
+    // Handle output redirection
+    if (p->outfile)
+    {
+        int mode = p->append_mode ? O_APPEND : O_TRUNC;
+        if ((out_fd = open(p->outfile, O_WRONLY | O_CREAT | O_CLOEXEC | mode, 0644)) < 0)
+        {
+            my_perror("open output file");
+            if (in_fd != -1)
+                close(in_fd);
+            mark_process_failed(p, 1);
+            return -1;
+        }
+    }
+    // Handle error redirection
+    if (p->errfile && (err_fd = open(p->errfile, O_WRONLY | O_CREAT | O_CLOEXEC |
+                                         (p->job->batched ? O_APPEND : O_TRUNC), 0644)) < 0)
+    {
+        my_perror("open error file");
+        if (in_fd != -1)
+            close(in_fd);
+        if (out_fd != -1)
+            close(out_fd);
+        mark_process_failed(p, 1);
+        return -1;
+    }
+    if (in_fd != -1)
+        infile = in_fd;
+    if (out_fd != -1)
+        outfile = out_fd;
+    if (err_fd != -1)
+        errfile = err_fd;
+
+    posix_spawnattr_init(&attr);
+    sigemptyset(&sigs);
+    posix_spawnattr_setsigmask(&attr, &sigs);
+    if (shell_is_interactive)
+    {
+        /* Put the process into the process group and set the handling
+           for job control signals back to the default.  */
+        flags |= POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF;
+        posix_spawnattr_setpgroup(&attr, pgid);
+        sigaddset(&sigs, SIGINT);
+        sigaddset(&sigs, SIGQUIT);
+        sigaddset(&sigs, SIGTSTP);
+        sigaddset(&sigs, SIGTTIN);
+        sigaddset(&sigs, SIGTTOU);
+        sigaddset(&sigs, SIGCHLD);
+        sigaddset(&sigs, SIGHUP);
+        sigaddset(&sigs, SIGTERM);
+        posix_spawnattr_setsigdefault(&attr, &sigs);
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    posix_spawn_file_actions_init(&actions);
+#ifdef HAVE_SPAWN_TCSETPGRP
+    if (shell_is_interactive && foreground)
+        posix_spawn_file_actions_addtcsetpgrp_np(&actions, shell_terminal);
+#endif
+    /* Set the standard input/output channels of the new process.  */
+    if (infile != STDIN_FILENO)
+        posix_spawn_file_actions_adddup2(&actions, infile, STDIN_FILENO);
+    if (outfile != STDOUT_FILENO)
+        posix_spawn_file_actions_adddup2(&actions, outfile, STDOUT_FILENO);
+    if (errfile != STDERR_FILENO)
+        posix_spawn_file_actions_adddup2(&actions, errfile, STDERR_FILENO);
+
+    err = posix_spawn(&pid, p->path, &actions, &attr, p->argv, env_environ());
+    if (err == ENOENT && p->path != p->argv[0])
+    {
+        /* The hashed executable is gone. Forget it and search PATH again. */
+        hash_forget(p->argv[0]);
+        p->path = p->argv[0];
+        err = posix_spawnp(&pid, p->argv[0], &actions, &attr, p->argv, env_environ());
+    }
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (in_fd != -1)
+        close(in_fd);
+    if (out_fd != -1)
+        close(out_fd);
+    if (err_fd != -1)
+        close(err_fd);
+
+    if (err != 0)
+    {
+        my_fprintf(stderr, "psh: %s: %s\n", p->argv[0], strerror(err));
+        mark_process_failed(p, err == ENOENT ? 127 : 126);
+        return -1;
+    }
+    return pid;
 }
 
 /* Launch the job J. */
@@ -1378,52 +1240,113 @@ void launch_job(job *j, int foreground)
     pid_t pid;
     int mypipe[2], infile, outfile;
     char *prev_proc_outfile = NULL;
+    int spawn = use_posix_spawn(foreground);
+    builtin_func builtin;
+    process *in_shell = NULL;
+
+    /* Output of builtins must come before the output of the job. */
+    if (!shell_is_interactive)
+        fflush(stdout);
 
     infile = j->stdin;
     for (p = j->first_process; p; p = p->next)
     {
-        if (prev_proc_outfile)
-        {
-            free(prev_proc_outfile);
-            prev_proc_outfile = NULL;
-        }
-        if (p->outfile)
-            prev_proc_outfile = strdup(p->outfile);
+        prev_proc_outfile = p->outfile;
 
         /* Set up pipes, if necessary.  */
-        if (p->next)
+        if (p->next && !j->batched)
         {
             if (pipe(mypipe) < 0)
             {
                 my_perror("pipe");
                 exit(1);
             }
+            /* Pipe ends must not leak into the other processes of the job.  */
+            fcntl(mypipe[0], F_SETFD, FD_CLOEXEC);
+            fcntl(mypipe[1], F_SETFD, FD_CLOEXEC);
             outfile = mypipe[1];
         }
         else
             outfile = j->stdout;
 
-        /* Fork the child processes.  */
-        pid = fork();
-        if (pid == 0)
-            /* This is the child process.  */
-            launch_process(p, j->pgid, infile,
-                           outfile, j->stderr, foreground);
-        else if (pid < 0)
+        pid = 0;
+        builtin = p->argv[0] ? find_builtin(p->argv[0]) : NULL;
+        if (builtin && !p->next && foreground && p != j->first_process &&
+            !builtin_controls_shell(builtin))
         {
-            /* The fork failed.  */
-            my_perror("fork");
-            exit(1);
+            /* The last stage runs in the shell, reading the pipe.  */
+            run_builtin_stage(p, builtin, infile, outfile, j->stderr);
+            in_shell = p;
+        }
+        else if (builtin)
+        {
+            /* Other stages run in a child that does not exec.  */
+            pid = fork();
+            if (pid == 0)
+            {
+                setup_process(p, j->pgid, infile, outfile, j->stderr, foreground);
+                shell_is_interactive = 0;
+                last_proc_exit_status = 0;
+                /* The jobs belong to the shell, exit must not hang them up.  */
+                first_job = NULL;
+                builtin(p->argv);
+                utility_flush();
+                fflush(stderr);
+                _exit(last_proc_exit_status);
+            }
+            else if (pid < 0)
+            {
+                my_perror("fork");
+                exit(1);
+            }
+        }
+        /* Resolve the command once in the shell, so the child can exec it directly
+           and a missing command is reported without forking.  */
+        else if (!(p->path = p->argv[0] ? hash_lookup(p->argv[0]) : NULL))
+        {
+            if (p->argv[0])
+                my_fprintf(stderr, "psh: %s: command not found\n", p->argv[0]);
+            mark_process_failed(p, 127);
+        }
+        else if (!argv_fits(p->argv))
+        {
+            my_fprintf(stderr, "psh: %s: argument list too long\n", p->argv[0]);
+            mark_process_failed(p, 126);
         }
         else
+        {
+            if (spawn)
+                pid = spawn_process(p, j->pgid, infile,
+                                    outfile, j->stderr, foreground);
+            else
+            {
+                /* Fork the child processes.  */
+                pid = fork();
+                if (pid == 0)
+                    /* This is the child process.  */
+                    launch_process(p, j->pgid, infile,
+                                   outfile, j->stderr, foreground);
+                else if (pid < 0)
+                {
+                    /* The fork failed.  */
+                    my_perror("fork");
+                    exit(1);
+                }
+            }
+        }
+
+        if (pid > 0)
         {
             /* This is the parent process.  */
             p->pid = pid;
+            p->pidfd = open_pidfd(pid);
+            register_process(j, p);
             if (shell_is_interactive)
             {
                 if (!j->pgid)
                     j->pgid = pid;
                 setpgid(pid, j->pgid);
+                register_job(j);
             }
         }
 
@@ -1432,27 +1355,63 @@ void launch_job(job *j, int foreground)
             close(infile);
         if (outfile != j->stdout)
             close(outfile);
+        /* Only a stage followed by another one made a pipe.  */
+        if (j->batched || !p->next)
+            continue;
         infile = mypipe[0];
 
         /* Reassign the infile in case previous process had a non-default outfile. */
         if (prev_proc_outfile)
         {
             close(infile);
-            if (p->next)
-                p->next->infile = strdup(prev_proc_outfile);
+            infile = j->stdin;
+            p->next->infile = prev_proc_outfile;
         }
     }
-    if (prev_proc_outfile)
-        free(prev_proc_outfile);
-
     format_job_info(j, "launched");
 
-    if (!shell_is_interactive)
+    if (job_is_completed(j))
+        /* Nothing was started.  */
+        ;
+    else if (!shell_is_interactive)
         wait_for_job(j);
     else if (foreground)
         put_job_in_foreground(j, 0);
     else
         put_job_in_background(j, 0);
+    /* The earlier stages may have finished after the one run in the shell.  */
+    if (in_shell && job_is_completed(j))
+        last_proc_exit_status = in_shell->exit_status;
+}
+
+/* Run the builtin as the last stage of a pipeline in the shell itself,
+   with its standard channels swapped for the pipe and back.  */
+void run_builtin_stage(process *p, builtin_func builtin, int infile, int outfile, int errfile)
+{
+    int channels[3] = {infile, outfile, errfile}, saved[3], redirected[3];
+
+    for (int fd = 0; fd < 3; fd++)
+    {
+        saved[fd] = -1;
+        if (channels[fd] == fd)
+            continue;
+        fflush(fd == 1 ? stdout : stderr);
+        saved[fd] = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+        dup2(channels[fd], fd);
+    }
+    last_proc_exit_status = 0;
+    if (redirect_builtin(p, redirected) < 0)
+        last_proc_exit_status = 1;
+    else
+    {
+        builtin(p->argv);
+        utility_flush();
+        restore_builtin(redirected);
+    }
+    restore_builtin(saved);
+    p->completed = 1;
+    p->exit_status = last_proc_exit_status;
+    p->status = last_proc_exit_status << 8;
 }
 
 /* Check the builtin commands. If not a builtin, launch the executable in PATH.
@@ -1460,22 +1419,70 @@ void launch_job(job *j, int foreground)
     return -1. */
 int execute(job *j, int foreground)
 {
-    int i;
-
     if (j->first_process->argv[0] == NULL)
     {
         return 1;
     }
 
-    for (i = 0; i < psh_num_builtins(); i++)
+    builtin_func builtin = find_builtin(j->first_process->argv[0]);
+    int saved[3], status;
+
+    if (!builtin)
+        return -1;
+    /* exit and return keep the last status unless given one.  */
+    if (builtin != psh_exit && builtin != psh_return)
+        last_proc_exit_status = 0;
+    if (redirect_builtin(j->first_process, saved) < 0)
+    {
+        last_proc_exit_status = 1;
+        return 1;
+    }
+    status = builtin(j->first_process->argv);
+    utility_flush();
+    restore_builtin(saved);
+    return status;
+}
+
+/* Open the files a builtin redirects to in place of the shell's standard
+   channels, saving those in saved. Return -1 if a file cannot be opened.  */
+int redirect_builtin(process *p, int saved[3])
+{
+    char *files[3] = {p->infile, p->outfile, p->errfile};
+
+    saved[0] = saved[1] = saved[2] = -1;
+    for (int fd = 0; fd < 3; fd++)
     {
-        if (strcmp(j->first_process->argv[0], builtin_str[i]) == 0)
+        int flags = fd == 0 ? O_RDONLY : O_WRONLY | O_CREAT | (fd == 1 && p->append_mode ? O_APPEND : O_TRUNC);
+        int file;
+
+        if (!files[fd])
+            continue;
+        if ((file = open(files[fd], flags | O_CLOEXEC, 0644)) < 0)
         {
-            return (*(func_arr[i]))(j->first_process->argv);
+            my_fprintf(stderr, "psh: %s: %s\n", files[fd], strerror(errno));
+            restore_builtin(saved);
+            return -1;
         }
+        fflush(fd == 1 ? stdout : stderr);
+        saved[fd] = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+        dup2(file, fd);
+        close(file);
     }
+    return 0;
+}
 
-    return -1;
+/* Put back the standard channels saved by redirect_builtin.  */
+void restore_builtin(int saved[3])
+{
+    for (int fd = 0; fd < 3; fd++)
+    {
+        if (saved[fd] < 0)
+            continue;
+        fflush(fd == 1 ? stdout : stderr);
+        dup2(saved[fd], fd);
+        close(saved[fd]);
+        saved[fd] = -1;
+    }
 }
 
 /* Put job j in the foreground.  If cont is nonzero,
@@ -1525,38 +1532,45 @@ void put_job_in_background(job *j, int cont)
    Return 0 if all went well, nonzero otherwise.  */
 int mark_process_status(pid_t pid, int status)
 {
-    job *j;
     process *p;
     if (pid > 0)
     {
         /* Update the record for the process.  */
-        for (j = first_job; j; j = j->next)
-            for (p = j->first_process; p; p = p->next)
-                if (p->pid == pid)
+        if ((p = find_process(pid)) != NULL)
+        {
+            p->status = status;
+            if (WIFSTOPPED(status))
+            {
+                p->stopped = 1;
+            }
+            else
+            {
+                p->completed = 1;
+                if (p->pidfd >= 0)
                 {
-                    p->status = status;
-                    if (WIFSTOPPED(status))
-                    {
-                        p->stopped = 1;
-                    }
-                    else
-                    {
-                        p->completed = 1;
-                        if (WIFEXITED(status))
-                        {
-                            p->exit_status = WEXITSTATUS(status); // Store the exit code
-                            last_proc_exit_status = p->exit_status;
-                        }
-                        else if (WIFSIGNALED(status))
-                        {
-                            p->exit_status = WTERMSIG(status); // Store the signal number
-                            my_fprintf(stderr, "%d: Terminated by signal %d.\n",
-                                       (int)pid, WTERMSIG(p->status));
-                            last_proc_exit_status = p->exit_status;
-                        }
-                    }
-                    return 0;
+                    close(p->pidfd);
+                    p->pidfd = -1;
+                }
+                if (WIFEXITED(status))
+                {
+                    p->exit_status = WEXITSTATUS(status); // Store the exit code
+                    last_proc_exit_status = p->exit_status;
+                    /* The hashed executable could not be found. */
+                    if (p->exit_status == 127 && p->path != p->argv[0])
+                        hash_forget(p->argv[0]);
                 }
+                else if (WIFSIGNALED(status))
+                {
+                    p->exit_status = WTERMSIG(status); // Store the signal number
+                    /* A writer whose reader went away is not worth a message.  */
+                    if (WTERMSIG(status) != SIGPIPE)
+                        my_fprintf(stderr, "%d: Terminated by signal %d.\n",
+                                   (int)pid, WTERMSIG(p->status));
+                    last_proc_exit_status = p->exit_status;
+                }
+            }
+            return 0;
+        }
         my_fprintf(stderr, "No child process %d.\n", pid);
         return -1;
     }
@@ -1585,16 +1599,36 @@ void update_status(void)
 }
 
 /* Check for processes that have status information available,
-   blocking until all processes in the given job have reported.  */
+   blocking until all processes in the given job have reported.
+   The shell keeps following window size changes meanwhile.  */
 void wait_for_job(job *j)
 {
     int status;
     pid_t pid;
 
-    do
+    if (signal_fd < 0)
+    {
+        do
+        {
+            pid = waitpid(-j->pgid, &status, WUNTRACED);
+        } while (!mark_process_status(pid, status) && !job_is_stopped(j) && !job_is_completed(j));
+        return;
+    }
+
+    update_status();
+    while (!job_is_stopped(j) && !job_is_completed(j))
     {
-        pid = waitpid(-j->pgid, &status, WUNTRACED);
-    } while (!mark_process_status(pid, status) && !job_is_stopped(j) && !job_is_completed(j));
+        int nfds = 0;
+        int signal_index = add_poll_fd(&nfds, signal_fd);
+        add_job_pidfds(j, &nfds);
+        if (poll(poll_fds, nfds, -1) < 0 && errno != EINTR)
+        {
+            my_perror("poll");
+            return;
+        }
+        if (handle_poll_events(signal_index, signal_index + 1, nfds))
+            update_status();
+    }
 }
 
 /* Format information about job status for the user to look at.  */
@@ -1603,14 +1637,29 @@ void format_job_info(job *j, const char *status)
     // my_fprintf(stderr, "%ld (%s): %s\n", (long)j->pgid, status, j->command);
 }
 
+/* Return 1 if a background job finished or stopped since the user was last told. */
+int job_notifications_pending()
+{
+    for (job *j = first_job; j; j = j->next)
+        if (j->in_bg && j->pgid != 0 &&
+            (job_is_completed(j) || (job_is_stopped(j) && !j->notified)))
+            return 1;
+    return 0;
+}
+
 /* Notify the user about stopped or terminated jobs.
    Delete terminated jobs from the active job list.  */
 void do_job_notification(void)
 {
     job *j, *jlast, *jnext;
 
-    /* Update status information for child processes.  */
-    update_status();
+    /* Update status information for child processes, if any are running.  */
+    for (j = first_job; j; j = j->next)
+        if (j->pgid != 0 && !job_is_completed(j))
+        {
+            update_status();
+            break;
+        }
 
     jlast = NULL;
     for (j = first_job; j; j = jnext)
@@ -1622,19 +1671,15 @@ void do_job_notification(void)
         if (job_is_completed(j))
         {
             format_job_info(j, "completed");
-            if (jlast)
-                jlast->next = jnext;
-            else
-                first_job = jnext;
+            if (j->in_bg && j->pgid != 0)
+                my_printf("[%d] done %d %s\n", j->number, j->pgid, j->command);
+            remove_job(j, jlast);
             free_job(j);
         }
 
         else if (j->pgid == 0)
         {
-            if (jlast)
-                jlast->next = jnext;
-            else
-                first_job = jnext;
+            remove_job(j, jlast);
             free_job(j);
         }
 
@@ -1643,6 +1688,8 @@ void do_job_notification(void)
         else if (job_is_stopped(j) && !j->notified)
         {
             format_job_info(j, "stopped");
+            if (j->in_bg)
+                my_printf("[%d] stopped %d %s\n", j->number, j->pgid, j->command);
             j->notified = 1;
             jlast = j;
         }
@@ -1677,38 +1724,96 @@ void continue_job(job *j, int foreground, int send_cont)
         put_job_in_background(j, send_cont);
 }
 
-/* Free the job J. */
+/* Free the job J. Jobs that were not promoted live in the line arena
+   and are released with it.  */
 void free_job(job *j)
 {
-    process *p = j->first_process;
-    while (p != NULL)
-    {
-        process *next = p->next;
+    unregister_job(j);
+    for (process *p = j->first_process; p; p = p->next)
+        if (p->pidfd >= 0)
+            close(p->pidfd);
+    if (j->promoted)
+        free(j);
+}
 
-        // Free each argument string in argv
-        if (p->argv)
-        {
-            for (char **arg = p->argv; *arg != NULL; ++arg)
-            {
-                free(*arg);
-            }
-            free(p->argv);
-        }
-        if (p->infile)
-            free(p->infile);
-        if (p->outfile)
-            free(p->outfile);
-        if (p->errfile)
-            free(p->errfile);
+/* Copy str to *pos and advance it. */
+char *_copy_string(char **pos, const char *str)
+{
+    size_t len;
+    if (!str)
+        return NULL;
+    len = strlen(str) + 1;
+    memcpy(*pos, str, len);
+    *pos += len;
+    return *pos - len;
+}
 
-        // Free the process structure itself
-        free(p);
+/* Copy the job J out of the line arena. The job, its processes, their
+   argv arrays and all strings are packed into a single heap block.  */
+job *promote_job(job *j)
+{
+    size_t size = sizeof(job), strings = j->command ? strlen(j->command) + 1 : 0;
+    process *p, **link;
+    char *block, *pos, *str;
+    job *copy;
+    int i;
+
+    for (p = j->first_process; p; p = p->next)
+    {
+        for (i = 0; p->argv[i]; i++)
+            strings += strlen(p->argv[i]) + 1;
+        size += sizeof(process) + (i + 1) * sizeof(char *);
+        strings += (p->infile ? strlen(p->infile) + 1 : 0) +
+                   (p->outfile ? strlen(p->outfile) + 1 : 0) +
+                   (p->errfile ? strlen(p->errfile) + 1 : 0);
+    }
 
-        p = next;
+    block = malloc(size + strings);
+    if (!block)
+    {
+        my_fprintf(stderr, "psh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    copy = (job *)block;
+    *copy = *j;
+    copy->promoted = 1;
+    pos = block + sizeof(job);
+    str = block + size;
+    link = &copy->first_process;
+    for (p = j->first_process; p; p = p->next)
+    {
+        process *q = (process *)pos;
+        *q = *p;
+        q->job = copy;
+        q->argv = (char **)(pos + sizeof(process));
+        for (i = 0; p->argv[i]; i++)
+            q->argv[i] = _copy_string(&str, p->argv[i]);
+        q->argv[i] = NULL;
+        pos += sizeof(process) + (i + 1) * sizeof(char *);
+        /* A command given by path is its own hash entry.  */
+        if (p->path && p->path == p->argv[0])
+            q->path = q->argv[0];
+        q->infile = _copy_string(&str, p->infile);
+        q->outfile = _copy_string(&str, p->outfile);
+        q->errfile = _copy_string(&str, p->errfile);
+        *link = q;
+        link = &q->next;
     }
+    *link = NULL;
+    copy->command = _copy_string(&str, j->command);
+    return copy;
+}
 
-    // Free the command string and the job structure itself
-    if (j->command)
-        free(j->command);
-    free(j);
+/* Move the jobs of the current line that are still active out of the line
+   arena, so it can be reset.  */
+void promote_jobs()
+{
+    job *j, *prev = NULL;
+    for (j = first_job; j; prev = j, j = j->next)
+        if (!j->promoted)
+        {
+            job *copy = promote_job(j);
+            replace_job(j, copy, prev);
+            j = copy;
+        }
 }
@@ -10,43 +10,24 @@
 #include "builtin.h"
 #include "helpers.h"
 #include "data_structs.h"
+#include "parser.h"
 
-typedef enum
-{
-    JOB,
-    OPERATOR
-} Type;
+#define PSH_VERSION "0.2"
 
-typedef enum Token_Type
-{
-    CMD,
-    ARG,
-    REDIRECTION,
-    PIPE,
-    OPER,
-    LINE_CONTINUATION,
-    INVERSION,
-    QUOTE,
-    QUOTE_END,
-    BG_OPER,
-    END
-} Token_Type;
-
-typedef struct wrapper
-{
-    struct job *j;
-    char *oper;
-    Type type;
-    int exit_status;
-} wrapper;
-
-void read_line(char *buffer, char *prompt);
-char **tokenize(char *line);
+void read_line(char **line, size_t *size, int prompt_type);
+void reserve_line(char **line, size_t *size, size_t needed);
 void init_shell();
-job *create_job(char **tokens, int start, int end);
+job *create_job(Node *pipeline, int background);
+int run_pipeline(Node *pipeline, int background);
+int run_node(Node *node, int background);
+char *remove_quotes(const char *word);
+char *expand_word(char *word);
 void launch_job(job *j, int foreground);
 void free_job(job *j);
+job *promote_job(job *j);
+void promote_jobs();
 void do_job_notification();
+int job_notifications_pending();
 void wait_for_job(job *j);
 void put_job_in_foreground(job *j, int cont);
 void put_job_in_background(job *j, int cont);
@@ -57,11 +38,8 @@ int mark_process_status(pid_t pid, int status);
 void update_status();
 void mark_job_as_running(job *j);
 void continue_job(job *j, int foreground, int send_cont);
-job *find_job(pid_t pgid);
-wrapper **create_jobs(char **tokens);
-int launch_jobs(wrapper **list);
-void print_list(wrapper **list);
 int execute(job *j, int foreground);
-int check_tokens(char **tokens);
-int *categorize_tokens(char **tokens);
+int redirect_builtin(process *p, int saved[3]);
+void restore_builtin(int saved[3]);
+void run_builtin_stage(process *p, builtin_func builtin, int infile, int outfile, int errfile);
 void free_tokens(char **tokens);
\ No newline at end of file
@@ -0,0 +1,200 @@
+#!/bin/bash
+
+# Benchmarks for psh. Run from the repository root after 'make'.
+# Usage: out/bench.sh [name...]   (default: all benchmarks)
+
+PSH=${PSH:-./psh}
+export PSH_NON_INTERACTIVE=1
+
+# Print the wall time of a command in milliseconds.
+time_ms() {
+    local start end
+    start=$(date +%s%N)
+    "$@" > /dev/null 2>&1
+    end=$(date +%s%N)
+    echo $(( (end - start) / 1000000 ))
+}
+
+# Feed N copies of a command line to psh.
+run_lines() {
+    local n=$1 line=$2
+    { yes "$line" | head -n "$n"; echo exit; } | $PSH
+}
+
+# Spawn latency of the fork and posix_spawn backends.
+bench_spawn() {
+    local n=2000 fork_ms spawn_ms
+    fork_ms=$(PSH_SPAWN=fork time_ms run_lines $n /bin/true)
+    spawn_ms=$(PSH_SPAWN=posix_spawn time_ms run_lines $n /bin/true)
+    echo "spawn: $n x /bin/true"
+    echo "  fork:        ${fork_ms} ms ($(( fork_ms * 1000 / n )) us per command)"
+    echo "  posix_spawn: ${spawn_ms} ms ($(( spawn_ms * 1000 / n )) us per command)"
+}
+
+# Heap allocations per command line, counted with out/malloc_count.so.
+bench_alloc() {
+    local n=1000 line='echo a b c $HOME ~ x{1,2} *.h > /dev/null; true && true' base total
+    gcc -shared -fPIC -O2 -o out/malloc_count.so out/malloc_count.c || return
+    count() {
+        PSH="env LD_PRELOAD=$PWD/out/malloc_count.so $PSH" run_lines "$1" "$line" 2>&1 >/dev/null |
+            sed -n 's/^malloc_count: \([0-9]*\) allocations.*/\1/p'
+    }
+    base=$(count 0)
+    total=$(count $n)
+    echo "alloc: $n x '$line'"
+    echo "  startup:  $base allocations"
+    echo "  per line: $(( (total - base) / n )) allocations"
+}
+
+# Lexing and job creation for long command lines.
+bench_lex() {
+    local n=2000 line ms
+    line="cd . $(seq -s ' ' 1 200)"
+    ms=$(time_ms run_lines $n "$line")
+    echo "lex: $n x 'cd . 1 ... 200' (builtin, no fork)"
+    echo "  ${ms} ms ($(( ms * 1000 / n )) us per line)"
+}
+
+# Replaying the same lines with and without the parse cache.
+bench_cache() {
+    local n=3000 line off_ms on_ms
+    line="cd . \$HOME | cd . 2>/dev/null && cd . '$(seq -s ' ' 1 60)' || cd . *.h > /dev/null; cd ."
+    replay() {
+        { for i in $(seq "$n"); do echo "$line"; done; echo parsecache; echo exit; } | $PSH
+    }
+    off_ms=$(PSH_PARSE_CACHE=0 time_ms replay)
+    on_ms=$(time_ms replay)
+    echo "cache: $n x replayed line"
+    echo "  PSH_PARSE_CACHE=0: ${off_ms} ms"
+    echo "  default:           ${on_ms} ms ($(replay 2>/dev/null | grep -o 'hits [0-9]* misses [0-9]*'))"
+}
+
+# Startup and script parsing throughput against dash, builtins only.
+bench_script() {
+    local n=500 lines=100000 script=/tmp/psh_bench_script.psh sh
+    for i in $(seq 10); do
+        echo "# block $i"
+        echo "cd . && cd /tmp || cd '/'; cd . \\"
+        echo "    > /dev/null"
+        echo 'cd "$HOME" 2> /dev/null; cd .'
+    done > "$script.block"
+    for i in $(seq $(( lines / 40 ))); do cat "$script.block"; done > "$script"
+    rm -f "$script.block"
+    echo "script: startup ($n x -c 'cd .') and $lines lines of builtins"
+    for sh in "$PSH" dash; do
+        command -v "$sh" > /dev/null || continue
+        startup() { for i in $(seq "$n"); do $sh -c 'cd .'; done; }
+        echo "  $(basename "$sh"): startup $(( $(time_ms startup) * 1000 / n )) us," \
+             "script $(time_ms $sh "$script") ms"
+    done
+    rm -f "$script"
+}
+
+# Parsing a large script against loading its trees from the .pshc cache.
+bench_pshc() {
+    local lines=200000 script=/tmp/psh_bench_pshc.psh cold_ms warm_ms
+    export XDG_CACHE_HOME=/tmp/psh_bench_cache
+    for i in $(seq $(( lines / 4 ))); do
+        echo "# step $i"
+        echo "ls -l \"\$HOME/dir $i\" 2> /dev/null | grep -v '^total' > /tmp/out.$i || echo failed"
+        echo "cp a$i.txt b$i.txt && mv b$i.txt c$i.txt; rm -f c$i.txt &"
+        echo "! test -e /tmp/flag.$i"
+    done > "$script"
+    cold_ms=$(PSH_SCRIPT_CACHE=0 time_ms $PSH -n "$script")
+    $PSH -n "$script"
+    warm_ms=$(time_ms $PSH -n "$script")
+    echo "pshc: $lines lines, $(( $(wc -c < "$script") / 1024 )) KiB, parsed with -n"
+    echo "  parse:      ${cold_ms} ms"
+    echo "  cache load: ${warm_ms} ms ($(( $(cat "$XDG_CACHE_HOME"/psh/*.pshc | wc -c) / 1024 )) KiB cache)"
+    rm -rf "$script" "$XDG_CACHE_HOME"
+}
+
+# Loops, case and function calls run from compiled code against dash.
+bench_loop() {
+    local n=20000 script=/tmp/psh_bench_loop.psh sh
+    {
+        echo 'visit() { case $1 in *0) cd . ;; *) cd /tmp ;; esac; }'
+        echo "for i in $(seq -s ' ' $n); do"
+        echo '    if cd .; then visit $i; else break; fi'
+        echo 'done'
+        echo "for i in $(seq -s ' ' $n); do cd . && cd /tmp; done"
+    } > "$script"
+    echo "loop: 2 x $n iterations of builtins, a case and a function call"
+    for sh in "$PSH" dash; do
+        command -v "$sh" > /dev/null || continue
+        echo "  $(basename "$sh"): $(time_ms $sh "$script") ms"
+    done
+    rm -f "$script"
+}
+
+# Brace expansion of a million words. The list is too long for an external
+# echo, so the time is mostly the expansion itself.
+bench_brace() {
+    local n=1000000 sh
+    echo "brace: echo {1..$n}"
+    for sh in "$PSH" bash; do
+        command -v "$sh" > /dev/null || continue
+        echo "  $(basename "$sh"): $(time_ms $sh -c "echo {1..$n}") ms"
+    done
+}
+
+# Variable lookups and assignments with 5000 variables defined.
+bench_vars() {
+    local script=/tmp/psh_bench_vars.sh
+    echo 'set v{1..5000}=1' > "$script"
+    echo 'for i in {1..20000}; do set a=$v4999 b=$v1; done' >> "$script"
+    echo "vars: 40000 lookups among 5000 variables"
+    echo "  psh: $(time_ms "$PSH" "$script") ms"
+    rm -f "$script"
+}
+
+# A word with 2000 parameter references, expanded 200 times.
+bench_expand() {
+    local script=/tmp/psh_bench_expand.sh refs
+    refs=$(printf '$a%.0s' $(seq 2000))
+    echo 'set a=x' > "$script"
+    echo "for i in {1..200}; do set b=$refs; done" >> "$script"
+    echo "expand: 200 words of 2000 \$a each"
+    echo "  psh: $(time_ms "$PSH" "$script") ms"
+    rm -f "$script"
+}
+
+# echo, true and test as builtins against the external binaries.
+bench_builtins() {
+    local n=100000 script=/tmp/psh_bench_builtins.sh
+    echo "for i in {1..$n}; do echo \$i; true; [ \$i = 0 ]; done" > "$script"
+    echo "builtins: $n iterations of echo, true and ["
+    echo "  builtin:  $(time_ms "$PSH" "$script") ms"
+    echo "for i in {1..$n}; do /bin/echo \$i; /bin/true; /usr/bin/[ \$i = 0 ]; done" > "$script"
+    echo "  external: $(time_ms "$PSH" "$script") ms"
+    rm -f "$script"
+}
+
+# Recursive ** globbing over a tree of 100000 files against bash's globstar.
+bench_globstar() {
+    local root=/tmp/psh_bench_tree psh=$(realpath "$PSH")
+    for a in $(seq 20); do
+        for b in $(seq 20); do
+            mkdir -p "$root/src/d$a/e$b"
+            (cd "$root/src/d$a/e$b" && touch $(seq -f 'f%g.c' 125) $(seq -f 'f%g.h' 125))
+        done
+    done
+    echo "globstar: src/**/*.c over $(find "$root/src" -type f | wc -l) files"
+    echo "  psh: $(cd "$root" && time_ms "$psh" -c 'echo src/**/*.c') ms"
+    command -v bash > /dev/null &&
+        echo "  bash: $(cd "$root" && time_ms bash -O globstar -c 'echo src/**/*.c') ms"
+    rm -rf "$root"
+}
+
+# Compiled glob matcher against fnmatch over a million names.
+bench_match() {
+    gcc -O2 -I. -o out/glob_bench out/glob_bench.c glob_match.c custom_print.c || return
+    echo "match: 1000000 synthetic names"
+    out/glob_bench
+    rm -f out/glob_bench
+}
+
+benchmarks=${*:-spawn alloc lex cache script pshc loop brace vars expand builtins globstar match}
+for b in $benchmarks; do
+    "bench_$b"
+done
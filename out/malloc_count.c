@@ -0,0 +1,50 @@
+/* LD_PRELOAD library counting heap allocations, used by out/bench.sh.
+   The totals are written to stderr when the process exits. Build with:
+   gcc -shared -fPIC -O2 -o out/malloc_count.so out/malloc_count.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long mallocs, frees;
+
+void *malloc(size_t size)
+{
+    mallocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    mallocs++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (!ptr)
+        mallocs++;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    if (ptr)
+        frees++;
+    __libc_free(ptr);
+}
+
+/* Count the shell only, not the commands it starts. */
+__attribute__((constructor)) static void init(void)
+{
+    unsetenv("LD_PRELOAD");
+}
+
+__attribute__((destructor)) static void report(void)
+{
+    fprintf(stderr, "malloc_count: %lu allocations, %lu frees\n", mallocs, frees);
+}
@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "parse_cache.h"
+#include "env.h"
+#include "custom_print.h"
+
+/* LRU cache of syntax trees keyed by the normalized command line. Lines
+   run again from history or a loop skip lexing and parsing; only the
+   expansions, which depend on the shell state, are done again. The size
+   is set by PSH_PARSE_CACHE (default 64 lines, 0 disables the cache). */
+
+#define PARSE_CACHE_DEFAULT_SIZE 64
+#define PARSE_CACHE_BUCKETS 256
+#define PARSE_CACHE_BLOCK_SIZE 1024
+
+typedef struct Cache_Entry
+{
+    struct Cache_Entry *hash_next;
+    struct Cache_Entry *prev, *next; /* recency list, most recent first */
+    unsigned long hash;
+    char *key;
+    Node *tree;
+    Arena arena; /* holds the key and the tree */
+} Cache_Entry;
+
+Cache_Entry *cache_buckets[PARSE_CACHE_BUCKETS];
+Cache_Entry *cache_first = NULL, *cache_last = NULL;
+Cache_Entry *cache_running = NULL; /* entry of the line being run */
+int cache_count = 0;
+unsigned long parse_cache_hits = 0, parse_cache_misses = 0;
+
+/* Return the configured number of cached lines. */
+int _parse_cache_size()
+{
+    char *value = psh_getenv("PSH_PARSE_CACHE");
+    if (!value || *value == '\0')
+        return PARSE_CACHE_DEFAULT_SIZE;
+    return atoi(value) > 0 ? atoi(value) : 0;
+}
+
+/* Copy the line with every run of unquoted blanks turned into one space,
+   so lines differing only in spacing share an entry. */
+char *_normalize(const char *line, unsigned long *hash)
+{
+    char *key = arena_alloc(&line_arena, strlen(line) + 1), *out = key;
+    char quote = 0;
+    unsigned long h = 5381;
+
+    for (; *line; line++)
+    {
+        char c = *line;
+        if (quote)
+        {
+            if (c == quote)
+                quote = 0;
+        }
+        else if (c == '"' || c == '\'')
+            quote = c;
+        else if (c == '\\' && line[1] != '\0')
+        {
+            *out++ = c;
+            h = h * 33 + (unsigned char)c;
+            c = *++line;
+        }
+        else if (c == ' ' || c == '\t')
+        {
+            while (line[1] == ' ' || line[1] == '\t')
+                line++;
+            c = ' ';
+        }
+        *out++ = c;
+        h = h * 33 + (unsigned char)c;
+    }
+    *out = '\0';
+    *hash = h;
+    return key;
+}
+
+void _unlink_entry(Cache_Entry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        cache_first = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        cache_last = e->prev;
+}
+
+void _push_front(Cache_Entry *e)
+{
+    e->prev = NULL;
+    e->next = cache_first;
+    if (cache_first)
+        cache_first->prev = e;
+    cache_first = e;
+    if (!cache_last)
+        cache_last = e;
+}
+
+void _evict(Cache_Entry *e)
+{
+    Cache_Entry **link = &cache_buckets[e->hash % PARSE_CACHE_BUCKETS];
+    while (*link != e)
+        link = &(*link)->hash_next;
+    *link = e->hash_next;
+    _unlink_entry(e);
+    arena_free(&e->arena);
+    free(e);
+    cache_count--;
+}
+
+/* Parse the line, reusing the tree of an identical line parsed before.
+   Only lines that parse completely are cached. */
+Node *parse_cached(const char *line, Parse_Status *status)
+{
+    int size = _parse_cache_size();
+    unsigned long hash;
+    char *key;
+    Cache_Entry *e;
+
+    cache_running = NULL;
+    while (cache_count > size)
+        _evict(cache_last);
+    if (size == 0)
+        return parse(&line_arena, line, status);
+
+    key = _normalize(line, &hash);
+    for (e = cache_buckets[hash % PARSE_CACHE_BUCKETS]; e; e = e->hash_next)
+        if (e->hash == hash && strcmp(e->key, key) == 0)
+        {
+            parse_cache_hits++;
+            _unlink_entry(e);
+            _push_front(e);
+            cache_running = e;
+            *status = PARSE_OK;
+            return e->tree;
+        }
+
+    parse_cache_misses++;
+    e = malloc(sizeof(Cache_Entry));
+    if (!e)
+    {
+        my_fprintf(stderr, "psh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(&e->arena, 0, sizeof(Arena));
+    e->arena.block_size = PARSE_CACHE_BLOCK_SIZE;
+    e->tree = parse(&e->arena, line, status);
+    if (*status != PARSE_OK)
+    {
+        arena_free(&e->arena);
+        free(e);
+        return NULL;
+    }
+    e->key = arena_strdup(&e->arena, key);
+    e->hash = hash;
+    e->hash_next = cache_buckets[hash % PARSE_CACHE_BUCKETS];
+    cache_buckets[hash % PARSE_CACHE_BUCKETS] = e;
+    _push_front(e);
+    cache_running = e;
+    if (++cache_count > size)
+        _evict(cache_last);
+    return e->tree;
+}
+
+/* Print the hit and miss counters and the cached lines, most recent first. */
+void parse_cache_print()
+{
+    my_printf("hits %lu misses %lu entries %d\n", parse_cache_hits, parse_cache_misses, cache_count);
+    for (Cache_Entry *e = cache_first; e; e = e->next)
+        my_printf("  %s\n", e->key);
+}
+
+/* Forget the cached lines and reset the counters. The tree of the line
+   being run is kept, unless all is set. */
+void parse_cache_clear(int all)
+{
+    Cache_Entry *e, *prev;
+    for (e = cache_last; e; e = prev)
+    {
+        prev = e->prev;
+        if (all || e != cache_running)
+            _evict(e);
+    }
+    if (all)
+        cache_running = NULL;
+    parse_cache_hits = parse_cache_misses = 0;
+}
@@ -0,0 +1,10 @@
+#include "parser.h"
+
+#ifndef PARSE_CACHE_H
+#define PARSE_CACHE_H
+
+Node *parse_cached(const char *line, Parse_Status *status);
+void parse_cache_print();
+void parse_cache_clear(int all);
+
+#endif
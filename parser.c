@@ -0,0 +1,647 @@
+#include <stdio.h>
+#include <string.h>
+#include "parser.h"
+#include "custom_print.h"
+
+/* Recursive descent parser building the syntax tree of a command line or
+   of a script statement. Tokens are pulled from the lexer one at a time,
+   and syntax errors and input that needs a continuation are detected in
+   the same pass. The tree holds the words before expansion, so it can be
+   run more than once.
+
+   script   : (list NEWLINE)*
+   list     : and_or ((';' | '&') and_or)* [';' | '&']
+   and_or   : pipeline (('&&' | '||') NEWLINE* pipeline)*
+   pipeline : ['!'] command ('|' NEWLINE* command)*
+   command  : simple | compound | function
+   simple   : (WORD | redirect)+
+   redirect : ('<' | '>' | '>>' | '2>') WORD
+   compound : if | while | for | case | '{' body '}'
+   if       : 'if' body 'then' body ('elif' body 'then' body)* ['else' body] 'fi'
+   while    : ('while' | 'until') body 'do' body 'done'
+   for      : 'for' WORD NEWLINE* ['in' WORD* (';' | NEWLINE)] NEWLINE* 'do' body 'done'
+   case     : 'case' WORD NEWLINE* 'in' NEWLINE* item* 'esac'
+   item     : ['('] WORD ('|' WORD)* ')' [body] [';;'] NEWLINE*
+   function : WORD '(' ')' NEWLINE* compound | 'function' WORD ['(' ')'] NEWLINE* compound
+   body     : NEWLINE* and_or ((';' | '&' | NEWLINE) NEWLINE* and_or)* [';' | '&'] NEWLINE*
+
+   A command line is a single list in which newlines act as ';'. Reserved
+   words are only recognized unquoted and as the first word of a command.
+   Compound commands cannot be piped or put in the background. */
+
+#define WORDS_INITIAL_SIZE 8
+
+Node *_parse_and_or(Parser *p);
+Node *_parse_compound(Parser *p);
+
+Node *_new_node(Parser *p, Node_Type type)
+{
+    Node *node = arena_alloc(p->arena, sizeof(Node));
+    memset(node, 0, sizeof(Node));
+    node->type = type;
+    return node;
+}
+
+/* The children array doubles whenever count reaches a power of two. */
+void _add_child(Parser *p, Node *node, Node *child)
+{
+    if ((node->count & (node->count - 1)) == 0)
+        node->children = arena_grow(p->arena, node->children, node->count * sizeof(Node *),
+                                    (node->count ? 2 * node->count : 1) * sizeof(Node *));
+    node->children[node->count++] = child;
+}
+
+Lex_Kind _peek(Parser *p)
+{
+    return p->token.kind;
+}
+
+/* Move to the next token. A continuation or an open quote at the end of
+   the text ends the input early and marks it incomplete. */
+void _advance(Parser *p)
+{
+    p->last_end = p->token.offset + p->token.length;
+    lex_next(&p->lexer, &p->token);
+    if (p->token.kind == LEX_CONTINUATION)
+    {
+        p->token.kind = LEX_END;
+        p->incomplete = 1;
+    }
+    else if (p->token.flags & LEX_OPEN_QUOTE)
+        p->incomplete = 1;
+}
+
+void _skip_newlines(Parser *p)
+{
+    while (_peek(p) == LEX_NEWLINE)
+        _advance(p);
+}
+
+int _line_of(Parser *p, size_t offset)
+{
+    int line = p->line;
+    for (const char *s = p->lexer.text; (s = memchr(s, '\n', p->lexer.text + offset - s)); s++)
+        line++;
+    return line;
+}
+
+/* Report a syntax error at the offset. */
+Node *_error(Parser *p, size_t offset, const char *message)
+{
+    if (p->name)
+        my_fprintf(stderr, "psh: %s: line %d: %s\n", p->name, _line_of(p, offset), message);
+    else
+        my_fprintf(stderr, "psh: %s\n", message);
+    p->status = PARSE_ERROR;
+    return NULL;
+}
+
+/* Stop at the current token. The end of the input where more is expected
+   asks for a continuation, anything else is an error. */
+Node *_unexpected(Parser *p)
+{
+    Lex_Token *t = &p->token;
+    char message[96];
+
+    if ((t->kind == LEX_END || p->incomplete) && !p->final)
+    {
+        p->status = PARSE_INCOMPLETE;
+        return NULL;
+    }
+    if (t->kind == LEX_END || p->incomplete)
+        return _error(p, t->offset, "syntax error: unexpected end of file");
+    if (t->kind == LEX_NEWLINE)
+        return _error(p, t->offset, "syntax error near unexpected token `newline'");
+    snprintf(message, sizeof(message), "syntax error near unexpected token `%.*s'",
+             t->length < 64 ? t->length : 64, p->lexer.text + t->offset);
+    return _error(p, t->offset, message);
+}
+
+/* Return 1 if the current token is the unquoted word. */
+int _at_word(Parser *p, const char *word)
+{
+    size_t n = strlen(word);
+    return p->token.kind == LEX_WORD && !(p->token.flags & LEX_QUOTED) &&
+           (size_t)p->token.length == n && memcmp(p->lexer.text + p->token.offset, word, n) == 0;
+}
+
+/* Reserved words and operators that end the body of a compound command. */
+int _at_body_end(Parser *p)
+{
+    static const char *words[] = {"then", "elif", "else", "fi", "do", "done", "esac", "}", NULL};
+    if (_peek(p) == LEX_DSEMI)
+        return 1;
+    for (int i = 0; words[i]; i++)
+        if (_at_word(p, words[i]))
+            return 1;
+    return 0;
+}
+
+/* Consume the reserved word or stop with an error. */
+int _expect(Parser *p, const char *word)
+{
+    if (!_at_word(p, word))
+    {
+        _unexpected(p);
+        return 0;
+    }
+    _advance(p);
+    return 1;
+}
+
+/* Copy the text of the current token into the tree. */
+char *_token_text(Parser *p)
+{
+    return arena_strndup(p->arena, p->lexer.text + p->token.offset, p->token.length);
+}
+
+/* Append the current word to a NULL-terminated array of size slots. */
+char **_add_word(Parser *p, char **words, int *count, int *size)
+{
+    /* Keep a slot for the terminating NULL. */
+    if (*count + 1 >= *size)
+    {
+        words = arena_grow(p->arena, words, *size * sizeof(char *), 2 * *size * sizeof(char *));
+        *size *= 2;
+    }
+    words[(*count)++] = _token_text(p);
+    words[*count] = NULL;
+    return words;
+}
+
+Node *_parse_command(Parser *p)
+{
+    Node *command = _new_node(p, NODE_COMMAND);
+    Redirect **last_redirect = &command->redirects;
+    int count = 0, size = WORDS_INITIAL_SIZE;
+
+    command->words = arena_alloc(p->arena, size * sizeof(char *));
+    for (;; _advance(p))
+    {
+        Lex_Kind kind = _peek(p);
+        if (kind == LEX_WORD || (kind == LEX_BANG && count > 0))
+        {
+            if (p->incomplete)
+                return _unexpected(p);
+            command->words = _add_word(p, command->words, &count, &size);
+        }
+        else if (lex_is_redirection(kind))
+        {
+            Redirect *r;
+            _advance(p);
+            if (_peek(p) != LEX_WORD || p->incomplete)
+                return _unexpected(p);
+            r = arena_alloc(p->arena, sizeof(Redirect));
+            r->kind = kind;
+            r->target = _token_text(p);
+            r->next = NULL;
+            *last_redirect = r;
+            last_redirect = &r->next;
+        }
+        else if (kind == LEX_LPAREN && count == 1 && !command->redirects)
+        {
+            /* name () compound */
+            Node *function = _new_node(p, NODE_FUNCTION), *body;
+            _advance(p);
+            if (_peek(p) != LEX_RPAREN)
+                return _unexpected(p);
+            _advance(p);
+            _skip_newlines(p);
+            if (!(body = _parse_compound(p)))
+                return NULL;
+            function->words = command->words;
+            _add_child(p, function, body);
+            return function;
+        }
+        else
+            break;
+    }
+    if (count == 0 && command->redirects == NULL)
+        return _unexpected(p);
+    command->words[count] = NULL;
+    return command;
+}
+
+/* An and-or list put in the background must end in a simple pipeline. */
+int _check_background(Parser *p, Node *item)
+{
+    Node *last = item;
+    while (last->type == NODE_AND || last->type == NODE_OR)
+        last = last->children[1];
+    if (last->children[0]->type == NODE_COMMAND)
+        return 1;
+    _error(p, p->token.offset, "compound commands cannot run in the background");
+    return 0;
+}
+
+/* Parse the commands of a compound command body up to the reserved word
+   that ends it. Only case items may have an empty body. */
+Node *_parse_body(Parser *p, int empty)
+{
+    Node *list = _new_node(p, NODE_LIST);
+    for (;;)
+    {
+        Node *item;
+        _skip_newlines(p);
+        if (_peek(p) == LEX_END || _at_body_end(p))
+            break;
+        if (!(item = _parse_and_or(p)))
+            return NULL;
+        if (_peek(p) == LEX_AMP)
+        {
+            if (!_check_background(p, item))
+                return NULL;
+            item->flags |= NODE_BACKGROUND;
+        }
+        else if (_peek(p) != LEX_SEMI && _peek(p) != LEX_NEWLINE && _peek(p) != LEX_END &&
+                 !_at_body_end(p))
+            return _unexpected(p);
+        if (_peek(p) == LEX_AMP || _peek(p) == LEX_SEMI)
+            _advance(p);
+        _add_child(p, list, item);
+    }
+    if (list->count == 0 && !empty)
+        return _unexpected(p);
+    return list;
+}
+
+Node *_parse_if(Parser *p)
+{
+    Node *node = _new_node(p, NODE_IF), *part;
+
+    for (;;)
+    {
+        _advance(p); /* if or elif */
+        if (!(part = _parse_body(p, 0)))
+            return NULL;
+        _add_child(p, node, part);
+        if (!_expect(p, "then") || !(part = _parse_body(p, 0)))
+            return NULL;
+        _add_child(p, node, part);
+        if (!_at_word(p, "elif"))
+            break;
+    }
+    if (_at_word(p, "else"))
+    {
+        _advance(p);
+        if (!(part = _parse_body(p, 0)))
+            return NULL;
+        _add_child(p, node, part);
+    }
+    return _expect(p, "fi") ? node : NULL;
+}
+
+/* do body done */
+Node *_parse_do(Parser *p)
+{
+    Node *body;
+    if (!_expect(p, "do") || !(body = _parse_body(p, 0)) || !_expect(p, "done"))
+        return NULL;
+    return body;
+}
+
+Node *_parse_while(Parser *p)
+{
+    Node *node = _new_node(p, NODE_WHILE), *part;
+
+    if (_at_word(p, "until"))
+        node->flags |= NODE_UNTIL;
+    _advance(p);
+    if (!(part = _parse_body(p, 0)))
+        return NULL;
+    _add_child(p, node, part);
+    if (!(part = _parse_do(p)))
+        return NULL;
+    _add_child(p, node, part);
+    return node;
+}
+
+/* Start a word array with the current word, which must be there. */
+char **_first_word(Parser *p, int *count, int *size)
+{
+    char **words;
+    if (_peek(p) != LEX_WORD || p->incomplete)
+    {
+        _unexpected(p);
+        return NULL;
+    }
+    words = arena_alloc(p->arena, *size * sizeof(char *));
+    words = _add_word(p, words, count, size);
+    _advance(p);
+    return words;
+}
+
+Node *_parse_for(Parser *p)
+{
+    Node *node = _new_node(p, NODE_FOR), *body;
+    int count = 0, size = WORDS_INITIAL_SIZE;
+
+    _advance(p);
+    if (!(node->words = _first_word(p, &count, &size)))
+        return NULL;
+    _skip_newlines(p);
+    if (_at_word(p, "in"))
+    {
+        node->flags |= NODE_FOR_IN;
+        for (_advance(p); _peek(p) == LEX_WORD && !p->incomplete; _advance(p))
+            node->words = _add_word(p, node->words, &count, &size);
+        if (_peek(p) != LEX_SEMI && _peek(p) != LEX_NEWLINE)
+            return _unexpected(p);
+        _advance(p);
+    }
+    else if (_peek(p) == LEX_SEMI)
+        _advance(p);
+    _skip_newlines(p);
+    if (!(body = _parse_do(p)))
+        return NULL;
+    _add_child(p, node, body);
+    return node;
+}
+
+Node *_parse_case(Parser *p)
+{
+    Node *node = _new_node(p, NODE_CASE);
+    int count = 0, size = 2;
+
+    _advance(p);
+    if (!(node->words = _first_word(p, &count, &size)))
+        return NULL;
+    _skip_newlines(p);
+    if (!_expect(p, "in"))
+        return NULL;
+    _skip_newlines(p);
+
+    while (!_at_word(p, "esac"))
+    {
+        Node *item = _new_node(p, NODE_CASE_ITEM), *body;
+        count = 0, size = WORDS_INITIAL_SIZE;
+
+        if (_peek(p) == LEX_LPAREN)
+            _advance(p);
+        if (!(item->words = _first_word(p, &count, &size)))
+            return NULL;
+        while (_peek(p) == LEX_PIPE)
+        {
+            _advance(p);
+            if (_peek(p) != LEX_WORD || p->incomplete)
+                return _unexpected(p);
+            item->words = _add_word(p, item->words, &count, &size);
+            _advance(p);
+        }
+        if (_peek(p) != LEX_RPAREN)
+            return _unexpected(p);
+        _advance(p);
+        if (!(body = _parse_body(p, 1)))
+            return NULL;
+        _add_child(p, item, body);
+        _add_child(p, node, item);
+        if (_peek(p) == LEX_DSEMI)
+            _advance(p);
+        else if (!_at_word(p, "esac"))
+            return _unexpected(p);
+        _skip_newlines(p);
+    }
+    _advance(p);
+    return node;
+}
+
+Node *_parse_group(Parser *p)
+{
+    Node *node = _new_node(p, NODE_GROUP), *body;
+
+    _advance(p);
+    if (!(body = _parse_body(p, 0)) || !_expect(p, "}"))
+        return NULL;
+    _add_child(p, node, body);
+    return node;
+}
+
+/* function name [()] compound */
+Node *_parse_function(Parser *p)
+{
+    Node *node = _new_node(p, NODE_FUNCTION), *body;
+    int count = 0, size = 2;
+
+    _advance(p);
+    if (!(node->words = _first_word(p, &count, &size)))
+        return NULL;
+    if (_peek(p) == LEX_LPAREN)
+    {
+        _advance(p);
+        if (_peek(p) != LEX_RPAREN)
+            return _unexpected(p);
+        _advance(p);
+    }
+    _skip_newlines(p);
+    if (!(body = _parse_compound(p)))
+        return NULL;
+    _add_child(p, node, body);
+    return node;
+}
+
+/* Return 1 if a compound command starts at the current token. */
+int _at_compound(Parser *p)
+{
+    return _at_word(p, "if") || _at_word(p, "while") || _at_word(p, "until") ||
+           _at_word(p, "for") || _at_word(p, "case") || _at_word(p, "{");
+}
+
+Node *_parse_compound(Parser *p)
+{
+    if (_at_word(p, "if"))
+        return _parse_if(p);
+    if (_at_word(p, "while") || _at_word(p, "until"))
+        return _parse_while(p);
+    if (_at_word(p, "for"))
+        return _parse_for(p);
+    if (_at_word(p, "case"))
+        return _parse_case(p);
+    if (_at_word(p, "{"))
+        return _parse_group(p);
+    return _unexpected(p);
+}
+
+Node *_parse_pipeline(Parser *p)
+{
+    Node *pipeline = _new_node(p, NODE_PIPELINE);
+    size_t first;
+    int simple = 1;
+
+    if (_peek(p) == LEX_BANG)
+    {
+        pipeline->flags |= NODE_INVERTED;
+        _advance(p);
+    }
+    first = p->token.offset;
+    for (;;)
+    {
+        Node *command;
+        if (_at_compound(p))
+            command = _parse_compound(p);
+        else if (_at_word(p, "function"))
+            command = _parse_function(p);
+        else
+            command = _parse_command(p);
+        if (!command)
+            return NULL;
+        if (command->type != NODE_COMMAND)
+            simple = 0;
+        _add_child(p, pipeline, command);
+        if (_peek(p) != LEX_PIPE)
+            break;
+        _advance(p);
+        _skip_newlines(p);
+    }
+    if (!simple && pipeline->count > 1)
+        return _error(p, first, "compound commands cannot be piped");
+    /* The text names the job, compound commands do not make one. */
+    if (simple)
+    {
+        pipeline->text = arena_strndup(p->arena, p->lexer.text + first, p->last_end - first);
+        pipeline->offset = first;
+    }
+    return pipeline;
+}
+
+Node *_parse_and_or(Parser *p)
+{
+    Node *left = _parse_pipeline(p);
+    while (left && (_peek(p) == LEX_AND_IF || _peek(p) == LEX_OR_IF))
+    {
+        Node *node = _new_node(p, _peek(p) == LEX_AND_IF ? NODE_AND : NODE_OR);
+        Node *right;
+        _advance(p);
+        _skip_newlines(p);
+        if (!(right = _parse_pipeline(p)))
+            return NULL;
+        _add_child(p, node, left);
+        _add_child(p, node, right);
+        left = node;
+    }
+    return left;
+}
+
+/* Parse and-or lists up to the end of the input, or with statement set
+   only up to the end of the first non-empty line. */
+Node *_parse_list(Parser *p, int statement)
+{
+    Node *list = _new_node(p, NODE_LIST);
+    while (_peek(p) != LEX_END)
+    {
+        Node *item;
+        if (_peek(p) == LEX_NEWLINE)
+        {
+            _advance(p);
+            if (statement && list->count > 0)
+                break;
+            continue;
+        }
+        if (!(item = _parse_and_or(p)))
+            return NULL;
+        if (_peek(p) == LEX_AMP)
+        {
+            if (!_check_background(p, item))
+                return NULL;
+            item->flags |= NODE_BACKGROUND;
+        }
+        else if (_peek(p) != LEX_SEMI && _peek(p) != LEX_NEWLINE && _peek(p) != LEX_END)
+            return _unexpected(p);
+        if (_peek(p) == LEX_AMP || _peek(p) == LEX_SEMI)
+            _advance(p);
+        _add_child(p, list, item);
+    }
+    /* The last line of a script may lack its newline. */
+    if (statement && _peek(p) == LEX_END && !p->final)
+        return _unexpected(p);
+    return list;
+}
+
+void parser_init(Parser *p, const char *text, size_t length, const char *name, int final)
+{
+    memset(p, 0, sizeof(Parser));
+    p->name = name;
+    p->line = 1;
+    p->final = final;
+    lexer_init(&p->lexer, text, length);
+    _advance(p);
+}
+
+/* Parse the next statement of a script into a tree allocated in the arena a.
+   Return NULL with status PARSE_OK at the end of the text. Unless the text
+   is final, a statement running into its end is PARSE_INCOMPLETE and should
+   be parsed again from parser_offset once more text is available. */
+Node *parse_next(Parser *p, Arena *a, Parse_Status *status)
+{
+    Node *tree;
+
+    p->arena = a;
+    p->status = PARSE_OK;
+    tree = _parse_list(p, 1);
+    *status = p->status;
+    if (tree && tree->count == 0)
+        return NULL;
+    return tree;
+}
+
+/* Offset of the first token not consumed by the statements parsed so far. */
+size_t parser_offset(Parser *p)
+{
+    return p->token.offset;
+}
+
+/* Parse a command line into a tree allocated in the arena a.
+   Return NULL and set status if the line is incomplete or wrong. */
+Node *parse(Arena *a, const char *line, Parse_Status *status)
+{
+    Parser p;
+    Node *tree;
+
+    parser_init(&p, line, strlen(line), NULL, 0);
+    p.arena = a;
+    p.status = PARSE_OK;
+    tree = _parse_list(&p, 0);
+    /* A backslash or an open quote at the end asks for more input. */
+    if (tree && p.incomplete)
+        p.status = PARSE_INCOMPLETE;
+    *status = p.status;
+    return p.status == PARSE_OK ? tree : NULL;
+}
+
+/* Copy a tree into the arena, for trees that outlive the line they were
+   parsed from. */
+Node *node_copy(Arena *a, Node *node)
+{
+    Node *copy = arena_alloc(a, sizeof(Node));
+    Redirect **last = &copy->redirects;
+
+    *copy = *node;
+    if (node->count)
+    {
+        copy->children = arena_alloc(a, node->count * sizeof(Node *));
+        for (int i = 0; i < node->count; i++)
+            copy->children[i] = node_copy(a, node->children[i]);
+    }
+    if (node->words)
+    {
+        int n = 0;
+        while (node->words[n])
+            n++;
+        copy->words = arena_alloc(a, (n + 1) * sizeof(char *));
+        for (int i = 0; i < n; i++)
+            copy->words[i] = arena_strdup(a, node->words[i]);
+        copy->words[n] = NULL;
+    }
+    *last = NULL;
+    for (Redirect *r = node->redirects; r; r = r->next)
+    {
+        Redirect *target = arena_alloc(a, sizeof(Redirect));
+        target->kind = r->kind;
+        target->target = arena_strdup(a, r->target);
+        target->next = NULL;
+        *last = target;
+        last = &target->next;
+    }
+    if (node->text)
+        copy->text = arena_strdup(a, node->text);
+    return copy;
+}
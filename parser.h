@@ -0,0 +1,75 @@
+#include "arena.h"
+#include "lexer.h"
+
+#ifndef PARSER_H
+#define PARSER_H
+
+typedef enum Node_Type
+{
+    NODE_LIST,     /* and-or lists run one after another */
+    NODE_AND,      /* children[1] runs if children[0] succeeded */
+    NODE_OR,       /* children[1] runs if children[0] failed */
+    NODE_PIPELINE, /* commands connected by pipes */
+    NODE_COMMAND,  /* simple command */
+    NODE_IF,       /* children are condition and body pairs, then the else body if any */
+    NODE_WHILE,    /* children[1] runs while children[0] succeeds */
+    NODE_FOR,      /* words are the variable and the items, children[0] is the body */
+    NODE_CASE,     /* words[0] is the subject, children are the items */
+    NODE_CASE_ITEM,/* words are the patterns, children[0] is the body */
+    NODE_GROUP,    /* { list } */
+    NODE_FUNCTION  /* words[0] is the name, children[0] is the body */
+} Node_Type;
+
+/* Node flags. */
+#define NODE_INVERTED 1   /* pipeline preceded by ! */
+#define NODE_BACKGROUND 2 /* list item ended by & */
+#define NODE_UNTIL 4      /* while loop that runs until the condition succeeds */
+#define NODE_FOR_IN 8     /* for loop with an in list, otherwise it runs over $1... */
+
+typedef struct Redirect
+{
+    struct Redirect *next;
+    Lex_Kind kind; /* LEX_LESS, LEX_GREAT, LEX_DGREAT or LEX_ERR_GREAT */
+    char *target;  /* file name before expansion */
+} Redirect;
+
+typedef struct Node
+{
+    Node_Type type;
+    int flags;
+    struct Node **children; /* list items, sides of && and ||, or pipeline commands */
+    int count;
+    char **words;           /* command words before expansion, NULL-terminated */
+    Redirect *redirects;
+    char *text;             /* source text of a pipeline, used for job messages */
+    size_t offset;          /* where text starts in the source */
+} Node;
+
+typedef enum Parse_Status
+{
+    PARSE_OK,
+    PARSE_INCOMPLETE, /* the line needs a continuation, or a script more input */
+    PARSE_ERROR
+} Parse_Status;
+
+/* Parses a script one statement at a time. */
+typedef struct Parser
+{
+    Arena *arena;       /* the tree is allocated here */
+    Lexer lexer;
+    Lex_Token token;    /* the next token */
+    size_t last_end;    /* end of the token before it */
+    const char *name;   /* script name for error messages, NULL for a command line */
+    int line;           /* number of the first line of the text */
+    int final;          /* the end of the text is the end of the input */
+    int incomplete;     /* a quote or a continuation is open at the end */
+    Parse_Status status;
+} Parser;
+
+Node *parse(Arena *a, const char *line, Parse_Status *status);
+void parser_init(Parser *p, const char *text, size_t length, const char *name, int final);
+Node *parse_next(Parser *p, Arena *a, Parse_Status *status);
+size_t parser_offset(Parser *p);
+Node *node_copy(Arena *a, Node *node);
+
+#endif
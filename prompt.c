@@ -0,0 +1,664 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "prompt.h"
+#include "env.h"
+#include "custom_print.h"
+#include "events.h"
+
+#define GIT_HEAD_LEN 256
+#define GIT_STATUS_LINE_LEN 256
+#define DEFAULT_PROMPT_BUDGET_MS 1000
+#define GIT_STATUS_PLACEHOLDER "?"
+
+typedef enum Segment_Type
+{
+    SEG_TEXT,
+    SEG_CWD,
+    SEG_GIT_BRANCH,
+    SEG_GIT_STATUS
+} Segment_Type;
+
+/* A piece of a compiled prompt. Dynamic segments remember the key they were
+   rendered for and are rendered again only when that key changes. */
+typedef struct Segment
+{
+    Segment_Type type;
+    char *value;              /* literal text or the last rendered value */
+    int valid;                /* true if value matches the key below */
+    dev_t key_dev;            /* cwd inode for -p, .git/HEAD inode for -b */
+    ino_t key_ino;
+    struct timespec key_mtime; /* .git/HEAD mtime for -b */
+    int key_serial;           /* git_status_serial for -s */
+} Segment;
+
+typedef struct Prompt
+{
+    Segment *segments;
+    int count;
+    int compiled;
+    char *rendered; /* concatenation of all segment values */
+    size_t cap;
+} Prompt;
+
+/* Current working directory as maintained by the shell.
+   It is refreshed only by 'cd', so drawing the prompt never asks the system for it. */
+char *shell_cwd = NULL;
+dev_t cwd_dev;
+ino_t cwd_ino;
+
+/* Cached location of .git/HEAD for the current directory. */
+char *git_head_path = NULL;
+int git_lookup_done = 0;
+dev_t git_lookup_dev;
+ino_t git_lookup_ino;
+struct timespec git_lookup_mtime;
+
+/* State of the asynchronous git status used by -s. The status is computed by a
+   'git status' helper running in its own process group, so the prompt is drawn
+   with a placeholder right away and updated in place once the result arrives. */
+char *git_status_value = NULL;
+int git_status_serial = 0;
+int git_status_epoch = -1;
+int prompt_epoch = 0;
+int git_status_fd = -1;
+pid_t git_status_pgid = 0;
+struct timespec git_status_deadline;
+char git_status_line[GIT_STATUS_LINE_LEN];
+int git_status_line_len = 0;
+int git_status_skip_line = 0;
+int git_status_dirty = 0, git_status_ahead = 0, git_status_behind = 0;
+
+Prompt prompts[2];
+char *prompt_vars[] = {"PS1", "PS2"};
+char *prompt_defaults[] = {"$ ", "> "};
+
+/* Store the current working directory. */
+void update_cwd()
+{
+    char buf[PATH_MAX];
+    struct stat st;
+    if (getcwd(buf, sizeof(buf)) == NULL)
+        return;
+    free(shell_cwd);
+    shell_cwd = strdup(buf);
+    if (stat(buf, &st) == 0)
+    {
+        cwd_dev = st.st_dev;
+        cwd_ino = st.st_ino;
+    }
+}
+
+/* Initialize the shell-maintained working directory. */
+void init_cwd()
+{
+    update_cwd();
+    if (!shell_cwd)
+        shell_cwd = strdup("/");
+}
+
+/* Return the last component of the current directory. */
+char *get_cwd_segment()
+{
+    char *last;
+    if (!shell_cwd)
+        init_cwd();
+    if (strcmp(shell_cwd, "/") == 0)
+        return strdup("/");
+    last = strrchr(shell_cwd, '/');
+    return strdup(last ? last + 1 : shell_cwd);
+}
+
+/* Read the first line of a file into buf. Return 0 on success. */
+int _read_first_line(const char *path, char *buf, size_t size)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return -1;
+    if (!fgets(buf, size, fp))
+    {
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    buf[strcspn(buf, "\r\n")] = '\0';
+    return 0;
+}
+
+/* Find the git directory of the repository containing dir.
+   Handles both regular '.git' directories and the 'gitdir:' files
+   used by worktrees and submodules. Return 0 on success. */
+int _find_git_dir(const char *dir, char *gitdir, size_t size)
+{
+    char path[PATH_MAX];
+    char line[PATH_MAX];
+    struct stat st;
+
+    strncpy(path, dir, sizeof(path) - 1);
+    path[sizeof(path) - 1] = '\0';
+
+    while (1)
+    {
+        size_t len = strlen(path);
+        char *slash;
+
+        snprintf(gitdir, size, "%s%s.git", path, (len > 0 && path[len - 1] == '/') ? "" : "/");
+        if (stat(gitdir, &st) == 0)
+        {
+            if (S_ISDIR(st.st_mode))
+                return 0;
+            if (S_ISREG(st.st_mode) && _read_first_line(gitdir, line, sizeof(line)) == 0 &&
+                strncmp(line, "gitdir: ", 8) == 0)
+            {
+                if (line[8] == '/')
+                    snprintf(gitdir, size, "%s", line + 8);
+                else
+                    snprintf(gitdir, size, "%s%s%s", path, (len > 0 && path[len - 1] == '/') ? "" : "/", line + 8);
+                return 0;
+            }
+        }
+
+        if (strcmp(path, "/") == 0 || len == 0)
+            return -1;
+        slash = strrchr(path, '/');
+        if (!slash)
+            return -1;
+        if (slash == path)
+            path[1] = '\0';
+        else
+            *slash = '\0';
+    }
+}
+
+/* Return the path of HEAD for the repository containing the current directory,
+   or NULL outside of a repository. The lookup walks up the directory tree, so it
+   is repeated only after 'cd' or when the current directory itself was modified
+   while no repository was found (e.g. by 'git init'). */
+char *_get_git_head_path()
+{
+    char gitdir[PATH_MAX];
+    struct stat st;
+
+    if (!shell_cwd)
+        init_cwd();
+
+    if (git_lookup_done && git_lookup_dev == cwd_dev && git_lookup_ino == cwd_ino)
+    {
+        if (git_head_path)
+            return git_head_path;
+        if (stat(shell_cwd, &st) == 0 &&
+            st.st_mtim.tv_sec == git_lookup_mtime.tv_sec &&
+            st.st_mtim.tv_nsec == git_lookup_mtime.tv_nsec)
+            return NULL;
+    }
+
+    free(git_head_path);
+    git_head_path = NULL;
+    git_lookup_done = 1;
+    git_lookup_dev = cwd_dev;
+    git_lookup_ino = cwd_ino;
+    if (stat(shell_cwd, &st) == 0)
+        git_lookup_mtime = st.st_mtim;
+
+    if (_find_git_dir(shell_cwd, gitdir, sizeof(gitdir)) != 0)
+        return NULL;
+
+    git_head_path = malloc(strlen(gitdir) + sizeof("/HEAD"));
+    if (!git_head_path)
+    {
+        my_fprintf(stderr, "psh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(git_head_path, "%s/HEAD", gitdir);
+    return git_head_path;
+}
+
+/* Return the branch HEAD points to, or the abbreviated commit hash if it is detached. */
+char *_read_git_branch(const char *head_path)
+{
+    char head[GIT_HEAD_LEN];
+
+    if (_read_first_line(head_path, head, sizeof(head)) != 0)
+        return strdup("");
+
+    if (strncmp(head, "ref: ", 5) == 0)
+    {
+        char *ref = head + 5;
+        if (strncmp(ref, "refs/heads/", 11) == 0)
+            ref += 11;
+        return strdup(ref);
+    }
+
+    /* Detached HEAD. */
+    head[7] = '\0';
+    return strdup(head);
+}
+
+/* Return the name of the current git branch, the abbreviated commit hash if
+   HEAD is detached, or an empty string outside of a repository. */
+char *get_git_branch_segment()
+{
+    char *head_path = _get_git_head_path();
+    if (!head_path)
+        return strdup("");
+    return _read_git_branch(head_path);
+}
+
+/* Bring the value of a segment up to date. Return 1 if it changed. */
+int _refresh_segment(Segment *seg)
+{
+    struct stat st;
+    char *head_path;
+
+    switch (seg->type)
+    {
+    case SEG_CWD:
+        if (seg->valid && seg->key_dev == cwd_dev && seg->key_ino == cwd_ino)
+            return 0;
+        free(seg->value);
+        seg->value = get_cwd_segment();
+        seg->key_dev = cwd_dev;
+        seg->key_ino = cwd_ino;
+        seg->valid = 1;
+        return 1;
+
+    case SEG_GIT_BRANCH:
+        head_path = _get_git_head_path();
+        if (!head_path || stat(head_path, &st) != 0)
+        {
+            if (seg->valid && seg->key_ino == 0)
+                return 0;
+            free(seg->value);
+            seg->value = strdup("");
+            seg->key_dev = 0;
+            seg->key_ino = 0;
+            seg->valid = 1;
+            return 1;
+        }
+        if (seg->valid &&
+            seg->key_dev == st.st_dev && seg->key_ino == st.st_ino &&
+            seg->key_mtime.tv_sec == st.st_mtim.tv_sec &&
+            seg->key_mtime.tv_nsec == st.st_mtim.tv_nsec)
+            return 0;
+        free(seg->value);
+        seg->value = _read_git_branch(head_path);
+        seg->key_dev = st.st_dev;
+        seg->key_ino = st.st_ino;
+        seg->key_mtime = st.st_mtim;
+        seg->valid = 1;
+        return 1;
+
+    case SEG_GIT_STATUS:
+        if (seg->valid && seg->key_serial == git_status_serial)
+            return 0;
+        free(seg->value);
+        seg->value = strdup(git_status_value ? git_status_value : "");
+        seg->key_serial = git_status_serial;
+        seg->valid = 1;
+        return 1;
+
+    default:
+        return 0;
+    }
+}
+
+/* Set the value shown by -s segments. */
+void _set_git_status(const char *value)
+{
+    free(git_status_value);
+    git_status_value = strdup(value);
+    git_status_serial++;
+}
+
+/* Return the time budget of the git status helper in milliseconds. */
+int _get_prompt_budget()
+{
+    char *value = psh_getenv("PSH_PROMPT_BUDGET_MS");
+    if (!value || value[0] == '\0')
+        return DEFAULT_PROMPT_BUDGET_MS;
+    return atoi(value);
+}
+
+/* Stop the git status helper and close its pipe. */
+void _stop_git_status()
+{
+    if (git_status_fd == -1)
+        return;
+    close(git_status_fd);
+    git_status_fd = -1;
+    if (git_status_pgid > 0)
+        killpg(git_status_pgid, SIGTERM);
+    git_status_pgid = 0;
+}
+
+/* Start 'git status' in the background. The helper is double-forked into its
+   own process group, so it is never reaped by the job control code and can be
+   killed as a whole when it runs out of budget. */
+void _start_git_status()
+{
+    int fds[2], status;
+    pid_t pid;
+    int budget = _get_prompt_budget();
+
+    _stop_git_status();
+    git_status_epoch = prompt_epoch;
+    if (budget <= 0 || !_get_git_head_path())
+    {
+        _set_git_status("");
+        return;
+    }
+    if (pipe(fds) < 0)
+    {
+        _set_git_status(GIT_STATUS_PLACEHOLDER);
+        return;
+    }
+
+    pid = fork();
+    if (pid == 0)
+    {
+        setpgid(0, 0);
+        if (fork() == 0)
+        {
+            int devnull = open("/dev/null", O_RDWR);
+            dup2(devnull, STDIN_FILENO);
+            dup2(fds[1], STDOUT_FILENO);
+            dup2(devnull, STDERR_FILENO);
+            close(devnull);
+            close(fds[0]);
+            close(fds[1]);
+            signal(SIGINT, SIG_DFL);
+            signal(SIGQUIT, SIG_DFL);
+            signal(SIGPIPE, SIG_DFL);
+            reset_signal_mask();
+            execlp("git", "git", "--no-optional-locks", "status", "--porcelain=v2",
+                   "--branch", "--untracked-files=no", NULL);
+            _exit(127);
+        }
+        _exit(0);
+    }
+    close(fds[1]);
+    if (pid < 0)
+    {
+        close(fds[0]);
+        _set_git_status(GIT_STATUS_PLACEHOLDER);
+        return;
+    }
+    waitpid(pid, &status, 0);
+
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    git_status_fd = fds[0];
+    git_status_pgid = pid;
+    git_status_line_len = 0;
+    git_status_skip_line = 0;
+    git_status_dirty = git_status_ahead = git_status_behind = 0;
+    clock_gettime(CLOCK_MONOTONIC, &git_status_deadline);
+    git_status_deadline.tv_sec += budget / 1000;
+    git_status_deadline.tv_nsec += (long)(budget % 1000) * 1000000;
+    if (git_status_deadline.tv_nsec >= 1000000000)
+    {
+        git_status_deadline.tv_sec++;
+        git_status_deadline.tv_nsec -= 1000000000;
+    }
+    _set_git_status(GIT_STATUS_PLACEHOLDER);
+}
+
+/* Publish the collected git status, e.g. "*+2-1" for a dirty tree that is
+   two commits ahead of and one behind its upstream. */
+void _finish_git_status()
+{
+    char value[64];
+    int len = 0;
+
+    _stop_git_status();
+    if (git_status_dirty)
+        len += snprintf(value + len, sizeof(value) - len, "*");
+    if (git_status_ahead)
+        len += snprintf(value + len, sizeof(value) - len, "+%d", git_status_ahead);
+    if (git_status_behind)
+        len += snprintf(value + len, sizeof(value) - len, "-%d", git_status_behind);
+    value[len] = '\0';
+    _set_git_status(value);
+}
+
+/* Parse a chunk of 'git status --porcelain=v2 --branch' output. Header lines
+   start with '#' and come first, so the first entry line means the tree is
+   dirty and nothing else is needed. Return 1 once the status is known. */
+int _parse_git_status(const char *data, ssize_t len)
+{
+    for (ssize_t i = 0; i < len; i++)
+    {
+        if (git_status_line_len == 0 && !git_status_skip_line && data[i] != '#' && data[i] != '\n')
+        {
+            git_status_dirty = 1;
+            return 1;
+        }
+        if (data[i] == '\n')
+        {
+            git_status_line[git_status_line_len] = '\0';
+            sscanf(git_status_line, "# branch.ab +%d -%d", &git_status_ahead, &git_status_behind);
+            git_status_line_len = 0;
+            git_status_skip_line = 0;
+        }
+        else if (git_status_line_len < GIT_STATUS_LINE_LEN - 1)
+            git_status_line[git_status_line_len++] = data[i];
+        else
+            git_status_skip_line = 1;
+    }
+    return 0;
+}
+
+/* Return the fd of the git status helper, or -1 if no segment is waiting for it. */
+int prompt_pending_fd()
+{
+    return git_status_fd;
+}
+
+/* Return the number of milliseconds left in the budget of the git status helper,
+   or -1 if no segment is waiting for it. */
+int prompt_timeout()
+{
+    struct timespec now;
+    long timeout;
+
+    if (git_status_fd == -1)
+        return -1;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timeout = (git_status_deadline.tv_sec - now.tv_sec) * 1000 +
+              (git_status_deadline.tv_nsec - now.tv_nsec) / 1000000;
+    return timeout > 0 ? timeout : 0;
+}
+
+/* Collect the output of the git status helper without blocking, and stop it once
+   its budget runs out, keeping the placeholder. Return 1 if the prompt changed
+   and must be redrawn. */
+int prompt_update()
+{
+    char data[4096];
+    ssize_t n;
+
+    if (git_status_fd == -1)
+        return 0;
+
+    while ((n = read(git_status_fd, data, sizeof(data))) > 0)
+    {
+        if (_parse_git_status(data, n))
+        {
+            _finish_git_status();
+            return 1;
+        }
+    }
+    if (n == 0)
+    {
+        _finish_git_status();
+        return 1;
+    }
+    if (prompt_timeout() == 0)
+        _stop_git_status();
+    return 0;
+}
+
+/* Mark the git status as outdated. It is computed again for the next prompt. */
+void prompt_invalidate_status()
+{
+    prompt_epoch++;
+}
+
+/* Return 1 if the prompt has a -s segment. */
+int _has_status_segment(Prompt *pr)
+{
+    for (int i = 0; i < pr->count; i++)
+        if (pr->segments[i].type == SEG_GIT_STATUS)
+            return 1;
+    return 0;
+}
+
+/* Append a segment to the prompt. */
+Segment *_add_segment(Prompt *pr, Segment_Type type, char *value)
+{
+    Segment *new = realloc(pr->segments, (pr->count + 1) * sizeof(Segment));
+    if (!new)
+    {
+        my_fprintf(stderr, "psh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    pr->segments = new;
+    memset(&new[pr->count], 0, sizeof(Segment));
+    new[pr->count].type = type;
+    new[pr->count].value = value;
+    new[pr->count].valid = type == SEG_TEXT;
+    return &new[pr->count++];
+}
+
+/* Free the segments and the rendered text of a prompt. */
+void _free_prompt(Prompt *pr)
+{
+    for (int i = 0; i < pr->count; i++)
+        free(pr->segments[i].value);
+    free(pr->segments);
+    free(pr->rendered);
+    memset(pr, 0, sizeof(Prompt));
+}
+
+/* Split the value of PS1 or PS2 into literal text and flag segments.
+   -b shows the current git branch, -p the current directory,
+   -s the git status (dirty, ahead and behind). */
+void _compile_prompt(int type)
+{
+    Prompt *pr = &prompts[type];
+    char *var = psh_getenv(prompt_vars[type]);
+    int start = 0;
+
+    _free_prompt(pr);
+    pr->compiled = 1;
+    if (!var)
+        var = prompt_defaults[type];
+
+    for (int i = 0; var[i] != '\0'; i++)
+    {
+        if (var[i] != '-')
+            continue;
+        if (i > start)
+            _add_segment(pr, SEG_TEXT, strndup(var + start, i - start));
+        i++;
+        start = i + 1;
+        if (var[i] == '\0')
+            return;
+        switch (var[i])
+        {
+        case 'b':
+            _add_segment(pr, SEG_GIT_BRANCH, NULL);
+            break;
+        case 'p':
+            _add_segment(pr, SEG_CWD, NULL);
+            break;
+        case 's':
+            _add_segment(pr, SEG_GIT_STATUS, NULL);
+            break;
+        default:
+            my_fprintf(stderr, "Unexpected token after '-': %c\n", var[i]);
+            break;
+        }
+    }
+    if (var[start] != '\0')
+        _add_segment(pr, SEG_TEXT, strdup(var + start));
+}
+
+/* Compile both prompts from the current values of PS1 and PS2. */
+void compile_prompts()
+{
+    _compile_prompt(PROMPT_PS1);
+    _compile_prompt(PROMPT_PS2);
+}
+
+/* Recompile the matching prompt after a variable was set or unset. */
+void prompt_var_changed(const char *name)
+{
+    for (int i = 0; i < 2; i++)
+        if (strcmp(name, prompt_vars[i]) == 0)
+            _compile_prompt(i);
+}
+
+/* Return the prompt of the given type. Only the segments whose keys changed
+   since the last call are rendered again. The returned string is owned by the
+   prompt and stays valid until the next call. */
+char *render_prompt(int type)
+{
+    Prompt *pr = &prompts[type];
+    int changed = 0;
+    size_t len = 0;
+
+    if (!pr->compiled)
+        _compile_prompt(type);
+    if (git_status_epoch != prompt_epoch && _has_status_segment(pr))
+        _start_git_status();
+
+    for (int i = 0; i < pr->count; i++)
+        changed |= _refresh_segment(&pr->segments[i]);
+    if (!changed && pr->rendered)
+        return pr->rendered;
+
+    for (int i = 0; i < pr->count; i++)
+        len += strlen(pr->segments[i].value);
+    if (len + 1 > pr->cap)
+    {
+        char *new = realloc(pr->rendered, len + 1);
+        if (!new)
+        {
+            my_fprintf(stderr, "psh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        pr->rendered = new;
+        pr->cap = len + 1;
+    }
+    len = 0;
+    for (int i = 0; i < pr->count; i++)
+    {
+        size_t seg_len = strlen(pr->segments[i].value);
+        memcpy(pr->rendered + len, pr->segments[i].value, seg_len);
+        len += seg_len;
+    }
+    pr->rendered[len] = '\0';
+    return pr->rendered;
+}
+
+/* Free the compiled prompts and the cached working directory. */
+void free_prompts()
+{
+    _free_prompt(&prompts[PROMPT_PS1]);
+    _free_prompt(&prompts[PROMPT_PS2]);
+    _stop_git_status();
+    free(git_status_value);
+    git_status_value = NULL;
+    free(git_head_path);
+    git_head_path = NULL;
+    free(shell_cwd);
+    shell_cwd = NULL;
+}
@@ -0,0 +1,22 @@
+#ifndef PROMPT_H
+#define PROMPT_H
+
+#define PROMPT_PS1 0
+#define PROMPT_PS2 1
+
+extern char *shell_cwd;
+
+void init_cwd();
+void update_cwd();
+char *get_cwd_segment();
+char *get_git_branch_segment();
+void compile_prompts();
+void prompt_var_changed(const char *name);
+char *render_prompt(int type);
+int prompt_pending_fd();
+int prompt_timeout();
+int prompt_update();
+void prompt_invalidate_status();
+void free_prompts();
+
+#endif
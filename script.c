@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "script.h"
+#include "main.h"
+#include "env.h"
+#include "custom_print.h"
+#include "events.h"
+#include "cmd_hash.h"
+#include "job_table.h"
+#include "arena.h"
+#include "parser.h"
+#include "script_cache.h"
+#include "vm.h"
+
+/* Non-interactive execution: psh -c 'command', psh FILE and psh < FILE.
+   The input is parsed one statement at a time and each statement runs
+   before the next one is parsed, with no line editor in between. Files
+   are mapped into memory; pipes and other unmappable input are read in
+   large chunks, and only the statement being parsed is kept. */
+
+#define SCRIPT_CHUNK_SIZE (64 * 1024)
+
+extern int shell_is_interactive;
+extern pid_t shell_pgid;
+extern int last_proc_exit_status;
+int script_noexec = 0; /* -n: parse the input without running it */
+
+/* Set $0, $1... and $#. */
+void _set_positional(const char *name, int argc, char **argv)
+{
+    char number[16];
+
+    psh_setenv("0", (char *)name);
+    for (int i = 0; i < argc; i++)
+    {
+        snprintf(number, sizeof(number), "%d", i + 1);
+        psh_setenv(number, argv[i]);
+    }
+    snprintf(number, sizeof(number), "%d", argc);
+    psh_setenv("#", number);
+}
+
+/* Run one statement and drop everything it allocated. */
+int _run_statement(Node *tree)
+{
+    int status = 1;
+
+    if (!script_noexec)
+    {
+        status = run_node(tree, 0);
+        do_job_notification();
+        promote_jobs();
+    }
+    arena_reset(&line_arena);
+    return status;
+}
+
+/* Run the statements of text one by one, adding them to the cache buffer
+   if there is one. The cache is only complete if the whole text was
+   parsed, so the rest is parsed even after exit. Return -1 on a syntax
+   error, which stops the script with status 2, 0 if the exit builtin was
+   run and 1 otherwise. */
+int _run_text(const char *text, size_t length, const char *name, Pshc_Buffer *cache)
+{
+    Parser p;
+    Parse_Status parse_status = PARSE_OK;
+    Node *tree;
+    int status = 1;
+
+    parser_init(&p, text, length, name, 1);
+    while (status && (tree = parse_next(&p, &line_arena, &parse_status)))
+    {
+        if (cache)
+            script_cache_add(cache, tree);
+        status = _run_statement(tree);
+    }
+    while (cache && parse_status == PARSE_OK && (tree = parse_next(&p, &line_arena, &parse_status)))
+    {
+        script_cache_add(cache, tree);
+        arena_reset(&line_arena);
+    }
+    arena_reset(&line_arena);
+    if (parse_status == PARSE_ERROR)
+    {
+        last_proc_exit_status = 2;
+        return -1;
+    }
+    return status;
+}
+
+/* Run the statements of text one by one. Return 0 if the exit builtin was run. */
+int run_text(const char *text, size_t length, const char *name)
+{
+    return _run_text(text, length, name, NULL) > 0;
+}
+
+/* Read input that cannot be mapped. Statements are parsed up to the last
+   complete line in the buffer; a statement running past it is parsed
+   again once the next chunk is read. */
+int run_stream(int fd, const char *name)
+{
+    size_t size = SCRIPT_CHUNK_SIZE, length = 0, start = 0, end;
+    char *buf = malloc(size);
+    Parser p;
+    Parse_Status parse_status = PARSE_OK;
+    Node *tree;
+    int status = 1, eof = 0, line = 1;
+
+    if (!buf)
+    {
+        my_fprintf(stderr, "psh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    while (status && !eof)
+    {
+        ssize_t n;
+
+        /* Keep only the statement that is not complete yet. */
+        for (char *s = buf; (s = memchr(s, '\n', buf + start - s)); s++)
+            line++;
+        memmove(buf, buf + start, length - start);
+        length -= start;
+        start = 0;
+        if (length == size)
+        {
+            size *= 2;
+            if (!(buf = realloc(buf, size)))
+            {
+                my_fprintf(stderr, "psh: allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        n = read(fd, buf + length, size - length);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            eof = 1;
+        else
+            length += n;
+
+        end = length;
+        if (!eof)
+        {
+            while (end > 0 && buf[end - 1] != '\n')
+                end--;
+            if (end == 0)
+                continue;
+        }
+
+        parser_init(&p, buf, end, name, eof);
+        p.line = line;
+        for (;;)
+        {
+            start = parser_offset(&p);
+            if (!(tree = parse_next(&p, &line_arena, &parse_status)))
+                break;
+            if (!(status = _run_statement(tree)))
+                break;
+        }
+        arena_reset(&line_arena);
+        if (parse_status == PARSE_ERROR)
+        {
+            last_proc_exit_status = 2;
+            break;
+        }
+    }
+    free(buf);
+    return status;
+}
+
+/* Run a mapped script file, from its cached trees if they are up to date.
+   Otherwise parse it and cache the trees for the next run. */
+int _run_mapped(const char *path, char *text, struct stat *st)
+{
+    Pshc_Buffer cache = {NULL, 0, 0, 0};
+    Pshc_Map map;
+    Node *tree;
+    int status = 1;
+
+    if (!script_cache_enabled())
+        return run_text(text, st->st_size, path);
+
+    if (script_cache_open(&map, path, st, text))
+    {
+        while (status && (tree = script_cache_next(&map, &line_arena)))
+            status = _run_statement(tree);
+        arena_reset(&line_arena);
+        script_cache_close(&map);
+        /* Only a damaged file gets here, it is rewritten next time. */
+        if (map.error)
+        {
+            my_fprintf(stderr, "psh: %s: corrupt script cache\n", path);
+            script_cache_remove(path);
+            last_proc_exit_status = 2;
+        }
+        return status;
+    }
+
+    status = _run_text(text, st->st_size, path, &cache);
+    if (status >= 0)
+        script_cache_save(path, st, &cache);
+    free(cache.data);
+    return status != 0;
+}
+
+/* Run a script file. Return 0 if the exit builtin was run. */
+int run_script(const char *path)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    int status;
+
+    if (fd < 0)
+    {
+        my_fprintf(stderr, "psh: %s: %s\n", path, strerror(errno));
+        last_proc_exit_status = errno == ENOENT ? 127 : 126;
+        return 1;
+    }
+
+    /* Offsets into the text are ints, larger files are streamed. */
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size <= INT_MAX)
+    {
+        char *text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (text != MAP_FAILED)
+        {
+            close(fd);
+            madvise(text, st.st_size, MADV_SEQUENTIAL);
+            status = _run_mapped(path, text, &st);
+            munmap(text, st.st_size);
+            return status;
+        }
+    }
+
+    status = run_stream(fd, path);
+    close(fd);
+    return status;
+}
+
+/* Entry point when psh is given arguments or its input is not a terminal.
+
+   psh [-n] -c COMMAND [NAME [ARG...]]
+   psh [-n] FILE [ARG...]
+   psh [-n] < FILE */
+int script_main(int argc, char **argv)
+{
+    shell_is_interactive = 0;
+    shell_pgid = getpid();
+    init_events();
+
+    if (argc > 1 && strcmp(argv[1], "-n") == 0)
+    {
+        script_noexec = 1;
+        argv[1] = argv[0];
+        argc--;
+        argv++;
+    }
+
+    if (argc > 1 && strcmp(argv[1], "-c") == 0)
+    {
+        if (argc == 2)
+        {
+            my_fprintf(stderr, "psh: -c: option requires an argument\n");
+            return 2;
+        }
+        _set_positional(argc > 3 ? argv[3] : "psh", argc > 4 ? argc - 4 : 0, argv + 4);
+        run_text(argv[2], strlen(argv[2]), "-c");
+    }
+    else if (argc > 1 && argv[1][0] == '-' && argv[1][1] != '\0')
+    {
+        my_fprintf(stderr, "psh: %s: invalid option\n"
+                           "usage: psh [-n] [-c command [name [arg ...]] | file [arg ...]]\n",
+                   argv[1]);
+        return 2;
+    }
+    else if (argc > 1)
+    {
+        _set_positional(argv[1], argc - 2, argv + 2);
+        run_script(argv[1]);
+    }
+    else
+    {
+        _set_positional("psh", 0, NULL);
+        run_stream(STDIN_FILENO, "stdin");
+    }
+
+    fflush(stdout);
+    free_env_list();
+    free_job_table();
+    free_functions();
+    arena_free(&line_arena);
+    hash_clear();
+    return last_proc_exit_status;
+}
@@ -0,0 +1,11 @@
+#include <stddef.h>
+
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+int script_main(int argc, char **argv);
+int run_text(const char *text, size_t length, const char *name);
+int run_script(const char *path);
+int run_stream(int fd, const char *name);
+
+#endif
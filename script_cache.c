@@ -0,0 +1,382 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include "script_cache.h"
+#include "main.h"
+#include "env.h"
+#include "custom_print.h"
+
+/* Parsed scripts cached on disk. After a script has been parsed to the
+   end, its statement trees are written to $XDG_CACHE_HOME/psh (or
+   ~/.cache/psh) in a file named after a hash of its real path. A later
+   run of the same file with the same size and mtime, by the same psh
+   version, maps the cache and reads the trees back one statement at a
+   time without lexing or parsing; the strings of the trees point into
+   the mapping. Set PSH_SCRIPT_CACHE=0 to disable the cache.
+
+   A file is the header, the real path, then every statement as a node:
+
+   node     : type flags count node*count words redirects text
+   words    : 0 (no words) | n+1 string*n
+   redirect : n (kind string)*n
+   string   : 0 (NULL) | length+1 bytes NUL
+   text     : 0 (NULL) | offset+1 length
+
+   The text of a pipeline is a slice of the script, which is unchanged
+   while the cache is valid, so only its offset is stored.
+
+   Numbers are unsigned LEB128, 7 bits per byte with the high bit set on
+   all but the last byte. */
+
+#define PSHC_MAGIC "PSHC"
+#define PSHC_FORMAT 3
+
+typedef struct Pshc_Header
+{
+    char magic[4];
+    uint32_t format;
+    char version[16];
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t path_length;
+    uint32_t statements;
+} Pshc_Header;
+
+int script_cache_enabled()
+{
+    char *value = psh_getenv("PSH_SCRIPT_CACHE");
+    return !value || *value == '\0' || atoi(value) != 0;
+}
+
+/* Fill the header a cache of the script must have. */
+void _pshc_header(Pshc_Header *h, struct stat *st, size_t path_length, unsigned int statements)
+{
+    memset(h, 0, sizeof(Pshc_Header));
+    memcpy(h->magic, PSHC_MAGIC, 4);
+    h->format = PSHC_FORMAT;
+    strncpy(h->version, PSH_VERSION, sizeof(h->version) - 1);
+    h->size = st->st_size;
+    h->mtime_sec = st->st_mtim.tv_sec;
+    h->mtime_nsec = st->st_mtim.tv_nsec;
+    h->path_length = path_length;
+    h->statements = statements;
+}
+
+/* Build the cache file name of the script into name. Return 0 if there is
+   no cache directory; create the directory if create is set. */
+int _pshc_file(const char *real, char *name, size_t size, int create)
+{
+    char *base = psh_getenv("XDG_CACHE_HOME"), *home = psh_getenv("HOME");
+    unsigned long long hash = 14695981039346656037ull;
+    int n;
+
+    for (const char *s = real; *s; s++)
+        hash = (hash ^ (unsigned char)*s) * 1099511628211ull;
+
+    if (base && *base)
+        n = snprintf(name, size, "%s/psh/%016llx.pshc", base, hash);
+    else if (home && *home)
+        n = snprintf(name, size, "%s/.cache/psh/%016llx.pshc", home, hash);
+    else
+        return 0;
+    if (n < 0 || (size_t)n >= size)
+        return 0;
+    if (create)
+        for (char *s = strchr(name + 1, '/'); s; s = strchr(s + 1, '/'))
+        {
+            *s = '\0';
+            mkdir(name, 0700);
+            *s = '/';
+        }
+    return 1;
+}
+
+size_t _pshc_number(Pshc_Map *m)
+{
+    size_t value = 0;
+
+    /* Most numbers fit in one byte. */
+    if (m->pos < m->length && !(m->data[m->pos] & 0x80))
+        return m->data[m->pos++];
+    for (int shift = 0; m->pos < m->length && shift < 64; shift += 7)
+    {
+        unsigned char c = m->data[m->pos++];
+        value |= (size_t)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return value;
+    }
+    m->error = 1;
+    return 0;
+}
+
+char *_pshc_string(Pshc_Map *m)
+{
+    size_t length = _pshc_number(m);
+    char *s;
+
+    if (length-- == 0)
+        return NULL;
+    if (m->length - m->pos <= length || m->data[m->pos + length] != '\0')
+    {
+        m->error = 1;
+        return NULL;
+    }
+    s = m->data + m->pos;
+    m->pos += length + 1;
+    return s;
+}
+
+Node *_pshc_node(Pshc_Map *m, Arena *a, int depth)
+{
+    Node *node = arena_alloc(a, sizeof(Node));
+    Redirect **last_redirect = &node->redirects;
+    size_t n;
+
+    memset(node, 0, sizeof(Node));
+    node->type = _pshc_number(m);
+    node->flags = _pshc_number(m);
+    /* A node takes at least 6 bytes, which bounds a corrupt count. */
+    n = _pshc_number(m);
+    if (m->error || depth > 1000 || n > (m->length - m->pos) / 6)
+    {
+        m->error = 1;
+        return NULL;
+    }
+    node->count = n;
+    if (n)
+        node->children = arena_alloc(a, n * sizeof(Node *));
+    for (size_t i = 0; i < n && !m->error; i++)
+        node->children[i] = _pshc_node(m, a, depth + 1);
+
+    if ((n = _pshc_number(m)) && !m->error)
+    {
+        if (--n > m->length - m->pos)
+            m->error = 1;
+        else
+        {
+            node->words = arena_alloc(a, (n + 1) * sizeof(char *));
+            for (size_t i = 0; i < n; i++)
+                node->words[i] = _pshc_string(m);
+            node->words[n] = NULL;
+        }
+    }
+
+    n = _pshc_number(m);
+    for (size_t i = 0; i < n && !m->error; i++)
+    {
+        Redirect *r = arena_alloc(a, sizeof(Redirect));
+        r->kind = _pshc_number(m);
+        r->target = _pshc_string(m);
+        r->next = NULL;
+        *last_redirect = r;
+        last_redirect = &r->next;
+    }
+
+    if ((n = _pshc_number(m)))
+    {
+        size_t length = _pshc_number(m);
+        if (--n > m->source_length || length > m->source_length - n)
+            m->error = 1;
+        else
+            node->text = arena_strndup(a, m->source + n, length);
+    }
+    return m->error ? NULL : node;
+}
+
+/* Map the cache of the script. Return 0 if there is no cache or it is
+   out of date. */
+int script_cache_open(Pshc_Map *map, const char *path, struct stat *st, const char *source)
+{
+    char real[PATH_MAX], name[PATH_MAX];
+    Pshc_Header expected, *header;
+    struct stat cache_st;
+    size_t path_length;
+    int fd;
+
+    memset(map, 0, sizeof(Pshc_Map));
+    if (!realpath(path, real) || !_pshc_file(real, name, sizeof(name), 0))
+        return 0;
+    if ((fd = open(name, O_RDONLY | O_CLOEXEC)) < 0)
+        return 0;
+    if (fstat(fd, &cache_st) < 0 || cache_st.st_size < (off_t)sizeof(Pshc_Header))
+    {
+        close(fd);
+        return 0;
+    }
+    map->length = cache_st.st_size;
+    map->data = mmap(NULL, map->length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map->data == MAP_FAILED)
+    {
+        map->data = NULL;
+        return 0;
+    }
+
+    /* The script must not have changed since the cache was written. */
+    header = (Pshc_Header *)map->data;
+    path_length = strlen(real);
+    _pshc_header(&expected, st, path_length, header->statements);
+    if (memcmp(header, &expected, sizeof(Pshc_Header)) != 0 ||
+        map->length - sizeof(Pshc_Header) < path_length ||
+        memcmp(map->data + sizeof(Pshc_Header), real, path_length) != 0)
+    {
+        script_cache_close(map);
+        return 0;
+    }
+    madvise(map->data, map->length, MADV_SEQUENTIAL);
+    map->pos = sizeof(Pshc_Header) + path_length;
+    map->statements = header->statements;
+    map->source = source;
+    map->source_length = st->st_size;
+    return 1;
+}
+
+/* Read the next statement into the arena. Return NULL after the last one,
+   or with error set if the file turns out to be corrupt. */
+Node *script_cache_next(Pshc_Map *map, Arena *a)
+{
+    Node *node;
+
+    if (map->statements == 0 || map->error)
+        return NULL;
+    map->statements--;
+    node = _pshc_node(map, a, 0);
+    if (map->statements == 0 && map->pos != map->length)
+        map->error = 1;
+    return map->error ? NULL : node;
+}
+
+void script_cache_close(Pshc_Map *map)
+{
+    if (map->data)
+        munmap(map->data, map->length);
+    map->data = NULL;
+}
+
+void _pshc_put(Pshc_Buffer *b, const void *data, size_t length)
+{
+    if (b->length + length > b->size)
+    {
+        while (b->length + length > b->size)
+            b->size = b->size ? 2 * b->size : 4096;
+        if (!(b->data = realloc(b->data, b->size)))
+        {
+            my_fprintf(stderr, "psh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(b->data + b->length, data, length);
+    b->length += length;
+}
+
+void _pshc_put_number(Pshc_Buffer *b, size_t value)
+{
+    unsigned char bytes[10];
+    int n = 0;
+
+    while (value >= 0x80)
+    {
+        bytes[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    bytes[n++] = value;
+    _pshc_put(b, bytes, n);
+}
+
+void _pshc_put_string(Pshc_Buffer *b, const char *s)
+{
+    size_t length;
+
+    if (!s)
+    {
+        _pshc_put_number(b, 0);
+        return;
+    }
+    length = strlen(s);
+    _pshc_put_number(b, length + 1);
+    _pshc_put(b, s, length + 1);
+}
+
+void _pshc_put_node(Pshc_Buffer *b, Node *node)
+{
+    size_t n = 0;
+
+    _pshc_put_number(b, node->type);
+    _pshc_put_number(b, node->flags);
+    _pshc_put_number(b, node->count);
+    for (int i = 0; i < node->count; i++)
+        _pshc_put_node(b, node->children[i]);
+
+    if (!node->words)
+        _pshc_put_number(b, 0);
+    else
+    {
+        while (node->words[n])
+            n++;
+        _pshc_put_number(b, n + 1);
+        for (size_t i = 0; i < n; i++)
+            _pshc_put_string(b, node->words[i]);
+    }
+
+    n = 0;
+    for (Redirect *r = node->redirects; r; r = r->next)
+        n++;
+    _pshc_put_number(b, n);
+    for (Redirect *r = node->redirects; r; r = r->next)
+    {
+        _pshc_put_number(b, r->kind);
+        _pshc_put_string(b, r->target);
+    }
+
+    if (!node->text)
+        _pshc_put_number(b, 0);
+    else
+    {
+        _pshc_put_number(b, node->offset + 1);
+        _pshc_put_number(b, strlen(node->text));
+    }
+}
+
+/* Append a parsed statement of the script. */
+void script_cache_add(Pshc_Buffer *b, Node *statement)
+{
+    _pshc_put_node(b, statement);
+    b->statements++;
+}
+
+void script_cache_remove(const char *path)
+{
+    char real[PATH_MAX], name[PATH_MAX];
+    if (realpath(path, real) && _pshc_file(real, name, sizeof(name), 0))
+        unlink(name);
+}
+
+/* Write the statements of the script to its cache file. The file is
+   written under a temporary name and renamed, so a reader never sees
+   half of it. Failures are silent, the script is parsed next time. */
+void script_cache_save(const char *path, struct stat *st, Pshc_Buffer *b)
+{
+    char real[PATH_MAX], name[PATH_MAX], temp[PATH_MAX + 32];
+    Pshc_Header header;
+    size_t path_length;
+    int fd, ok;
+
+    if (!realpath(path, real) || !_pshc_file(real, name, sizeof(name), 1))
+        return;
+    snprintf(temp, sizeof(temp), "%s.%d", name, (int)getpid());
+    if ((fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0)
+        return;
+    path_length = strlen(real);
+    _pshc_header(&header, st, path_length, b->statements);
+    ok = write(fd, &header, sizeof(header)) == sizeof(header) &&
+         write(fd, real, path_length) == (ssize_t)path_length &&
+         write(fd, b->data, b->length) == (ssize_t)b->length;
+    if (close(fd) < 0 || !ok || rename(temp, name) < 0)
+        unlink(temp);
+}
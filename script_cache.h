@@ -0,0 +1,38 @@
+#include <stddef.h>
+#include <sys/stat.h>
+#include "arena.h"
+#include "parser.h"
+
+#ifndef SCRIPT_CACHE_H
+#define SCRIPT_CACHE_H
+
+/* Statements of a script serialized for the cache. */
+typedef struct Pshc_Buffer
+{
+    char *data;
+    size_t length;
+    size_t size;
+    unsigned int statements;
+} Pshc_Buffer;
+
+/* A cache file mapped into memory, the loaded trees point into it. */
+typedef struct Pshc_Map
+{
+    char *data;
+    size_t length;
+    size_t pos;              /* start of the next statement */
+    unsigned int statements; /* statements not read yet */
+    int error;               /* the file is corrupt */
+    const char *source;      /* the script, pipeline texts are slices of it */
+    size_t source_length;
+} Pshc_Map;
+
+int script_cache_enabled();
+int script_cache_open(Pshc_Map *map, const char *path, struct stat *st, const char *source);
+Node *script_cache_next(Pshc_Map *map, Arena *a);
+void script_cache_close(Pshc_Map *map);
+void script_cache_add(Pshc_Buffer *b, Node *statement);
+void script_cache_remove(const char *path);
+void script_cache_save(const char *path, struct stat *st, Pshc_Buffer *b);
+
+#endif
@@ -0,0 +1,582 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include "utilities.h"
+#include "custom_print.h"
+
+/* Builtin versions of the small utilities scripts run most often: echo,
+   printf, test and [, true, false and pwd. They follow POSIX and the
+   usual GNU extensions, and save a fork and exec for each call.
+
+   Their output goes through stdio and is flushed after each builtin.
+   While the interactive shell has the terminal in raw mode, a newline
+   written to the terminal is sent as \r\n, which output processing would
+   otherwise add. */
+
+extern int last_proc_exit_status;
+extern int shell_is_interactive;
+
+int utility_raw_output = -1; /* stdout is the terminal in raw mode */
+
+void _put(const char *s, size_t n)
+{
+    if (utility_raw_output < 0)
+        utility_raw_output = shell_is_interactive && isatty(STDOUT_FILENO);
+    if (!utility_raw_output)
+    {
+        fwrite(s, 1, n, stdout);
+        return;
+    }
+    for (const char *end = s + n, *nl; s < end; s = nl + 1)
+    {
+        if (!(nl = memchr(s, '\n', end - s)))
+        {
+            fwrite(s, 1, end - s, stdout);
+            return;
+        }
+        fwrite(s, 1, nl - s, stdout);
+        fwrite("\r\n", 1, 2, stdout);
+    }
+}
+
+/* Called once the output of a builtin is complete. */
+void utility_flush()
+{
+    fflush(stdout);
+    utility_raw_output = -1;
+}
+
+/* Write the character the backslash escape at s stands for and return the
+   number of bytes after the backslash it takes. Octal escapes take up to
+   three digits after the 0 for echo, and up to three digits for printf.
+   Return -1 for \c, which ends the output. */
+int _put_escape(const char *s, int echo)
+{
+    const char *from = "abefnrtv\\", *to = "\a\b\033\f\n\r\t\v\\";
+    const char *p;
+    char c;
+    int n = 0, value = 0;
+
+    if (*s == 'c')
+        return -1;
+    if (*s && (p = strchr(from, *s)))
+    {
+        _put(to + (p - from), 1);
+        return 1;
+    }
+    if (*s == 'x' && isxdigit((unsigned char)s[1]))
+    {
+        for (n = 1; n < 3 && isxdigit((unsigned char)s[n]); n++)
+            value = value * 16 + (isdigit((unsigned char)s[n]) ? s[n] - '0' : (tolower((unsigned char)s[n]) - 'a' + 10));
+        c = value;
+        _put(&c, 1);
+        return n;
+    }
+    if ((echo && *s == '0') || (!echo && *s >= '0' && *s <= '7'))
+    {
+        int first = echo ? 1 : 0;
+        for (n = first; n < first + 3 && s[n] >= '0' && s[n] <= '7'; n++)
+            value = value * 8 + s[n] - '0';
+        c = value;
+        _put(&c, 1);
+        return n;
+    }
+    /* Not an escape, the backslash is kept. */
+    _put("\\", 1);
+    return 0;
+}
+
+/* Write the string with its backslash escapes. Return -1 if \c ended it. */
+int _put_escaped(const char *s, int echo)
+{
+    while (*s)
+    {
+        const char *backslash = strchr(s, '\\');
+        int n;
+        if (!backslash)
+        {
+            _put(s, strlen(s));
+            break;
+        }
+        _put(s, backslash - s);
+        if ((n = _put_escape(backslash + 1, echo)) < 0)
+            return -1;
+        s = backslash + 1 + n;
+    }
+    return 0;
+}
+
+/* Write the arguments separated by spaces. -n leaves out the newline,
+   -e interprets backslash escapes and -E does not. */
+int psh_echo(char **argv)
+{
+    int newline = 1, escapes = 0, i = 1;
+
+    for (; argv[i] && argv[i][0] == '-' && argv[i][1]; i++)
+    {
+        const char *c = argv[i] + 1;
+        if (strspn(c, "neE") != strlen(c))
+            break;
+        for (; *c; c++)
+        {
+            if (*c == 'n')
+                newline = 0;
+            else
+                escapes = *c == 'e';
+        }
+    }
+    for (int first = i; argv[i]; i++)
+    {
+        if (i > first)
+            _put(" ", 1);
+        if (!escapes)
+            _put(argv[i], strlen(argv[i]));
+        else if (_put_escaped(argv[i], 1) < 0)
+            return 1;
+    }
+    if (newline)
+        _put("\n", 1);
+    return 1;
+}
+
+/* Convert a printf argument to a number. A leading quote gives the code
+   of the character after it. */
+void _printf_number(const char *arg, long long *integer, double *real, int floating)
+{
+    char *end;
+
+    if (arg[0] == '\'' || arg[0] == '"')
+    {
+        *integer = (unsigned char)arg[1];
+        *real = *integer;
+        return;
+    }
+    errno = 0;
+    if (floating)
+        *real = strtod(arg, &end);
+    else if (arg[0] == '-')
+        *integer = strtoll(arg, &end, 0);
+    else
+        *integer = (long long)strtoull(arg, &end, 0);
+    if (*arg != '\0' && (end == arg || *end != '\0' || errno == ERANGE))
+    {
+        my_fprintf(stderr, "psh: printf: %s: invalid number\n", arg);
+        last_proc_exit_status = 1;
+    }
+}
+
+/* Write the output of snprintf with the format. */
+void _put_formatted(const char *format, ...)
+{
+    char buffer[512], *out = buffer;
+    va_list args, again;
+    int length;
+
+    va_start(args, format);
+    va_copy(again, args);
+    length = vsnprintf(buffer, sizeof(buffer), format, args);
+    if (length >= (int)sizeof(buffer))
+    {
+        out = malloc(length + 1);
+        if (!out)
+        {
+            my_fprintf(stderr, "psh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        vsnprintf(out, length + 1, format, again);
+    }
+    if (length > 0)
+        _put(out, length);
+    if (out != buffer)
+        free(out);
+    va_end(again);
+    va_end(args);
+}
+
+/* Write one conversion of the format at spec, n bytes long, ending with
+   its conversion character. Return -1 if a %b argument ended the output
+   with \c. */
+int _printf_convert(const char *spec, size_t n, char ***args)
+{
+    char format[64], conversion = spec[n - 1];
+    const char *arg;
+    long long integer = 0;
+    double real = 0;
+    size_t k = 0;
+
+    /* Flags, then a width and a precision that may come from arguments. */
+    format[k++] = '%';
+    for (size_t i = 1; i < n - 1 && k < sizeof(format) - 16; i++)
+    {
+        if (spec[i] == '*')
+        {
+            arg = **args ? *(*args)++ : "0";
+            k += snprintf(format + k, sizeof(format) - k, "%d", atoi(arg));
+        }
+        else
+            format[k++] = spec[i];
+    }
+    format[k] = '\0';
+    arg = **args ? *(*args)++ : NULL;
+
+    if (strchr("diouxX", conversion))
+    {
+        _printf_number(arg ? arg : "0", &integer, &real, 0);
+        snprintf(format + k, sizeof(format) - k, "ll%c", conversion);
+        if (conversion == 'd' || conversion == 'i')
+            _put_formatted(format, integer);
+        else
+            _put_formatted(format, (unsigned long long)integer);
+    }
+    else if (strchr("fFeEgGaA", conversion))
+    {
+        _printf_number(arg ? arg : "0", &integer, &real, 1);
+        snprintf(format + k, sizeof(format) - k, "%c", conversion);
+        _put_formatted(format, real);
+    }
+    else if (conversion == 'c')
+    {
+        if (arg && *arg)
+            _put(arg, 1);
+    }
+    else if (conversion == 'b')
+        return arg ? _put_escaped(arg, 1) : 0;
+    else
+    {
+        snprintf(format + k, sizeof(format) - k, "s");
+        _put_formatted(format, arg ? arg : "");
+    }
+    return 0;
+}
+
+/* Write the arguments under control of the format. The format is reused
+   while arguments are left, and missing ones count as empty or zero. */
+int psh_printf(char **argv)
+{
+    const char *format = argv[1];
+    char **args;
+
+    if (!format)
+    {
+        my_fprintf(stderr, "psh: printf: usage: printf format [arguments]\n");
+        last_proc_exit_status = 2;
+        return 1;
+    }
+    if (strcmp(format, "--") == 0 && !(format = argv[2]))
+        return 1;
+    args = argv + (format == argv[1] ? 2 : 3);
+
+    do
+    {
+        char **before = args;
+        for (const char *s = format; *s;)
+        {
+            if (*s == '\\')
+            {
+                int n = _put_escape(s + 1, 0);
+                if (n < 0)
+                    return 1;
+                s += 1 + n;
+            }
+            else if (*s == '%' && s[1] == '%')
+            {
+                _put("%", 1);
+                s += 2;
+            }
+            else if (*s == '%')
+            {
+                size_t n = 1 + strspn(s + 1, "-+ #0123456789.*");
+                if (!s[n] || !strchr("diouxXfFeEgGaAcsb", s[n]))
+                {
+                    my_fprintf(stderr, "psh: printf: %.*s: invalid format\n", (int)n + (s[n] != 0), s);
+                    last_proc_exit_status = 1;
+                    return 1;
+                }
+                if (_printf_convert(s, n + 1, &args) < 0)
+                    return 1;
+                s += n + 1;
+            }
+            else
+            {
+                size_t n = strcspn(s, "\\%");
+                _put(s, n);
+                s += n;
+            }
+        }
+        if (args == before)
+            break;
+    } while (*args);
+    return 1;
+}
+
+/* Evaluation of test expressions, by recursive descent over the
+   arguments. A failed evaluation sets error and makes the status 2. */
+
+typedef struct Test_State
+{
+    char **argv;
+    int count;
+    int next;
+    int error;
+    const char *name;
+} Test_State;
+
+const char *test_unary = "bcdefghknprstuwxzGLOS";
+
+int _test_or(Test_State *t);
+
+void _test_error(Test_State *t, const char *arg, const char *message)
+{
+    if (!t->error)
+    {
+        if (arg)
+            my_fprintf(stderr, "psh: %s: %s: %s\n", t->name, arg, message);
+        else
+            my_fprintf(stderr, "psh: %s: %s\n", t->name, message);
+    }
+    t->error = 1;
+}
+
+int _test_is_binary(const char *op)
+{
+    const char *binary[] = {"=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt",
+                            "-ge", "-nt", "-ot", "-ef", NULL};
+    for (int i = 0; binary[i]; i++)
+        if (strcmp(op, binary[i]) == 0)
+            return 1;
+    return 0;
+}
+
+int _test_is_unary(const char *op)
+{
+    return op[0] == '-' && op[1] && !op[2] && strchr(test_unary, op[1]);
+}
+
+long long _test_integer(Test_State *t, const char *arg)
+{
+    char *end;
+    long long value;
+
+    errno = 0;
+    value = strtoll(arg, &end, 10);
+    while (isspace((unsigned char)*end))
+        end++;
+    if (end == arg || *end != '\0' || errno == ERANGE)
+        _test_error(t, arg, "integer expression expected");
+    return value;
+}
+
+int _test_file(char op, const char *path)
+{
+    struct stat st;
+
+    if (op == 'h' || op == 'L')
+        return lstat(path, &st) == 0 && S_ISLNK(st.st_mode);
+    if (op == 't')
+        return isatty(atoi(path));
+    if (op == 'r' || op == 'w' || op == 'x')
+        return access(path, op == 'r' ? R_OK : op == 'w' ? W_OK : X_OK) == 0;
+    if (stat(path, &st) != 0)
+        return 0;
+    switch (op)
+    {
+    case 'b':
+        return S_ISBLK(st.st_mode);
+    case 'c':
+        return S_ISCHR(st.st_mode);
+    case 'd':
+        return S_ISDIR(st.st_mode);
+    case 'f':
+        return S_ISREG(st.st_mode);
+    case 'p':
+        return S_ISFIFO(st.st_mode);
+    case 'S':
+        return S_ISSOCK(st.st_mode);
+    case 's':
+        return st.st_size > 0;
+    case 'g':
+        return (st.st_mode & S_ISGID) != 0;
+    case 'u':
+        return (st.st_mode & S_ISUID) != 0;
+    case 'k':
+        return (st.st_mode & S_ISVTX) != 0;
+    case 'O':
+        return st.st_uid == geteuid();
+    case 'G':
+        return st.st_gid == getegid();
+    default: /* -e */
+        return 1;
+    }
+}
+
+int _test_binary(Test_State *t, const char *left, const char *op, const char *right)
+{
+    struct stat a, b;
+    int have_a, have_b;
+
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0)
+        return strcmp(left, right) == 0;
+    if (strcmp(op, "!=") == 0)
+        return strcmp(left, right) != 0;
+    if (strcmp(op, "<") == 0)
+        return strcmp(left, right) < 0;
+    if (strcmp(op, ">") == 0)
+        return strcmp(left, right) > 0;
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0)
+    {
+        have_a = stat(left, &a) == 0;
+        have_b = stat(right, &b) == 0;
+        if (op[1] == 'e')
+            return have_a && have_b && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+        if (op[1] == 'o')
+        {
+            struct stat swap = a;
+            int have_swap = have_a;
+            a = b, have_a = have_b;
+            b = swap, have_b = have_swap;
+        }
+        if (!have_a)
+            return 0;
+        if (!have_b)
+            return 1;
+        return a.st_mtim.tv_sec > b.st_mtim.tv_sec ||
+               (a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec > b.st_mtim.tv_nsec);
+    }
+
+    long long l = _test_integer(t, left), r = _test_integer(t, right);
+    if (op[1] == 'e')
+        return op[2] == 'q' ? l == r : l >= r;
+    if (op[1] == 'n')
+        return l != r;
+    if (op[1] == 'l')
+        return op[2] == 't' ? l < r : l <= r;
+    return op[2] == 't' ? l > r : l >= r;
+}
+
+int _test_primary(Test_State *t)
+{
+    char **a = t->argv + t->next;
+    int left = t->count - t->next;
+
+    if (left <= 0)
+    {
+        _test_error(t, NULL, "argument expected");
+        return 0;
+    }
+    /* A binary operator in second place wins over the other readings. */
+    if (left >= 3 && _test_is_binary(a[1]))
+    {
+        t->next += 3;
+        return _test_binary(t, a[0], a[1], a[2]);
+    }
+    if (strcmp(a[0], "!") == 0 && left > 1)
+    {
+        t->next++;
+        return !_test_primary(t);
+    }
+    if (strcmp(a[0], "(") == 0 && left > 1)
+    {
+        int value;
+        t->next++;
+        value = _test_or(t);
+        if (t->next >= t->count || strcmp(t->argv[t->next], ")") != 0)
+            _test_error(t, NULL, "`)' expected");
+        t->next++;
+        return value;
+    }
+    if (_test_is_unary(a[0]) && left > 1)
+    {
+        t->next += 2;
+        if (a[0][1] == 'n' || a[0][1] == 'z')
+            return (a[1][0] != '\0') == (a[0][1] == 'n');
+        return _test_file(a[0][1], a[1]);
+    }
+    t->next++;
+    return a[0][0] != '\0';
+}
+
+int _test_and(Test_State *t)
+{
+    int value = _test_primary(t);
+    while (t->next < t->count && strcmp(t->argv[t->next], "-a") == 0)
+    {
+        t->next++;
+        value = _test_primary(t) && value;
+    }
+    return value;
+}
+
+int _test_or(Test_State *t)
+{
+    int value = _test_and(t);
+    while (t->next < t->count && strcmp(t->argv[t->next], "-o") == 0)
+    {
+        t->next++;
+        value = _test_and(t) || value;
+    }
+    return value;
+}
+
+/* Evaluate the expression of test, or of [ up to its closing ]. The
+   status is 0 if it is true, 1 if it is false and 2 on an error. */
+int psh_test(char **argv)
+{
+    Test_State t = {argv + 1, 0, 0, 0, argv[0]};
+    int value;
+
+    while (t.argv[t.count])
+        t.count++;
+    if (strcmp(argv[0], "[") == 0)
+    {
+        if (t.count == 0 || strcmp(t.argv[t.count - 1], "]") != 0)
+        {
+            my_fprintf(stderr, "psh: [: missing `]'\n");
+            last_proc_exit_status = 2;
+            return 1;
+        }
+        t.count--;
+    }
+    if (t.count == 0)
+    {
+        last_proc_exit_status = 1;
+        return 1;
+    }
+    value = _test_or(&t);
+    if (!t.error && t.next < t.count)
+        _test_error(&t, t.argv[t.next], "unexpected argument");
+    last_proc_exit_status = t.error ? 2 : !value;
+    return 1;
+}
+
+int psh_true(char **argv)
+{
+    return 1;
+}
+
+int psh_false(char **argv)
+{
+    last_proc_exit_status = 1;
+    return 1;
+}
+
+/* Write the current directory. */
+int psh_pwd(char **argv)
+{
+    char *cwd = getcwd(NULL, 0);
+    if (!cwd)
+    {
+        my_perror("psh: pwd");
+        last_proc_exit_status = 1;
+        return 1;
+    }
+    _put(cwd, strlen(cwd));
+    _put("\n", 1);
+    free(cwd);
+    return 1;
+}
@@ -0,0 +1,12 @@
+#ifndef UTILITIES_H
+#define UTILITIES_H
+
+int psh_echo(char **argv);
+int psh_printf(char **argv);
+int psh_test(char **argv);
+int psh_true(char **argv);
+int psh_false(char **argv);
+int psh_pwd(char **argv);
+void utility_flush();
+
+#endif
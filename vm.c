@@ -0,0 +1,504 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+#include "vm.h"
+#include "main.h"
+#include "env.h"
+#include "custom_print.h"
+
+/* Compound commands are compiled to bytecode once and run by a dispatch
+   loop, so the body of a loop is neither lexed nor parsed nor walked as a
+   tree again on each iteration. Loops remember the line arena position
+   at entry and release everything an iteration allocated before the next
+   one starts, so a loop runs in constant memory. Functions keep their
+   body and its code in an arena of their own. */
+
+#define FUNCTION_BUCKETS 64
+#define FUNCTION_DEPTH_MAX 1000
+#define CODE_INITIAL_SIZE 16
+
+extern int last_proc_exit_status;
+
+int vm_pending = 0;        /* VM_BREAK, VM_CONTINUE or VM_RETURN asked by a builtin */
+int vm_pending_count = 0;  /* number of loops to break or continue */
+int vm_loop_depth = 0;     /* loops running in the current function or at top level */
+int vm_function_depth = 0; /* function calls running */
+
+Function *functions[FUNCTION_BUCKETS];
+int function_count = 0;
+
+typedef struct Compiler
+{
+    Code *code;
+    Arena *arena;
+    int loops; /* loops around the code being compiled */
+    int cases;
+} Compiler;
+
+typedef struct Loop_Frame
+{
+    int exit;        /* the OP_POP of the loop */
+    int next;        /* where the next iteration starts */
+    int status;      /* status of the last iteration */
+    Arena_Mark mark; /* line arena position before the first iteration */
+    char **items;    /* items of a for loop */
+    int index;
+    char *var;
+} Loop_Frame;
+
+int _emit(Compiler *c, Op op, int slot, int arg, Node *node)
+{
+    Code *code = c->code;
+    Instr *instr;
+    if (code->count == code->size)
+    {
+        int size = code->size ? 2 * code->size : CODE_INITIAL_SIZE;
+        code->instrs = arena_grow(c->arena, code->instrs, code->size * sizeof(Instr), size * sizeof(Instr));
+        code->size = size;
+    }
+    instr = &code->instrs[code->count];
+    instr->op = op;
+    instr->slot = slot;
+    instr->arg = arg;
+    instr->node = node;
+    return code->count++;
+}
+
+/* Make the jump at the index go to the next instruction. */
+void _patch(Compiler *c, int index)
+{
+    c->code->instrs[index].arg = c->code->count;
+}
+
+void _compile(Compiler *c, Node *node, int background)
+{
+    int jump, start, ends[node->count + 1], n = 0;
+
+    switch (node->type)
+    {
+    case NODE_LIST:
+        for (int i = 0; i < node->count; i++)
+            _compile(c, node->children[i], (node->children[i]->flags & NODE_BACKGROUND) != 0);
+        break;
+    case NODE_AND:
+    case NODE_OR:
+        _compile(c, node->children[0], 0);
+        jump = _emit(c, node->type == NODE_AND ? OP_IF_FALSE : OP_IF_TRUE, 0, 0, NULL);
+        _compile(c, node->children[1], background);
+        _patch(c, jump);
+        break;
+    case NODE_PIPELINE:
+        if (node->children[0]->type == NODE_COMMAND)
+            _emit(c, OP_RUN, background, 0, node);
+        else
+        {
+            _compile(c, node->children[0], 0);
+            if (node->flags & NODE_INVERTED)
+                _emit(c, OP_NOT, 0, 0, NULL);
+        }
+        break;
+    case NODE_GROUP:
+        _compile(c, node->children[0], 0);
+        break;
+    case NODE_IF:
+        for (int i = 0; i + 1 < node->count; i += 2)
+        {
+            _compile(c, node->children[i], 0);
+            jump = _emit(c, OP_IF_FALSE, 0, 0, NULL);
+            _compile(c, node->children[i + 1], 0);
+            ends[n++] = _emit(c, OP_JUMP, 0, 0, NULL);
+            _patch(c, jump);
+        }
+        /* Without an else, an if whose conditions all failed succeeds. */
+        if (node->count % 2)
+            _compile(c, node->children[node->count - 1], 0);
+        else
+            _emit(c, OP_STATUS, 0, 0, NULL);
+        while (n--)
+            _patch(c, ends[n]);
+        break;
+    case NODE_WHILE:
+        if (++c->loops > c->code->loops)
+            c->code->loops = c->loops;
+        start = _emit(c, OP_LOOP, 0, 0, NULL);
+        _compile(c, node->children[0], 0);
+        jump = _emit(c, node->flags & NODE_UNTIL ? OP_IF_TRUE : OP_IF_FALSE, 0, 0, NULL);
+        _compile(c, node->children[1], 0);
+        _emit(c, OP_NEXT, 0, start + 1, NULL);
+        _patch(c, jump);
+        _patch(c, start);
+        _emit(c, OP_POP, 0, 0, NULL);
+        c->loops--;
+        break;
+    case NODE_FOR:
+        if (++c->loops > c->code->loops)
+            c->code->loops = c->loops;
+        start = _emit(c, OP_FOR, 0, 0, node);
+        jump = _emit(c, OP_ITER, 0, 0, NULL);
+        _compile(c, node->children[0], 0);
+        _emit(c, OP_NEXT, 0, jump, NULL);
+        _patch(c, jump);
+        _patch(c, start);
+        _emit(c, OP_POP, 0, 0, NULL);
+        c->loops--;
+        break;
+    case NODE_CASE:
+        if (++c->cases > c->code->cases)
+            c->code->cases = c->cases;
+        _emit(c, OP_CASE, c->cases - 1, 0, node);
+        for (int i = 0; i < node->count; i++)
+        {
+            Node *body = node->children[i]->children[0];
+            jump = _emit(c, OP_MATCH, c->cases - 1, 0, node->children[i]);
+            if (body->count)
+                _compile(c, body, 0);
+            else
+                _emit(c, OP_STATUS, 0, 0, NULL);
+            ends[n++] = _emit(c, OP_JUMP, 0, 0, NULL);
+            _patch(c, jump);
+        }
+        _emit(c, OP_STATUS, 0, 0, NULL);
+        while (n--)
+            _patch(c, ends[n]);
+        c->cases--;
+        break;
+    case NODE_FUNCTION:
+        _emit(c, OP_DEFINE, 0, 0, node);
+        break;
+    default:
+        break;
+    }
+}
+
+/* Compile the tree into code allocated in the arena. */
+void compile(Code *code, Arena *a, Node *node)
+{
+    Compiler c = {code, a, 0, 0};
+    memset(code, 0, sizeof(Code));
+    _compile(&c, node, 0);
+}
+
+/* Expand the items of a for loop, or take $1... without an in list. */
+char **_for_items(Node *node)
+{
+    char **items;
+    int n = 0;
+
+    if (node->flags & NODE_FOR_IN)
+    {
+        while (node->words[n + 1])
+            n++;
+        items = arena_alloc(&line_arena, (n + 1) * sizeof(char *));
+        memcpy(items, node->words + 1, (n + 1) * sizeof(char *));
+        items = expand(items, NULL);
+        for (int i = 0; items[i]; i++)
+            items[i] = remove_quotes(items[i]);
+        return items;
+    }
+
+    char *count = psh_getenv("#"), number[16];
+    n = count ? atoi(count) : 0;
+    items = arena_alloc(&line_arena, (n + 1) * sizeof(char *));
+    for (int i = 0; i < n; i++)
+    {
+        char *value;
+        snprintf(number, sizeof(number), "%d", i + 1);
+        value = psh_getenv(number);
+        items[i] = arena_strdup(&line_arena, value ? value : "");
+    }
+    items[n] = NULL;
+    return items;
+}
+
+/* Turn a case pattern into an fnmatch pattern, quoted characters match
+   themselves. */
+char *_case_pattern(const char *word)
+{
+    char *pattern = arena_alloc(&line_arena, 2 * strlen(word) + 1), *out = pattern;
+    char quote = 0;
+
+    for (; *word; word++)
+    {
+        if (quote && *word == quote)
+            quote = 0;
+        else if (quote)
+        {
+            if (strchr("*?[]\\", *word))
+                *out++ = '\\';
+            *out++ = *word;
+        }
+        else if (*word == '"' || *word == '\'')
+            quote = *word;
+        else if (*word == '\\' && word[1] != '\0')
+        {
+            *out++ = *word++;
+            *out++ = *word;
+        }
+        else
+            *out++ = *word;
+    }
+    *out = '\0';
+    return pattern;
+}
+
+int _case_match(Node *item, const char *subject)
+{
+    for (int i = 0; item->words[i]; i++)
+        if (fnmatch(_case_pattern(item->words[i]), subject, 0) == 0)
+            return 1;
+    return 0;
+}
+
+/* Drop the jobs and allocations of the iteration that ended. */
+void _recycle(Loop_Frame *f)
+{
+    do_job_notification();
+    promote_jobs();
+    arena_release(&line_arena, f->mark);
+}
+
+/* Run compiled code. Return 0 if the shell should exit. */
+int vm_run(Code *code)
+{
+    Loop_Frame frames[code->loops + 1], *f = NULL;
+    char *subjects[code->cases + 1];
+    int pc = 0, depth = 0, base = vm_loop_depth, status = 1;
+
+    while (pc < code->count)
+    {
+        Instr *instr = &code->instrs[pc++];
+        switch (instr->op)
+        {
+        case OP_RUN:
+            if (!run_pipeline(instr->node, instr->slot))
+            {
+                status = 0;
+                goto done;
+            }
+            if (vm_pending == VM_RETURN)
+                goto done;
+            if (vm_pending && depth == 0)
+                vm_pending = 0;
+            else if (vm_pending)
+            {
+                int n = vm_pending_count < depth ? vm_pending_count : depth;
+                depth -= n - 1;
+                vm_loop_depth = base + depth;
+                f = &frames[depth - 1];
+                _recycle(f);
+                if (vm_pending == VM_BREAK)
+                {
+                    f->status = 0;
+                    pc = f->exit;
+                }
+                else
+                    pc = f->next;
+                vm_pending = 0;
+            }
+            break;
+        case OP_JUMP:
+            pc = instr->arg;
+            break;
+        case OP_IF_FALSE:
+            if (last_proc_exit_status != 0)
+                pc = instr->arg;
+            break;
+        case OP_IF_TRUE:
+            if (last_proc_exit_status == 0)
+                pc = instr->arg;
+            break;
+        case OP_NOT:
+            last_proc_exit_status = !last_proc_exit_status;
+            break;
+        case OP_STATUS:
+            last_proc_exit_status = instr->arg;
+            break;
+        case OP_LOOP:
+        case OP_FOR:
+            f = &frames[depth++];
+            vm_loop_depth = base + depth;
+            f->items = instr->op == OP_FOR ? _for_items(instr->node) : NULL;
+            f->var = instr->op == OP_FOR ? instr->node->words[0] : NULL;
+            f->index = 0;
+            f->exit = instr->arg;
+            f->next = pc;
+            f->status = 0;
+            f->mark = arena_mark(&line_arena);
+            break;
+        case OP_ITER:
+            if (f->items[f->index])
+                psh_setenv(f->var, f->items[f->index++]);
+            else
+                pc = instr->arg;
+            break;
+        case OP_NEXT:
+            f->status = last_proc_exit_status;
+            _recycle(f);
+            pc = instr->arg;
+            break;
+        case OP_POP:
+            last_proc_exit_status = f->status;
+            depth--;
+            vm_loop_depth = base + depth;
+            f = depth ? &frames[depth - 1] : NULL;
+            break;
+        case OP_CASE:
+            subjects[instr->slot] = expand_word(instr->node->words[0]);
+            break;
+        case OP_MATCH:
+            if (!_case_match(instr->node, subjects[instr->slot]))
+                pc = instr->arg;
+            break;
+        case OP_DEFINE:
+            define_function(instr->node);
+            last_proc_exit_status = 0;
+            break;
+        }
+    }
+done:
+    vm_loop_depth = base;
+    return status;
+}
+
+/* Compile and run a compound command of the line. */
+int run_compound(Node *node)
+{
+    Code code;
+    if (node->type == NODE_FUNCTION)
+    {
+        define_function(node);
+        last_proc_exit_status = 0;
+        return 1;
+    }
+    compile(&code, &line_arena, node);
+    return vm_run(&code);
+}
+
+unsigned int _function_hash(const char *name)
+{
+    unsigned int h = 5381;
+    while (*name)
+        h = h * 33 + (unsigned char)*name++;
+    return h % FUNCTION_BUCKETS;
+}
+
+void _free_function(Function *f)
+{
+    arena_free(&f->arena);
+    free(f);
+}
+
+Function *find_function(const char *name)
+{
+    if (!function_count || !name)
+        return NULL;
+    for (Function *f = functions[_function_hash(name)]; f; f = f->next)
+        if (strcmp(f->name, name) == 0)
+            return f;
+    return NULL;
+}
+
+/* Define or redefine a function. Its body is copied out of the line and
+   compiled once. */
+void define_function(Node *node)
+{
+    Function *f = malloc(sizeof(Function)), **link;
+    unsigned int h = _function_hash(node->words[0]);
+
+    if (!f)
+    {
+        my_fprintf(stderr, "psh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(f, 0, sizeof(Function));
+    f->arena.block_size = 1024;
+    f->name = arena_strdup(&f->arena, node->words[0]);
+    compile(&f->code, &f->arena, node_copy(&f->arena, node->children[0]));
+
+    for (link = &functions[h]; *link; link = &(*link)->next)
+        if (strcmp((*link)->name, f->name) == 0)
+        {
+            Function *old = *link;
+            *link = old->next;
+            function_count--;
+            if (old->users)
+                old->retired = 1;
+            else
+                _free_function(old);
+            break;
+        }
+    f->next = functions[h];
+    functions[h] = f;
+    function_count++;
+}
+
+/* Set $1... to the values, unsetting those up to previous, and $#. */
+void _set_arguments(char **values, int count, int previous)
+{
+    char number[16];
+    for (int i = 1; i <= count || i <= previous; i++)
+    {
+        snprintf(number, sizeof(number), "%d", i);
+        if (i <= count && values[i - 1])
+            psh_setenv(number, values[i - 1]);
+        else
+            psh_unsetenv(number);
+    }
+    snprintf(number, sizeof(number), "%d", count);
+    psh_setenv("#", number);
+}
+
+/* Run a function with argv[1]... as its positional parameters.
+   Return 0 if the shell should exit. */
+int call_function(Function *f, char **argv)
+{
+    char *value = psh_getenv("#"), number[16], **saved;
+    int previous = value ? atoi(value) : 0, argc = 0, loops = vm_loop_depth, status;
+
+    if (vm_function_depth >= FUNCTION_DEPTH_MAX)
+    {
+        my_fprintf(stderr, "psh: %s: maximum function nesting level exceeded\n", f->name);
+        last_proc_exit_status = 1;
+        return 1;
+    }
+
+    saved = arena_alloc(&line_arena, (previous + 1) * sizeof(char *));
+    for (int i = 0; i < previous; i++)
+    {
+        snprintf(number, sizeof(number), "%d", i + 1);
+        value = psh_getenv(number);
+        saved[i] = value ? arena_strdup(&line_arena, value) : NULL;
+    }
+    while (argv[argc + 1])
+        argc++;
+    _set_arguments(argv + 1, argc, previous);
+
+    f->users++;
+    vm_function_depth++;
+    vm_loop_depth = 0;
+    status = vm_run(&f->code);
+    vm_loop_depth = loops;
+    vm_function_depth--;
+    env_pop_locals(vm_function_depth);
+    f->users--;
+    /* break and continue do not reach the loops of the caller. */
+    vm_pending = 0;
+
+    _set_arguments(saved, previous, argc);
+    if (f->retired && !f->users)
+        _free_function(f);
+    return status;
+}
+
+void free_functions()
+{
+    for (int i = 0; i < FUNCTION_BUCKETS; i++)
+        while (functions[i])
+        {
+            Function *f = functions[i];
+            functions[i] = f->next;
+            _free_function(f);
+        }
+    function_count = 0;
+}
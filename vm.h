@@ -0,0 +1,71 @@
+#include "arena.h"
+#include "parser.h"
+
+#ifndef VM_H
+#define VM_H
+
+typedef enum Op
+{
+    OP_RUN,      /* run the simple pipeline node, slot is 1 in the background */
+    OP_JUMP,     /* go to arg */
+    OP_IF_FALSE, /* go to arg if the last status is not 0 */
+    OP_IF_TRUE,  /* go to arg if the last status is 0 */
+    OP_NOT,      /* invert the last status */
+    OP_STATUS,   /* set the last status to arg */
+    OP_LOOP,     /* enter a while loop that exits at arg */
+    OP_FOR,      /* expand the items of the for node and enter a loop that exits at arg */
+    OP_ITER,     /* set the variable to the next item, or go to arg after the last one */
+    OP_NEXT,     /* end of an iteration, free what it allocated and go to arg */
+    OP_POP,      /* leave the innermost loop */
+    OP_CASE,     /* expand the subject of the case node into slot */
+    OP_MATCH,    /* go to arg unless a pattern of the item node matches slot */
+    OP_DEFINE    /* define the function node */
+} Op;
+
+typedef struct Instr
+{
+    unsigned short op;
+    unsigned short slot;
+    int arg;
+    Node *node;
+} Instr;
+
+/* Compiled compound command. */
+typedef struct Code
+{
+    Instr *instrs;
+    int count;
+    int size;
+    int loops; /* deepest loop nesting */
+    int cases; /* deepest case nesting */
+} Code;
+
+typedef struct Function
+{
+    struct Function *next;
+    char *name;
+    Code code;
+    Arena arena; /* holds the body and its code */
+    int users;   /* calls running the function */
+    int retired; /* redefined while running, freed when the last call returns */
+} Function;
+
+/* Requests of the break, continue and return builtins. */
+#define VM_BREAK 1
+#define VM_CONTINUE 2
+#define VM_RETURN 3
+
+extern int vm_pending;
+extern int vm_pending_count;
+extern int vm_loop_depth;
+extern int vm_function_depth;
+
+void compile(Code *code, Arena *a, Node *node);
+int vm_run(Code *code);
+int run_compound(Node *node);
+void define_function(Node *node);
+Function *find_function(const char *name);
+int call_function(Function *f, char **argv);
+void free_functions();
+
+#endif